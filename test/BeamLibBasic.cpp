@@ -86,113 +86,116 @@ int BSemaphore::getValue() const {
 	return v;
 }
 
-// Simple Byte Fifo implementation
-
-// The BFifoBytes functions
-BFifoBytes::BFifoBytes(BUInt size){
-	osize = size;
-	odata = new char [osize];
-	owritePos = 0;
-	oreadPos = 0;
+// Single producer, single consumer byte ring implementation
+BFifoRing::BFifoRing(BUInt size){
+	odata = 0;
+	resize(size);
 }
 
-BFifoBytes::~BFifoBytes(){
+BFifoRing::~BFifoRing(){
 	delete [] odata;
 	odata = 0;
 	osize = 0;
-	owritePos = 0;
-	oreadPos = 0;
+	omask = 0;
 }
 
-void BFifoBytes::clear(){
-	owritePos = 0;
-	oreadPos = 0;
+void BFifoRing::clear(){
+	__atomic_store_n(&owritePos, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&oreadPos, 0, __ATOMIC_RELEASE);
+	oreadPosCache = 0;
+	owritePosCache = 0;
 }
 
-BUInt BFifoBytes::size(){
+BUInt BFifoRing::size(){
 	return osize;
 }
 
-int BFifoBytes::resize(BUInt size){
-	int	err = 0;
-	
+int BFifoRing::resize(BUInt size){
 	delete [] odata;
-	osize = size;
+	for(osize = BCacheLineSize; osize < size; osize <<= 1)
+		;
+	omask = osize - 1;
 	odata = new char [osize];
-	owritePos = 0;
-	oreadPos = 0;
+	clear();
 	
-	return err;
+	return 0;
+}
+
+// The producer's functions. The read position is only refetched when the cached copy shows too little space.
+BUInt BFifoRing::writeAvailable(){
+	oreadPosCache = __atomic_load_n(&oreadPos, __ATOMIC_ACQUIRE);
+	return osize - (owritePos - oreadPosCache);
 }
 
-BUInt BFifoBytes::writeAvailable(){
-	BUInt	readPos = oreadPos;
+void* BFifoRing::writeReserve(BUInt num){
+	BUInt	pos = owritePos & omask;
 
-	if(readPos <= owritePos)
-		return osize - owritePos + readPos - 1;
-	else
-		return (readPos - owritePos - 1);
+	if(num > (osize - pos))
+		return 0;
+	if(((osize - (owritePos - oreadPosCache)) < num) && (writeAvailable() < num))
+		return 0;
+
+	return &odata[pos];
 }
 
-int BFifoBytes::write(const void* data, BUInt num){
-	int	err = 0;
-	char*	d = (char*)data;
-	BUInt	nt;
+void BFifoRing::writeCommit(BUInt num){
+	__atomic_store_n(&owritePos, owritePos + num, __ATOMIC_RELEASE);
+}
 
-	while(num){
-		nt = num;
-		if(nt > (osize - owritePos))
-			nt = (osize - owritePos);
-		
-		memcpy(&odata[owritePos], d, nt);
+int BFifoRing::write(const void* data, BUInt num){
+	const char*	d = (const char*)data;
+	BUInt		pos = owritePos & omask;
+	BUInt		nt;
 
-		if((owritePos + nt) == osize)
-			owritePos = 0;
-		else
-			owritePos += nt;
+	if(((osize - (owritePos - oreadPosCache)) < num) && (writeAvailable() < num))
+		return 1;
 
-		d += nt;
-		num -= nt;
-	}
-		
-	return err;
+	nt = ((osize - pos) < num) ? (osize - pos) : num;
+	memcpy(&odata[pos], d, nt);
+	memcpy(odata, d + nt, num - nt);
+	writeCommit(num);
+
+	return 0;
 }
 
-BUInt BFifoBytes::readAvailable(){
-	BUInt		writePos = owritePos;
-	
-	if(oreadPos <= writePos)
-		return writePos - oreadPos;
-	else
-		return osize - oreadPos + writePos;
+// The consumer's functions. The write position is only refetched when the cached copy shows too little data.
+BUInt BFifoRing::readAvailable(){
+	owritePosCache = __atomic_load_n(&owritePos, __ATOMIC_ACQUIRE);
+	return owritePosCache - oreadPos;
+}
+
+void* BFifoRing::readPeek(BUInt num, BUInt offset){
+	BUInt	pos = (oreadPos + offset) & omask;
+
+	if(num > (osize - pos))
+		return 0;
+	if(((owritePosCache - oreadPos) < (offset + num)) && (readAvailable() < (offset + num)))
+		return 0;
+
+	return &odata[pos];
 }
 
-int BFifoBytes::read(void* data, BUInt num){
-	int	err = 0;
+void BFifoRing::readRelease(BUInt num){
+	__atomic_store_n(&oreadPos, oreadPos + num, __ATOMIC_RELEASE);
+}
+
+int BFifoRing::read(void* data, BUInt num){
 	char*	d = (char*)data;
+	BUInt	pos = oreadPos & omask;
 	BUInt	nt;
 
-	while(num){
-		nt = num;
-		if(nt > (osize - oreadPos))
-			nt = (osize - oreadPos);
-		
-		memcpy(d, &odata[oreadPos], nt);
-
-		if((oreadPos + nt) == osize)
-			oreadPos = 0;
-		else
-			oreadPos += nt;
+	if(((owritePosCache - oreadPos) < num) && (readAvailable() < num))
+		return 1;
 
-		d += nt;
-		num -= nt;
-	}
+	nt = ((osize - pos) < num) ? (osize - pos) : num;
+	memcpy(d, &odata[pos], nt);
+	memcpy(d + nt, odata, num - nt);
+	readRelease(num);
 
-	return err;
+	return 0;
 }
 
 
-
 void tprintf(const char* fmt, ...){
 	va_list		args;
 	char		tbuf[64];
@@ -102,28 +102,42 @@ private:
 	sem_t			osema;
 };
 
-// Simple Byte Fifo
-class BFifoBytes {
+const BUInt	BCacheLineSize = 64;			///< The CPU cache line size in bytes
+
+/// Single producer, single consumer byte ring.
+/// The ring is lock free. One thread may write while another reads, with acquire/release ordering on the positions
+/// so that it is correct on weakly ordered CPUs. The positions are free running and masked by the power of two size.
+/// Each thread's position is kept on its own cache line with a cached copy of the other thread's position.
+/// Data may be written and read in place using writeReserve()/writeCommit() and readPeek()/readRelease().
+class BFifoRing {
 public:
-			BFifoBytes(BUInt size);
-			~BFifoBytes();
+			BFifoRing(BUInt size);
+			~BFifoRing();
 
-	void		clear();
+	void		clear();					///< Clear the ring. Only when neither thread is accessing it
 
-	BUInt		size();						///< Returns fifo size
-	int		resize(BUInt size);				///< Resize FIFO, clears it as well
+	BUInt		size();						///< Returns ring size
+	int		resize(BUInt size);				///< Resize ring to the power of two at or above size, clears it as well
 
-	BUInt		writeAvailable();				///< How many items that can be written
-	int		write(const void* data, BUInt num);		///< Write a set of items. Can only write a maximum of writeAvailableChunk() to save going beyond end of FIFO buffer
+	BUInt		writeAvailable();				///< How many bytes can be written
+	void*		writeReserve(BUInt num);			///< Contiguous space for num bytes at the write position. Returns 0 if not available
+	void		writeCommit(BUInt num);				///< Add bytes that have been written in place
+	int		write(const void* data, BUInt num);		///< Write bytes. Returns 1, writing nothing, if there is not enough space
 
-	BUInt		readAvailable();				///< How many items are available to read
-	int		read(void* data, BUInt num);			///< Read a set of items
+	BUInt		readAvailable();				///< How many bytes are available to read
+	void*		readPeek(BUInt num, BUInt offset = 0);		///< The num contiguous bytes offset bytes on from the read position. Returns 0 if not available
+	void		readRelease(BUInt num);				///< Remove bytes that have been accessed in place
+	int		read(void* data, BUInt num);			///< Read bytes. Returns 1, reading nothing, if not enough are available
 
 protected:
-	BUInt		osize;						///< The size of the FIFO
-	char*		odata;						///< FIFO memory buffer
-	volatile BUInt	owritePos;					///< The write pointer
-	volatile BUInt	oreadPos;					///< The read pointer
+	BUInt		osize;						///< The size of the ring, a power of two
+	BUInt		omask;						///< The position mask
+	char*		odata;						///< Ring memory buffer
+	alignas(BCacheLineSize) BUInt	owritePos;			///< The write position, written by the producer
+	BUInt		oreadPosCache;					///< The producer's copy of the read position
+	alignas(BCacheLineSize) BUInt	oreadPos;			///< The read position, written by the consumer
+	BUInt		owritePosCache;					///< The consumer's copy of the write position
+	char		opad[BCacheLineSize - 2 * sizeof(BUInt)];
 };
 
 
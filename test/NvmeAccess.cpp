@@ -74,94 +74,191 @@ static void* nvmeProcess(void* arg){
 }
 
 NvmeAccess::NvmeAccess(){
-	oregsFd = -1;
-	ohostSendFd = -1;
-	ohostRecvFd = -1;
-	oregs = 0;
+	BUInt	n;
+	BUInt	q;
+	BUInt	t;
+
+	otransport = 0;
 	obufTx = 0;
+	obatchSize = 0;
+	otxUsed = 0;
+	pthread_mutex_init(&otxLock, 0);
 	obufRx = 0;
 	otag = 0;
+	otagsFree = NvmeMaxTags;
+	for(t = 0; t < NvmeMaxTags; t++)
+		otags[t].inUse = 0;
+	pthread_mutex_init(&otagsLock, 0);
+	pthread_cond_init(&otagsCond, 0);
 	onvmeNum = 0;
 	onvmeRegbase = 0x100;
-	oqueueNum = 16;
+	oqueueNum = NvmeQueueEngineNum;
 	oqueueAdminRx = 0;
 	oqueueAdminTx = 0;
-	oqueueAdminId = 0;
 	oqueueDataRx = 0;
 	oqueueDataTx = 0;
+	for(n = 0; n < 2; n++){
+		odevices[n].num = n;
+		odevices[n].regbase = n ? 0x200 : 0x100;
+		odevices[n].busAddress = n ? 0x10000000 : 0x00000000;
+		for(q = 0; q < NvmeMaxQueues; q++){
+			odevices[n].queues[q].cmdId = 0;
+			odevices[n].queues[q].cmdsFree = NvmeMaxCommands;
+			odevices[n].queues[q].queued = 0;
+			for(t = 0; t < NvmeMaxCommands; t++)
+				odevices[n].queues[q].cmds[t].inUse = 0;
+			pthread_mutex_init(&odevices[n].queues[q].lock, 0);
+			pthread_cond_init(&odevices[n].queues[q].cond, 0);
+		}
+		odevices[n].maxTransfer = 2 * NvmePageSize;
+		odevices[n].sgl = 0;
+		memset(odevices[n].identifyMem, 0, sizeof(odevices[n].identifyMem));
+	}
+	oioQueues = 2;
+	olistMem = new BUInt32[2 * NvmeMaxQueues * NvmeMaxCommands * NvmeListSize / 4];
+	memset(olistMem, 0, 2 * NvmeMaxQueues * NvmeMaxCommands * NvmeListSize);
+	oslotsMem = 0;
+	oslotsNum = 32;
+	oslotsHuge = 0;
+	oslotsMemSize = 0;
+	oslotsFreeNum = 0;
+	oslotsErrors = 0;
+	pthread_mutex_init(&oslotsLock, 0);
+	pthread_cond_init(&oslotsCond, 0);
+
+	oregionsNum = 0;
+	memset(oregionMap, 0, sizeof(oregionMap));
+	nvmeRegionAdd(0x00000000, sizeof(oqueueAdminMem), NvmeRegionRead, oqueueAdminMem);
+	nvmeRegionAdd(0x00010000, sizeof(oqueueDataMem), NvmeRegionRead, oqueueDataMem);
+	nvmeRegionAdd(0x00100000, 0x10000, NvmeRegionWrite, 0, &NvmeAccess::nvmeAdminCompletion);
+	nvmeRegionAdd(0x00110000, (NvmeMaxQueues - 1) * 0x10000, NvmeRegionWrite, 0, &NvmeAccess::nvmeIoCompletion);
+	nvmeRegionAdd(0x00800000, sizeof(odataBlockMem), NvmeRegionRead | NvmeRegionWrite, odataBlockMem);
+	nvmeRegionAdd(0x00900000, sizeof(odevices[0].identifyMem), NvmeRegionRead | NvmeRegionWrite, odevices[0].identifyMem);
+	nvmeRegionAdd(0x00910000, sizeof(odevices[1].identifyMem), NvmeRegionRead | NvmeRegionWrite, odevices[1].identifyMem);
+	nvmeRegionAdd(0x00C00000, 2 * NvmeMaxQueues * NvmeMaxCommands * NvmeListSize, NvmeRegionRead, olistMem);
+	nvmeRegionAdd(0x00E00000, sizeof(odataBlockMem), NvmeRegionRead | NvmeRegionWrite, odataBlockMem);
+	nvmeRegionAdd(0x00F00000, 0x00100000, NvmeRegionWrite, 0, &NvmeAccess::nvmeStreamData);
 }
 
 NvmeAccess::~NvmeAccess(){
+	BUInt	n;
+	BUInt	q;
+
 	close();
+	delete otransport;
+	otransport = 0;
+	pthread_cond_destroy(&otagsCond);
+	pthread_mutex_destroy(&otagsLock);
+	pthread_mutex_destroy(&otxLock);
+	for(n = 0; n < 2; n++){
+		for(q = 0; q < NvmeMaxQueues; q++){
+			pthread_cond_destroy(&odevices[n].queues[q].cond);
+			pthread_mutex_destroy(&odevices[n].queues[q].lock);
+		}
+	}
+	pthread_cond_destroy(&oslotsCond);
+	pthread_mutex_destroy(&oslotsLock);
+	delete [] olistMem;
+	if(oslotsHuge)
+		munmap(oslotsMem, oslotsMemSize);
+	else
+		free(oslotsMem);
 }
 
-void NvmeAccess::close(){
-	if(obufRx)
-		free(obufRx);
-	if(obufTx)
-		free(obufTx);
+void NvmeAccess::setTransport(NvmeTransport* transport){
+	delete otransport;
+	otransport = transport;
+}
 
-	if(odmaRegs)
-		munmap((void*)odmaRegs, 4096);
-	if(oregs)
-		munmap((void*)oregs, 4096);
-	
-	if(ohostRecvFd >= 0)
-		::close(ohostRecvFd);
-	if(ohostSendFd >= 0)
-		::close(ohostSendFd);
-	if(oregsFd >= 0)
-		::close(oregsFd);
+void NvmeAccess::setSendBatch(BUInt nbytes){
+	// A batch needs to hold at least the largest packet
+	if(nbytes && (nbytes < sizeof(NvmeRequestPacket)))
+		nbytes = sizeof(NvmeRequestPacket);
+	if(nbytes > 65536)
+		nbytes = 65536;
+
+	obatchSize = nbytes;
 }
 
+void NvmeAccess::setDataSlots(BUInt num, Bool hugePages){
+	if(num < 1)
+		num = 1;
+	if(num > NvmeSlotsMax)
+		num = NvmeSlotsMax;
 
-int NvmeAccess::init(){
-	int	r;
+	oslotsNum = num;
+	oslotsHuge = hugePages;
+}
 
-	if((oregsFd = open("/dev/bfpga0", O_RDWR | O_SYNC)) < 0){
-		fprintf(stderr, "Unable to open /dev/bfpga0\n");
-		return 1;
-	}
+void NvmeAccess::setIoQueues(BUInt num){
+	if(num < 1)
+		num = 1;
+	if(num > (NvmeMaxQueues - 1))
+		num = NvmeMaxQueues - 1;
 
-	if((r = ioctl(oregsFd, BFPGA_CMD_GETINFO, &oinfo)) < 0){
-		fprintf(stderr, "Error ioctl: %s\n", strerror(errno));
-		return 1;
-	}
-	dl1printf("Driver Register Addresses: %x(%x)\n", oinfo.regs.physAddress, oinfo.regs.length);
+	oioQueues = num;
+}
 
-	if((oregs = (volatile BUInt32*)mmap(0, oinfo.regs.length, PROT_READ|PROT_WRITE, MAP_SHARED, oregsFd, oinfo.regs.physAddress)) == 0){
-		fprintf(stderr, "Error mmap: %s\n", strerror(errno));
-		return 1;
-	}
-	
-	if((odmaRegs = (volatile BUInt32*)mmap(0, oinfo.dmaRegs.length, PROT_READ|PROT_WRITE, MAP_SHARED, oregsFd, oinfo.dmaRegs.physAddress)) == 0){
-		fprintf(stderr, "Error mmap: %s\n", strerror(errno));
-		return 1;
-	}
+BUInt NvmeAccess::getIoQueues(){
+	return oioQueues;
+}
 
+void NvmeAccess::close(){
+	if(otransport)
+		otransport->close();
 
-	if((ohostSendFd = open("/dev/bfpga0-send0", O_RDWR)) < 0){
-		fprintf(stderr, "Unable to open /dev/bfpga0-send0\n");
-		return 1;
-	}
+	// Note the receive buffer is not freed as the nvmeProcess thread may still be using it
+	pthread_mutex_lock(&otxLock);
+	if(obufTx)
+		free(obufTx);
+	obufTx = 0;
+	otxUsed = 0;
+	pthread_mutex_unlock(&otxLock);
+}
 
-	if((ohostRecvFd = open("/dev/bfpga0-recv0", O_RDWR)) < 0){
-		fprintf(stderr, "Unable to open /dev/bfpga0-recv0\n");
-		return 1;
+
+int NvmeAccess::init(){
+	int	e;
+	BUInt	s;
+
+	if(!otransport)
+		otransport = new NvmeTransportBfpga();
+
+	if(e = otransport->open())
+		return e;
+
+	posix_memalign((void **)&obufTx, 4096, (obatchSize > 4096) ? obatchSize : 4096);
+	posix_memalign((void **)&obufRx, 4096, NvmeRecvBufferSize);
+
+	// The host data slots, using huge pages if requested and available
+	oslotsMemSize = oslotsNum * NvmeSlotSize;
+	if(oslotsHuge){
+		oslotsMemSize = (oslotsMemSize + 0x1FFFFF) & ~0x1FFFFF;
+		oslotsMem = (BUInt32*)mmap(0, oslotsMemSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(oslotsMem == MAP_FAILED){
+			printf("NvmeAccess::init: Warning: huge pages not available for the data slots\n");
+			oslotsMem = 0;
+			oslotsHuge = 0;
+			oslotsMemSize = oslotsNum * NvmeSlotSize;
+		}
 	}
+	if(!oslotsMem)
+		posix_memalign((void **)&oslotsMem, 4096, oslotsMemSize);
+	
+	for(s = 0; s < oslotsNum; s++)
+		oslotsFree[s] = oslotsNum - 1 - s;
+	oslotsFreeNum = oslotsNum;
 
-	posix_memalign((void **)&obufTx, 4096, 4096);
-	posix_memalign((void **)&obufRx, 4096, 4096);
+	if(e = nvmeRegionAdd(NvmeSlotsAddress, oslotsNum * NvmeSlotSize, NvmeRegionRead | NvmeRegionWrite, oslotsMem))
+		return e;
 	
 	return 0;
 }
 
 void NvmeAccess::setNvme(BUInt n){
 	onvmeNum = n;
-	if(onvmeNum == 0)
-		onvmeRegbase = 0x100;
-	else if(onvmeNum == 1)
-		onvmeRegbase = 0x200;
+	if(onvmeNum < 2)
+		onvmeRegbase = odevices[onvmeNum].regbase;
 	else
 		onvmeRegbase = 0x000;
 }
@@ -170,6 +267,22 @@ BUInt NvmeAccess::getNvme(){
 	return onvmeNum;
 }
 
+/// When both Nvme's are selected the current Nvme for single Nvme operations is Nvme0
+BUInt NvmeAccess::nvmeDevice(int nvme){
+	if(nvme < 0)
+		return (onvmeNum == 1) ? 1 : 0;
+	else
+		return nvme ? 1 : 0;
+}
+
+BUInt32 NvmeAccess::nvmeIdentifyAddress(BUInt nvme){
+	return 0x01000000 | (0x00900000 + (nvmeDevice(nvme) * 0x10000));
+}
+
+BUInt32* NvmeAccess::nvmeIdentifyData(BUInt nvme){
+	return odevices[nvmeDevice(nvme)].identifyMem;
+}
+
 #if LDEBUG1
 void NvmeAccess::reset(){
 	BUInt32	data;
@@ -239,13 +352,239 @@ void NvmeAccess::start(){
 }
 
 // Send a queued request to the Nvme
-int NvmeAccess::nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12){
+int NvmeAccess::nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, int nvme){
+	int	e;
+	BUInt	id;
+
+	if(!wait)
+		return nvmeSubmit(1, nvmeDevice(nvme), queue, opcode, nameSpace, address, arg10, arg11, arg12, id);
+
+	if(e = nvmeSubmit(0, nvmeDevice(nvme), queue, opcode, nameSpace, address, arg10, arg11, arg12, id))
+		return e;
+
+	// Errors in the completion status are also reported by nvmeProcess()
+	return nvmeRequestWait(id);
+}
+
+int NvmeAccess::nvmeRequestStart(int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id){
+	return nvmeSubmit(0, nvmeDevice(-1), queue, opcode, nameSpace, address, arg10, arg11, arg12, id);
+}
+
+int NvmeAccess::nvmeRequestStartNvme(BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id){
+	return nvmeSubmit(0, nvme, queue, opcode, nameSpace, address, arg10, arg11, arg12, id);
+}
+
+int NvmeAccess::nvmeRequestStartSgl(BUInt nvme, int queue, int opcode, BUInt nameSpace, const NvmeSgl* sgl, BUInt num, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id){
+	return nvmeSubmit(0, nvme, queue, opcode, nameSpace, 0, arg10, arg11, arg12, id, sgl, num);
+}
+
+int NvmeAccess::nvmeRequestSlot(BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt slot, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12){
 	int	e;
-	BUInt32	cmd[16];
-	BUInt32	nvmeAddress;
+	BUInt	id;
+	
+	if(e = nvmeSubmit(1, nvme, queue, opcode, nameSpace, nvmeSlotAddress(slot), arg10, arg11, arg12, id, 0, 0, slot))
+		nvmeSlotFree(slot);
+
+	return e;
+}
+
+int NvmeAccess::nvmeRequestWait(BUInt id, BUInt32* completion){
+	NvmeQueue*	q = &odevices[(id >> 10) & 1].queues[(id >> 8) & 3];
+	NvmeCommand*	c = &q->cmds[id & 0xFF];
+	int		status;
+
+	c->sem.wait();
+
+	pthread_mutex_lock(&q->lock);
+	status = c->completion[3] >> 17;
+	if(completion)
+		memcpy(completion, c->completion, sizeof(c->completion));
+	c->inUse = 0;
+	q->cmdsFree++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return status;
+}
+
+BUInt NvmeAccess::nvmeQueueSlots(int queue){
+	NvmeQueue*	q;
+	BUInt		n;
+
+	if((queue < 0) || (queue >= (int)NvmeMaxQueues))
+		return 0;
+
+	q = &odevices[nvmeDevice(-1)].queues[queue];
+	pthread_mutex_lock(&q->lock);
+	n = (oqueueNum - 1) - q->queued;
+	pthread_mutex_unlock(&q->lock);
+
+	return n;
+}
+
+/// The IO read and write command transfer size is limited by the Nvme's MDTS, the commands number of blocks field and,
+/// when PRP's are used, the single PRP list per command.
+BUInt32 NvmeAccess::nvmeMaxTransfer(BUInt nvme){
+	BUInt32	n = odevices[nvme].sgl ? (65536 * NvmeLbaSize) : (NvmePrpListEntries * NvmePageSize);
+
+	if(odevices[nvme].maxTransfer && (odevices[nvme].maxTransfer < n))
+		n = odevices[nvme].maxTransfer;
+
+	return n;
+}
+
+/// The regions are found from the Nvme's bus master addresses using a map of the 64k blocks of the host's 16 MByte
+/// address window, so the number of regions does not affect the time to dispatch an access.
+int NvmeAccess::nvmeRegionAdd(BUInt32 base, BUInt32 size, BUInt access, BUInt32* data, NvmeRegionHandler handler){
+	NvmeRegion*	region;
+	BUInt		b;
+
+	if((oregionsNum >= NvmeMaxRegions) || (base & 0xFFFF) || !size || ((base + size) > 0x01000000) || (!data && !handler)){
+		printf("NvmeAccess::nvmeRegionAdd: Error bad region: base: 0x%8.8x size: 0x%x\n", base, size);
+		return 1;
+	}
+
+	for(b = base >> 16; b < ((base + size + 0xFFFF) >> 16); b++){
+		if(oregionMap[b]){
+			printf("NvmeAccess::nvmeRegionAdd: Error region overlaps: base: 0x%8.8x size: 0x%x\n", base, size);
+			return 1;
+		}
+	}
+
+	region = &oregions[oregionsNum++];
+	region->base = base;
+	region->size = size;
+	region->access = access;
+	region->data = data;
+	region->handler = handler;
+
+	for(b = base >> 16; b < ((base + size + 0xFFFF) >> 16); b++)
+		oregionMap[b] = region;
+
+	return 0;
+}
+
+BUInt NvmeAccess::nvmeSlotsNum(){
+	return oslotsNum;
+}
+
+/// The data slots are allocated and freed by the host threads issuing commands. A slot used by a command submitted
+/// with nvmeRequestSlot() is freed by nvmeProcess when the command completes.
+int NvmeAccess::nvmeSlotAllocate(BUInt& slot){
+	if(!oslotsNum || !oslotsMem){
+		printf("NvmeAccess::nvmeSlotAllocate: Error no data slots\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&oslotsLock);
+	while(!oslotsFreeNum)
+		pthread_cond_wait(&oslotsCond, &oslotsLock);
+	slot = oslotsFree[--oslotsFreeNum];
+	pthread_mutex_unlock(&oslotsLock);
+
+	return 0;
+}
+
+void NvmeAccess::nvmeSlotFree(BUInt slot){
+	pthread_mutex_lock(&oslotsLock);
+	oslotsFree[oslotsFreeNum++] = slot;
+	pthread_cond_broadcast(&oslotsCond);
+	pthread_mutex_unlock(&oslotsLock);
+}
+
+/// Used after commands submitted with nvmeRequestSlot(), whose completions are not waited for, to wait for them all
+/// to complete.
+int NvmeAccess::nvmeSlotsWait(){
+	int	n;
+
+	pthread_mutex_lock(&oslotsLock);
+	while(oslotsFreeNum != oslotsNum)
+		pthread_cond_wait(&oslotsCond, &oslotsLock);
+	n = oslotsErrors;
+	oslotsErrors = 0;
+	pthread_mutex_unlock(&oslotsLock);
+
+	return n;
+}
+
+BUInt32* NvmeAccess::nvmeSlotData(BUInt slot){
+	return &oslotsMem[slot * (NvmeSlotSize / 4)];
+}
+
+BUInt32 NvmeAccess::nvmeSlotAddress(BUInt slot){
+	return 0x01000000 | (NvmeSlotsAddress + (slot * NvmeSlotSize));
+}
+
+Bool NvmeAccess::nvmeSglSupported(BUInt nvme){
+	return odevices[nvme].sgl;
+}
+
+/// Commands are identified by the Nvme's command identifier. The top 8 bits of this are used by the queue engine to
+/// route the completion to the host, the bottom 8 bits identify the command within its queue. The handle returned
+/// is (nvme << 10) | (queue << 8) | command id. A submission queue holds oqueueNum - 1 commands, so submission waits
+/// until a slot is free.
+/// On Nvme's that support SGLs the data buffer of IO read and write commands is described by an SGL data block
+/// descriptor, or for a list of descriptors by a last segment descriptor pointing to them. Otherwise the buffer is
+/// described by PRP entries with a PRP list when it spans more than two memory pages.
+/// Each command handle has its own list in the host's 0x00C00000 region which the Nvme reads when it executes the command.
+int NvmeAccess::nvmeSubmit(Bool detach, BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id, const NvmeSgl* sgl, BUInt sglNum, int slot){
+	int		e;
+	BUInt32		cmd[16];
+	BUInt32		nvmeAddress;
+	NvmeQueue*	q;
+	NvmeCommand*	c;
+	BUInt8		cid;
+	Bool		useSgl = 0;
+	BUInt		numPages = 0;
+	BUInt32*	list;
+	NvmeSgl		desc;
+	BUInt		p;
+
+	if((queue < 0) || (queue >= (int)NvmeMaxQueues)){
+		printf("NvmeAccess::nvmeRequest: Error no queue: %d\n", queue);
+		return 1;
+	}
+
+	if(queue && ((opcode == 0x01) || (opcode == 0x02))){
+		useSgl = odevices[nvme].sgl;
+		if(!useSgl){
+			numPages = ((address % NvmePageSize) + ((arg12 & 0xFFFF) + 1) * NvmeLbaSize + NvmePageSize - 1) / NvmePageSize;
+			if((numPages - 1) > NvmePrpListEntries){
+				printf("NvmeAccess::nvmeRequest: Error transfer too large: %u blocks\n", (arg12 & 0xFFFF) + 1);
+				return 1;
+			}
+		}
+	}
+
+	if(sgl && (!useSgl || !sglNum || (sglNum > NvmeSglMaxDescriptors))){
+		printf("NvmeAccess::nvmeRequest: Error SGL not supported for the command or too many descriptors: %u\n", sglNum);
+		return 1;
+	}
+
+	q = &odevices[nvme].queues[queue];
+	pthread_mutex_lock(&q->lock);
+	while(!q->cmdsFree || (q->queued >= (oqueueNum - 1)))
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	while(q->cmds[++q->cmdId].inUse)
+		;
+
+	cid = q->cmdId;
+	id = (nvme << 10) | (queue << 8) | cid;
+	c = &q->cmds[cid];
+	c->inUse = 1;
+	c->detached = detach;
+	c->complete = 0;
+	c->nvme = nvme;
+	c->queue = queue;
+	c->slot = slot;
+	memset(c->completion, 0, sizeof(c->completion));
+	q->queued++;
+	q->cmdsFree--;
+	pthread_mutex_unlock(&q->lock);
 
 	memset(cmd, 0, 64);
-	cmd[0] = (0x01 << 24) | ((++oqueueAdminId & 0xFF) << 16) | opcode;	// This includes the hosts stream number
+	cmd[0] = (0x01 << 24) | (cid << 16) | opcode;	// This includes the hosts stream number
 	cmd[1] = nameSpace;	// Namespace
 	cmd[2] = 0;		// Reserved
 	cmd[3] = 0;
@@ -253,32 +592,50 @@ int NvmeAccess::nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, B
 	cmd[5] = 0x00;
 	cmd[6] = address;		// PRP1
 	cmd[7] = 0x00000000;
-	cmd[8] = address + 4096;	// PRP2
+	cmd[8] = (address & ~(NvmePageSize - 1)) + NvmePageSize;	// PRP2, the start of the next memory page
 	cmd[9] = 0x00000000;
+	
+	if(useSgl){
+		// SGL1 replaces PRP1 and PRP2
+		cmd[0] |= (1 << 14);
+		if(!sgl){
+			desc = NvmeSgl(address, ((arg12 & 0xFFFF) + 1) * NvmeLbaSize);
+		}
+		else if(sglNum == 1){
+			desc = sgl[0];
+		}
+		else {
+			memcpy(&olistMem[id * (NvmeListSize / 4)], sgl, sglNum * sizeof(NvmeSgl));
+			desc = NvmeSgl(0x01C00000 + (id * NvmeListSize), sglNum * sizeof(NvmeSgl), NvmeSglTypeLastSegment);
+		}
+		memcpy(&cmd[6], &desc, sizeof(desc));
+	}
+	else if(numPages > 2){
+		// PRP2 points to the PRP list of the pages after the first
+		list = &olistMem[id * (NvmeListSize / 4)];
+		for(p = 1; p < numPages; p++){
+			list[(p - 1) * 2] = (address & ~(NvmePageSize - 1)) + (p * NvmePageSize);
+			list[(p - 1) * 2 + 1] = 0x00000000;
+		}
+		cmd[8] = 0x01C00000 + (id * NvmeListSize);
+	}
 	cmd[10] = arg10;	// The argument CMD10
 	cmd[11] = arg11;	// The argument CMD11
 	cmd[12] = arg12;	// The argument CMD12
 
-#ifdef ZAP
-	// Scatter gather lists are only supported on some Nvme's	
-	if(queue){
-		// Use SGL
-		cmd[0] |= (1 << 14);
-		cmd[8] = 0x10000;		// Length of data
-	}
-#endif
-
 	dl1printf("nvmeRequest:\n"); dl1hd32(cmd, 16);
-	oqueueReplySem.wait(0);
 
 	if(UseQueueEngine){
 		// Send message to queue engine
-		nvmeAddress = ((onvmeNum == 1) ? 0x10000000 : 0) | 0x02000000 | (queue << 16);
+		nvmeAddress = 0x02000000 | (queue << 16);
 		dl2printf("Write to queue: %8.8x\n", nvmeAddress);
-		if(e = pcieWrite(1, nvmeAddress, 16, cmd))
+		if(e = pcieWriteNvme(nvme, 1, nvmeAddress, 16, cmd)){
+			nvmeCommandFree(id);
 			return e;
+		}
 	}
 	else {
+		// The host managed queues are a single queue pair, see oqueueAdminMem
 		if(queue){
 			memcpy(&oqueueDataMem[oqueueDataTx * 16], cmd, sizeof(cmd));
 
@@ -289,8 +646,9 @@ int NvmeAccess::nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, B
 			if(oqueueDataTx >= oqueueNum)
 				oqueueDataTx = 0;
 
-			if(e = writeNvmeReg32(0x1008, oqueueDataTx)){
+			if(e = writeNvmeReg32(0x1008, oqueueDataTx, nvme)){
 				printf("Error: %d\n", e);
+				nvmeCommandFree(id);
 				return 1;
 			}
 		}
@@ -304,241 +662,398 @@ int NvmeAccess::nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, B
 			if(oqueueAdminTx >= oqueueNum)
 				oqueueAdminTx = 0;
 
-			if(e = writeNvmeReg32(0x1000, oqueueAdminTx)){
+			if(e = writeNvmeReg32(0x1000, oqueueAdminTx, nvme)){
 				printf("Error: %d\n", e);
+				nvmeCommandFree(id);
 				return 1;
 			}
 		}
 	}
-	
-	if(wait){
-		// Wait for reply
-		oqueueReplySem.wait();
-	}
 
 	return 0;
 }
 
+void NvmeAccess::nvmeCommandFree(BUInt id){
+	NvmeQueue*	q = &odevices[(id >> 10) & 1].queues[(id >> 8) & 3];
+	NvmeCommand*	c = &q->cmds[id & 0xFF];
+
+	pthread_mutex_lock(&q->lock);
+	if(!c->complete)
+		q->queued--;
+	c->inUse = 0;
+	q->cmdsFree++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/// Match a completion queue entry to its command using the submission queue id and command identifier
+void NvmeAccess::nvmeCompletion(BUInt nvme, const BUInt32* completion){
+	BUInt		queue = completion[2] >> 16;
+	NvmeQueue*	q;
+	NvmeCommand*	c;
+	Bool		detached;
+	int		slot = -1;
+	Bool		failed = 0;
+
+	if(queue >= NvmeMaxQueues){
+		printf("NvmeAccess::nvmeCompletion: Error no queue: %u\n", queue);
+		return;
+	}
+	q = &odevices[nvme].queues[queue];
+	c = &q->cmds[completion[3] & 0xFF];
+
+	pthread_mutex_lock(&q->lock);
+	if(!c->inUse || c->complete){
+		pthread_mutex_unlock(&q->lock);
+		printf("NvmeAccess::nvmeCompletion: Error no command for nvme: %u queue: %u id: 0x%4.4x\n", nvme, queue, completion[3] & 0xFFFF);
+		return;
+	}
+
+	memcpy(c->completion, completion, sizeof(c->completion));
+	c->complete = 1;
+	q->queued--;
+	detached = c->detached;
+	if(detached){
+		slot = c->slot;
+		failed = (completion[3] >> 17) != 0;
+		c->inUse = 0;
+		q->cmdsFree++;
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	if(slot >= 0){
+		if(failed){
+			pthread_mutex_lock(&oslotsLock);
+			oslotsErrors++;
+			pthread_mutex_unlock(&oslotsLock);
+		}
+		nvmeSlotFree(slot);
+	}
+	if(!detached)
+		c->sem.set();
+}
+
 /// This function runs as a separate thread in order to receive both replies and requests from the Nvme.
 int NvmeAccess::nvmeProcess(){
-	int			nt;
-	NvmeRequestPacket	request;
-	NvmeReplyPacket		reply;
-	BUInt32*		data;
-	BUInt32			nWordsRet;
-	BUInt32			nWords;
-	int			e;
-	int			status = 0;
+	int		nt;
+	BUInt		used = 0;
+	BUInt		pos;
+	BUInt		n;
+	BUInt32*	p;
 	
 	// This reads packets from the NVMe and processes them. The packets have a special requester header produced by the Xilinx PCIe DMA IP.
 	// Responces have the special completer header added for the Xilinx PCIe DMA IP.
+	// A read may return any number of packets back to back and the last of these may be continued in the next read.
 	while(1){
 		dl4printf("NvmeAccess::nvmeProcess: loop\n");
 
-		// Read the packet from the Nvme. Coupdl be a request or a reply
-		if((nt = read(ohostRecvFd, obufRx, 4096)) < 0){
+		// Read packets from the Nvme after any partial packet left from the last read
+		if((nt = otransport->recv((char*)obufRx + used, NvmeRecvBufferSize - used)) < 0){
 			return 1;
 		}
 
 		dl4printf("NvmeAccess::nvmeProcess: awoken with: %d bytes\n", nt);
 		//dl3hd32(obufRx, nt / 4);
-		//printf("NvmeAccess::nvmeProcess: awoken with: %d bytes\n", nt);
-		//bhd32(obufRx, nt / 4);
-
-		// Determine if packet is a reply or an Nvme request from the reply bit in the header
-		if(obufRx[2] & 0x80000000){
-			memcpy(&opacketReply, obufRx, sizeof(opacketReply));
-			dl3printf("NvmeAccess::nvmeProcess: Reply id: %x\n", opacketReply.requesterId);
-			dl3hd32(&opacketReply, nt / 4);
-			opacketReplySem.set();
-			continue;
-		}
-		else {
-			memcpy(&request, obufRx, sizeof(request));
+		used += nt;
+
+		// Process each complete packet using the size from its header
+		pos = 0;
+		while((used - pos) >= 12){
+			p = (BUInt32*)((char*)obufRx + pos);
+			n = nvmePacketSize(p);
+
+			if(n > sizeof(NvmeRequestPacket)){
+				printf("NvmeAccess::nvmeProcess: Error packet size: %u, discarding receive data\n", n);
+				bhd32(p, 4);
+				pos = used;
+				break;
+			}
+			if(n > (used - pos))
+				break;
+
+			if(nvmeProcessPacket(p, n))
+				return 1;
+			pos += n;
 		}
-		
-		dl4printf("NvmeAccess::nvmeProcess: recvNum: %d Req: %d nWords: %d address: 0x%8.8x\n", nt, request.request, request.numWords, request.address);
-		dl4hd32(&request, nt / 4);
-		//dumpStatus();
 
-		if(request.request == 0){
-			// PCIe Read requests
-			dl3printf("NvmeAccess::nvmeProcess: Read memory: address: %8.8x nWords: %d\n", request.address, request.numWords);
+		// Keep any partial packet for the next read
+		used -= pos;
+		if(used && pos)
+			memmove(obufRx, (char*)obufRx + pos, used);
+	}
 
-			if((request.address & 0x00FF0000) == 0x00000000){
-				data = oqueueAdminMem;
-			}
-			else if((request.address & 0x00FF0000) == 0x00010000){
-				data = oqueueDataMem;
-			}
-			else if((request.address & 0x00FF0000) == 0x00E00000){
-				data = odataBlockMem;
-			}
-			else if((request.address & 0x00FF0000) == 0x00800000){
-				data = odataBlockMem;
-			}
-			else {
-				printf("NvmeAccess::nvmeProcess: Error read from uknown address: 0x%8.8x\n", request.address);
-				continue;
-			}
+	return 0;
+}
 
-			nWordsRet = request.numWords;
-			while(nWordsRet){
-				nWords = nWordsRet;
-				if(nWords > PcieMaxPayloadSize)
-					nWords = PcieMaxPayloadSize;
-
-				memset(&reply, 0, sizeof(reply));
-				if(onvmeNum == 1)
-					reply.completerId = 0x0100;
-				reply.reply = 1;
-				reply.address = request.address & 0x0FFF;
-				reply.numBytes = (nWordsRet * 4);
-				reply.numWords = nWords;
-				reply.tag = request.tag;
-				memcpy(reply.data, &data[(request.address & 0x0000FFFF) / 4], nWords * 4);
-
-				dl4printf("NvmeAccess::nvmeProcess: ReadData block from: 0x%8.8x nWords: %d\n", request.address, nWords);
-				dl4hd32(&reply, (3 + nWords));
-				if(packetSend(reply)){
-					printf("NvmeAccess::nvmeProcess: packet send error\n");
-					exit(1);
-				}
-					
-				nWordsRet -= nWords;
-				request.address += (4 * nWords);
-			}
+/// The packet is decoded in place in the receive buffer. Any data is copied directly to its destination.
+int NvmeAccess::nvmeProcessPacket(BUInt32* packet, BUInt nbytes){
+	NvmeRequestPacket&	request = *(NvmeRequestPacket*)packet;
+	NvmeReplyPacket		reply;
+	NvmeRegion*		region;
+	BUInt32			offset;
+	BUInt32*		data;
+	BUInt32			address;
+	BUInt32			nWordsRet;
+	BUInt32			nWords;
+
+	// Determine if packet is a reply or an Nvme request from the reply bit in the header
+	if(packet[2] & 0x80000000){
+		NvmeReplyPacket&	rxReply = *(NvmeReplyPacket*)packet;
+
+		dl3printf("NvmeAccess::nvmeProcess: Reply id: %x tag: %u\n", rxReply.requesterId, rxReply.tag);
+		dl3hd32(&rxReply, nbytes / 4);
+		pcieReply(rxReply);
+		return 0;
+	}
+	
+	dl4printf("NvmeAccess::nvmeProcess: recvNum: %d Req: %d nWords: %d address: 0x%8.8x\n", nbytes, request.request, request.numWords, request.address);
+	dl4hd32(&request, nbytes / 4);
+	//dumpStatus();
+
+	// Find the host memory region from the address within the host's address window
+	region = oregionMap[(request.address >> 16) & 0xFF];
+	offset = (request.address & 0x00FFFFFF) - (region ? region->base : 0);
+	if(!region || ((offset + (request.numWords * 4)) > region->size)){
+		printf("NvmeAccess::nvmeProcess: Error %s unknown address: 0x%8.8x nWords: %u\n", request.request ? "write to" : "read from", request.address, request.numWords);
+		return 0;
+	}
+
+	if(request.request == 0){
+		// PCIe Read requests
+		dl3printf("NvmeAccess::nvmeProcess: Read memory: address: %8.8x nWords: %d\n", request.address, request.numWords);
+
+		if(!(region->access & NvmeRegionRead) || !region->data){
+			printf("NvmeAccess::nvmeProcess: Error read from write only address: 0x%8.8x\n", request.address);
+			return 0;
 		}
-		else if(request.request == 1){
-			// PCIe Write requests
-			dl3printf("NvmeAccess::nvmeProcess: Write memory: address: %8.8x nWords: %d\n", request.address, request.numWords);
-			status = 0;
-			
-			if((request.address & 0x00FF0000) == 0x00100000){
-				status = request.data[3] >> 17;
-				dl4printf("NvmeAccess::nvmeProcess: NvmeReply: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
-				//printf("NvmeAccess::nvmeProcess: NvmeReply: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
-				//bhd32(&request, nt / 4);
-
-				// Write to completion queue doorbell
-				oqueueAdminRx++;
-				if(oqueueAdminRx >= oqueueNum)
-					oqueueAdminRx = 0;
-
-				if(!UseQueueEngine){
-					dl3printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueAdminRx);
-					printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueAdminRx);
-					if(e = writeNvmeReg32(0x1004, oqueueAdminRx)){
-						printf("Error: %d\n", e);
-						return 1;
-					}
-				}
-				oqueueReplySem.set();
-			}
-			else if((request.address & 0x00FF0000) == 0x00110000){
-				status = request.data[3] >> 17;
-				dl4printf("NvmeAccess::nvmeProcess: IoCompletion: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
-				//printf("NvmeAccess::nvmeProcess: IoCompletion: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
-
-				// Write to completion queue doorbell
-				oqueueDataRx++;
-				if(oqueueDataRx >= oqueueNum)
-					oqueueDataRx = 0;
-
-				if(!UseQueueEngine){
-					dl3printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueDataRx);
-					if(e = writeNvmeReg32(0x100C, oqueueDataRx)){
-						printf("Error: %d\n", e);
-						return 1;
-					}
-				}
-				oqueueReplySem.set();
-			}
-			else if((request.address & 0x00FF0000) == 0x000800000){
-				dl4printf("NvmeAccess::nvmeProcess: IoBlockWrite: address: %8.8x nWords: %d\n", (request.address & 0x0FFFFFFF), request.numWords);
-				//printf("NvmeAccess::nvmeProcess: IoBlockWrite: address: %8.8x nWords: %d\n", (request.address & 0x0FFFFFFF), request.numWords);
 
-				memcpy(&odataBlockMem[(request.address & 0x0000FFFF) / 4], request.data, request.numWords * 4);
+		data = &region->data[offset / 4];
+		address = request.address;
+		nWordsRet = request.numWords;
+		while(nWordsRet){
+			nWords = nWordsRet;
+			if(nWords > PcieMaxPayloadSize)
+				nWords = PcieMaxPayloadSize;
+
+			// Reply to the Nvme that made the request, as both may be active
+			memset(&reply, 0, sizeof(reply));
+			if(request.address & 0x10000000)
+				reply.completerId = 0x0100;
+			reply.reply = 1;
+			reply.address = address & 0x0FFF;
+			reply.numBytes = (nWordsRet * 4);
+			reply.numWords = nWords;
+			reply.tag = request.tag;
+			memcpy(reply.data, data, nWords * 4);
+
+			dl4printf("NvmeAccess::nvmeProcess: ReadData block from: 0x%8.8x nWords: %d\n", address, nWords);
+			dl4hd32(&reply, (3 + nWords));
+			if(packetQueue(&reply, 12 + (4 * nWords))){
+				printf("NvmeAccess::nvmeProcess: packet send error\n");
+				exit(1);
 			}
-			else if((request.address & 0x00F00000) == 0x00E00000){
-				dl4printf("NvmeAccess::nvmeProcess: Write: address: %8.8x nWords: %d\n", (request.address & 0x0FFFFFFF), nWords);
+				
+			nWordsRet -= nWords;
+			address += (4 * nWords);
+			data += nWords;
+		}
+		
+		if(flush()){
+			printf("NvmeAccess::nvmeProcess: packet send error\n");
+			exit(1);
+		}
+	}
+	else if(request.request == 1){
+		// PCIe Write requests
+		dl3printf("NvmeAccess::nvmeProcess: Write memory: address: %8.8x nWords: %d\n", request.address, request.numWords);
 
-				memcpy(&odataBlockMem[(request.address & 0x00000FFF) / 4], request.data, request.numWords * 4);
-				dl4hd32(odataBlockMem, request.numWords);
-			}
-			else if((request.address & 0x00F00000) == 0x00F00000){
-				dl3printf("NvmeAccess::nvmeProcess: Write: address: %8.8x nWords: %d\n", (request.address & 0x0FFFFFFF), nWords);
+		if(!(region->access & NvmeRegionWrite)){
+			printf("NvmeAccess::nvmeProcess: Error write to read only address: 0x%8.8x\n", request.address);
+			return 0;
+		}
 
-				//memcpy(&odataBlockMem[(request.address & 0x00000FFF) / 4], request.data, request.numWords * 4);
-				//dl3hd32(odataBlockMem, request.numWords);
-				nvmeDataPacket(request);
-			}
-			else {
-				printf("NvmeAccess::nvmeProcess: Write data: unknown address: 0x%8.8x\n", request.address);
-			}
-			
-			if(status){
-				printf("NvmeAccess::nvmeProcess: Queued Command returned error: status: %4.4x\n", status);
-				bhd32(&request, nt / 4);
-			}
+		if(region->data){
+			memcpy(&region->data[offset / 4], request.data, request.numWords * 4);
+			dl4hd32(&region->data[offset / 4], request.numWords);
 		}
 		else {
-			printf("NvmeAccess::nvmeProcess: Error: Uknown request: %x\n", request.request);
+			return (this->*region->handler)(request);
+		}
+	}
+	else {
+		printf("NvmeAccess::nvmeProcess: Error: Uknown request: %x\n", request.request);
+	}
+
+	return 0;
+}
+
+int NvmeAccess::nvmeAdminCompletion(NvmeRequestPacket& request){
+	int	e;
+	BUInt	nvme = (request.address & 0x10000000) ? 1 : 0;
+	
+	dl4printf("NvmeAccess::nvmeProcess: NvmeReply: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
+	//printf("NvmeAccess::nvmeProcess: NvmeReply: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
+
+	// Write to completion queue doorbell
+	oqueueAdminRx++;
+	if(oqueueAdminRx >= oqueueNum)
+		oqueueAdminRx = 0;
+
+	if(!UseQueueEngine){
+		dl3printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueAdminRx);
+		printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueAdminRx);
+		if(e = writeNvmeReg32(0x1004, oqueueAdminRx, nvme)){
+			printf("Error: %d\n", e);
+			return 1;
+		}
+	}
+
+	if(request.data[3] >> 17){
+		printf("NvmeAccess::nvmeProcess: Queued Command returned error: status: %4.4x\n", request.data[3] >> 17);
+		bhd32(&request, 4 + request.numWords);
+	}
+	nvmeCompletion(nvme, request.data);
+
+	return 0;
+}
+
+int NvmeAccess::nvmeIoCompletion(NvmeRequestPacket& request){
+	int	e;
+	BUInt	nvme = (request.address & 0x10000000) ? 1 : 0;
+	
+	dl4printf("NvmeAccess::nvmeProcess: IoCompletion: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
+	//printf("NvmeAccess::nvmeProcess: IoCompletion: Queue: %d QueueHeadPointer: %d Status: 0x%4.4x Command: 0x%x\n", request.data[2] >> 16, request.data[2] & 0xFFFF, request.data[3] >> 17, request.data[3] & 0xFFFF);
+
+	// Write to completion queue doorbell
+	oqueueDataRx++;
+	if(oqueueDataRx >= oqueueNum)
+		oqueueDataRx = 0;
+
+	if(!UseQueueEngine){
+		dl3printf("NvmeAccess::nvmeProcess: Write completion queue doorbell: %d\n", oqueueDataRx);
+		if(e = writeNvmeReg32(0x100C, oqueueDataRx, nvme)){
+			printf("Error: %d\n", e);
+			return 1;
 		}
 	}
 
+	if(request.data[3] >> 17){
+		printf("NvmeAccess::nvmeProcess: Queued Command returned error: status: %4.4x\n", request.data[3] >> 17);
+		bhd32(&request, 4 + request.numWords);
+	}
+	nvmeCompletion(nvme, request.data);
+
+	return 0;
+}
+
+int NvmeAccess::nvmeStreamData(NvmeRequestPacket& request){
+	dl3printf("NvmeAccess::nvmeProcess: Write: address: %8.8x nWords: %d\n", (request.address & 0x0FFFFFFF), request.numWords);
+	nvmeDataPacket(request);
+	
 	return 0;
 }
 
 void NvmeAccess::nvmeDataPacket(NvmeRequestPacket& packet){
 }
 
-BUInt32 NvmeAccess::readNvmeStorageReg(BUInt32 address){
-	return oregs[onvmeRegbase/4 + address/4];
+BUInt32 NvmeAccess::readNvmeStorageReg(BUInt32 address, int nvme){
+	if(nvme < 0)
+		return otransport->readReg(onvmeRegbase + address);
+	else if(nvme < 2)
+		return otransport->readReg(odevices[nvme].regbase + address);
+	else
+		return otransport->readReg(address);
+}
+
+void NvmeAccess::writeNvmeStorageReg(BUInt32 address, BUInt32 data, int nvme){
+	if(nvme < 0)
+		otransport->writeReg(onvmeRegbase + address, data);
+	else if(nvme < 2)
+		otransport->writeReg(odevices[nvme].regbase + address, data);
+	else
+		otransport->writeReg(address, data);
+}
+
+int NvmeAccess::readNvmeReg32(BUInt32 address, BUInt32& data, int nvme){
+	return pcieRead(0, address, 1, (BUInt32*)&data, nvme);
 }
 
-void NvmeAccess::writeNvmeStorageReg(BUInt32 address, BUInt32 data){
-	oregs[onvmeRegbase/4 + address/4] = data;
+int NvmeAccess::writeNvmeReg32(BUInt32 address, BUInt32 data, int nvme){
+	return pcieWrite(1, address, 1, (BUInt32*)&data, nvme);
 }
 
-int NvmeAccess::readNvmeReg32(BUInt32 address, BUInt32& data){
-	return pcieRead(0, address, 1, (BUInt32*)&data);
+int NvmeAccess::readNvmeReg64(BUInt32 address, BUInt64& data, int nvme){
+	return pcieRead(0, address, 2, (BUInt32*)&data, nvme);
 }
 
-int NvmeAccess::writeNvmeReg32(BUInt32 address, BUInt32 data){
-	return pcieWrite(1, address, 1, (BUInt32*)&data);
+int NvmeAccess::writeNvmeReg64(BUInt32 address, BUInt64 data, int nvme){
+	return pcieWrite(1, address, 2, (BUInt32*)&data, nvme);
 }
 
-int NvmeAccess::readNvmeReg64(BUInt32 address, BUInt64& data){
-	return pcieRead(0, address, 2, (BUInt32*)&data);
+int NvmeAccess::readNvmeRegs(BUInt num, const BUInt32* addresses, BUInt32* data, int nvme){
+	BUInt8	tags[NvmeMaxTags / 2];
+	BUInt	n;
+	BUInt	i;
+	int	e = 0;
+	int	err;
+
+	// All of the requests are sent before waiting for the replies. Limited to half the tags to leave some for others.
+	while(num){
+		n = (num > (NvmeMaxTags / 2)) ? (NvmeMaxTags / 2) : num;
+
+		for(i = 0; i < n; i++){
+			if(e = pcieReadStart(0, addresses[i], 1, &data[i], tags[i], nvme))
+				break;
+		}
+		n = i;
+
+		for(i = 0; i < n; i++){
+			if((err = pcieWait(tags[i])) && !e)
+				e = err;
+		}
+		if(e)
+			return e;
+
+		addresses += n;
+		data += n;
+		num -= n;
+	}
+
+	return 0;
 }
 
-int NvmeAccess::writeNvmeReg64(BUInt32 address, BUInt64 data){
-	return pcieWrite(1, address, 2, (BUInt32*)&data);
+int NvmeAccess::pcieWrite(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, int nvme){
+	return pcieWriteNvme(nvmeDevice(nvme), request, address, num, data);
 }
 
-int NvmeAccess::pcieWrite(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data){
+int NvmeAccess::pcieWriteNvme(BUInt nvme, BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data){
 	NvmeRequestPacket	txPacket;
-	int			nt;
-	int			reqType;
-	BUInt8			err;
 
 	//printf("pcieWrite\n");
-	if(onvmeNum == 1){
-		address |= 0x10000000;
-	}
+	address |= odevices[nvme].busAddress;
 	
-	// Memory or Config read
+	// Memory or Config write
 	dl2printf("NvmeAccess::pcieWrite address: 0x%8.8x num: %d\n", address, num);
 	txPacket.request = request;		// The request to perform
 	txPacket.address = address;		// 32bit address
 	txPacket.numWords = num;		// Number of 32bit DWords
-	txPacket.tag = ++otag;			// Tag
 	txPacket.requesterId = 0x0001;		// The hosts stream
 	txPacket.requesterIdEnable = 1;		// Enable requestor ID's
 	
 	memcpy(txPacket.data, data, (num * 4));
 
+	// Only config write requests have a reply. Posted writes just take the next tag number, under the tag lock as
+	// writes are made from a number of threads.
+	if(request == 10){
+		txPacket.tag = tagAllocate(0, 0);
+	}
+	else {
+		pthread_mutex_lock(&otagsLock);
+		txPacket.tag = ++otag;
+		pthread_mutex_unlock(&otagsLock);
+	}
+
 	dl2printf("Send packet\n");
 	dl2hd32(&txPacket, 4 + num);
 
@@ -548,38 +1063,40 @@ int NvmeAccess::pcieWrite(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32*
 #endif
 	if(packetSend(txPacket)){
 		printf("Packet send error\n");
+		if(request == 10)
+			tagFree(txPacket.tag);
 		return 1;
 	}	
 
 	if(request == 10){
 		// Wait for a reply on config write requests
-		opacketReplySem.wait();
-		dl2printf("Received reply: status: %x, error: %x, numWords: %d\n", opacketReply.status, opacketReply.error, opacketReply.numWords);
-		opacketReply.numWords++;
-		
-		dl2hd32(&opacketReply, 3 + opacketReply.numWords);
-		if(opacketReply.error)
-			return opacketReply.error;
+		return pcieWait(txPacket.tag);
 	}
 	
 	return 0;
 }
 
-int NvmeAccess::pcieRead(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data){
+int NvmeAccess::pcieRead(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, int nvme){
+	int	e;
+	BUInt8	tag;
+
+	if(e = pcieReadStart(request, address, num, data, tag, nvme))
+		return e;
+
+	return pcieWait(tag);
+}
+
+int NvmeAccess::pcieReadStart(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, BUInt8& tag, int nvme){
 	NvmeRequestPacket	txPacket;
-	BUInt8			err;
-	int			nt = num;
 
-	if(onvmeNum == 1){
-		address |= 0x10000000;
-	}
+	address |= odevices[nvmeDevice(nvme)].busAddress;
 
 	// Memory or Config read
 	dl1printf("NvmeAccess::pcieRead read: address: %d num: %d\n", address, num);
 	txPacket.request = request;		// The request to perform
 	txPacket.address = address;		// 32bit address
 	txPacket.numWords = num;		// Number of 32bit DWords
-	txPacket.tag = ++otag;			// Tag
+	txPacket.tag = tag = tagAllocate(data, num);	// Tag
 	txPacket.requesterId = 0x0001;		// The hosts stream
 	txPacket.requesterIdEnable = 1;		// Enable requestor ID's
 	
@@ -590,106 +1107,197 @@ int NvmeAccess::pcieRead(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32*
 	dumpDmaRegs(0, 0);
 	dumpDmaRegs(1, 0);
 #endif
-	memset(obufRx, 0, 4096);
-
 	if(packetSend(txPacket)){
 		printf("Packet send error\n");
+		tagFree(tag);
 		return 1;
 	}	
 
-	dl2printf("Recv data\n");
-	
-#if LDEBUG5
-	usleep(100000);
-	dumpDmaRegs(0, 0);
-	dumpDmaRegs(1, 0);
-#endif
-	
+	return 0;
+}
+
+int NvmeAccess::pcieWait(BUInt8 tag){
+	int	e;
+
 	// Wait for a reply
-	opacketReplySem.wait();
-	dl2printf("Received reply: status: %x, error: %x, numWords: %d\n", opacketReply.status, opacketReply.error, opacketReply.numWords);
-	
-	dl2hd32(&opacketReply, 3 + opacketReply.numWords);
-	if(opacketReply.error)
-		return opacketReply.error;
+	dl2printf("Recv data\n");
+	otags[tag].sem.wait();
+	dl2printf("Received reply: tag: %u error: %x, numWords: %d\n", tag, otags[tag].error, otags[tag].received);
 
-	memcpy(data, opacketReply.data, (num * sizeof(BUInt32)));
+	e = otags[tag].error;
+	tagFree(tag);
 
-	return 0;
+	return e;
 }
 
-int NvmeAccess::packetSend(const NvmeRequestPacket& packet){
-	BUInt	nb = 16;
+BUInt8 NvmeAccess::tagAllocate(BUInt32* data, BUInt32 numWords){
+	NvmeOutstanding*	o;
+	BUInt8			tag;
+
+	pthread_mutex_lock(&otagsLock);
+	while(!otagsFree)
+		pthread_cond_wait(&otagsCond, &otagsLock);
+
+	tag = otag;
+	while(otags[++tag].inUse)
+		;
+
+	otag = tag;
+	o = &otags[tag];
+	o->inUse = 1;
+	o->data = data;
+	o->numWords = numWords;
+	o->received = 0;
+	o->error = 0;
+	otagsFree--;
+	pthread_mutex_unlock(&otagsLock);
+
+	return tag;
+}
 
-	if((packet.request == 1) || (packet.request == 10) || (packet.request == 12))
-		nb += (4 * packet.numWords);
+void NvmeAccess::tagFree(BUInt8 tag){
+	pthread_mutex_lock(&otagsLock);
+	otags[tag].inUse = 0;
+	otagsFree++;
+	pthread_cond_signal(&otagsCond);
+	pthread_mutex_unlock(&otagsLock);
+}
 
-	if(write(ohostSendFd, &packet, nb) != nb){
-		printf("Send error\n");
-		return 1;
+/// Match a reply to its request using the tag. Replies to reads may be split into a number of packets.
+void NvmeAccess::pcieReply(const NvmeReplyPacket& reply){
+	NvmeOutstanding*	o = &otags[reply.tag];
+	BUInt32			n = reply.numWords;
+	Bool			complete;
+
+	pthread_mutex_lock(&otagsLock);
+	if(!o->inUse){
+		pthread_mutex_unlock(&otagsLock);
+		printf("NvmeAccess::nvmeProcess: Reply with unknown tag: %u\n", reply.tag);
+		return;
 	}
 
-	return 0;
+	if(n > (o->numWords - o->received))
+		n = o->numWords - o->received;
+	if(o->data)
+		memcpy(&o->data[o->received], reply.data, n * sizeof(BUInt32));
+	o->received += n;
+	o->error = reply.error;
+	complete = reply.error || (o->received >= o->numWords);
+	pthread_mutex_unlock(&otagsLock);
+
+	if(complete)
+		o->sem.set();
+}
+
+BUInt nvmePacketSize(const void* packet){
+	const BUInt32*	h = (const BUInt32*)packet;
+	BUInt		request;
+
+	// Replies have the reply bit set and a 3 word header. Requests have a 4 word header and only writes carry data.
+	if(h[2] & 0x80000000)
+		return 12 + (4 * (h[1] & 0x7FF));
+
+	request = (h[2] >> 11) & 0x0F;
+	if((request == 1) || (request == 10) || (request == 12))
+		return 16 + (4 * (h[2] & 0x7FF));
+
+	return 16;
+}
+
+int NvmeAccess::packetSend(const NvmeRequestPacket& packet){
+	if(packetQueue(&packet, nvmePacketSize(&packet)))
+		return 1;
+
+	return flush();
 }
 
 int NvmeAccess::packetSend(const NvmeReplyPacket& packet){
-	BUInt	nb = 12 + (4 * packet.numWords);
+	if(packetQueue(&packet, nvmePacketSize(&packet)))
+		return 1;
+
+	return flush();
+}
 
-	if(write(ohostSendFd, &packet, nb) != nb){
-		printf("Send error\n");
+/// Packets are batched back to back in the send buffer. The FPGA's stream multiplexers use each packet's header
+/// to delimit them so a number can be sent in one DMA transfer.
+int NvmeAccess::packetQueue(const void* packet, BUInt nbytes){
+	int	e = 0;
+
+	if(!obatchSize)
+		return otransport->send(packet, nbytes);
+
+	pthread_mutex_lock(&otxLock);
+	if(!obufTx){
+		pthread_mutex_unlock(&otxLock);
 		return 1;
 	}
-	return 0;
+
+	if((otxUsed + nbytes) > obatchSize){
+		e = otransport->send(obufTx, otxUsed);
+		otxUsed = 0;
+	}
+
+	memcpy((char*)obufTx + otxUsed, packet, nbytes);
+	otxUsed += nbytes;
+	pthread_mutex_unlock(&otxLock);
+
+	return e;
 }
 
-int NvmeAccess::readAvailable(){
-	unsigned long	n = 0;
+int NvmeAccess::flush(){
+	int	e = 0;
 
-	if(ohostRecvFd >= 0){
-		if(ioctl(ohostRecvFd, FIONREAD, &n) < 0){
-			n = 0;
-		}
+	if(!obatchSize)
+		return 0;
+
+	pthread_mutex_lock(&otxLock);
+	if(otxUsed){
+		e = otransport->send(obufTx, otxUsed);
+		otxUsed = 0;
 	}
+	pthread_mutex_unlock(&otxLock);
 
-	return n;
+	return e;
+}
+
+int NvmeAccess::readAvailable(){
+	return otransport->recvAvailable();
 }
 
 void NvmeAccess::dumpRegs(int nvmeNum){
 	int	r;
 	BUInt32	nvmeRegbase;
 	
-	if(nvmeNum == 0)
-		nvmeRegbase = 0x100;
-	else if(nvmeNum == 1)
-		nvmeRegbase = 0x200;
+	if((nvmeNum == 0) || (nvmeNum == 1))
+		nvmeRegbase = odevices[nvmeNum].regbase;
 	else if(nvmeNum == 2)
 		nvmeRegbase = 0x000;
 	else
 		nvmeRegbase = onvmeRegbase;
 
 	printf("NvmeStorageUnit's registers: base: 0x%x\n", nvmeRegbase);
-	printf("Id:             %8.8x\n", oregs[nvmeRegbase/4 + 0]);
-	printf("Control:        %8.8x\n", oregs[nvmeRegbase/4 + 1]);
-	printf("Status:         %8.8x\n", oregs[nvmeRegbase/4 + 2]);
-	printf("TotalBlocks:    %8.8x\n", oregs[nvmeRegbase/4 + 3]);
-	printf("DataChunkStart: %8.8x\n", oregs[nvmeRegbase/4 + 16]);
-	printf("DataChunkSize:  %8.8x\n", oregs[nvmeRegbase/4 + 17]);
-	printf("Error:          %8.8x\n", oregs[nvmeRegbase/4 + 18]);
-	printf("NumBlocks:      %8.8x\n", oregs[nvmeRegbase/4 + 19]);
-	printf("TimeUs:         %8.8x\n", oregs[nvmeRegbase/4 + 20]);
-	printf("PeakLatencyUs:  %8.8x\n", oregs[nvmeRegbase/4 + 21]);
-
-	printf("Test0:          %8.8x\n", oregs[nvmeRegbase/4 + 22]);
-	printf("Test1:          %8.8x\n", oregs[nvmeRegbase/4 + 23]);
-
-	printf("ReadControl:    %8.8x\n", oregs[nvmeRegbase/4 + 32]);
-	printf("ReadStatus:     %8.8x\n", oregs[nvmeRegbase/4 + 33]);
-	printf("ReadBlock:      %8.8x\n", oregs[nvmeRegbase/4 + 34]);
-	printf("ReadNumBlocks:  %8.8x\n", oregs[nvmeRegbase/4 + 35]);
+	printf("Id:             %8.8x\n", otransport->readReg(nvmeRegbase + RegIdent));
+	printf("Control:        %8.8x\n", otransport->readReg(nvmeRegbase + RegControl));
+	printf("Status:         %8.8x\n", otransport->readReg(nvmeRegbase + RegStatus));
+	printf("TotalBlocks:    %8.8x\n", otransport->readReg(nvmeRegbase + RegTotalBlocks));
+	printf("DataChunkStart: %8.8x\n", otransport->readReg(nvmeRegbase + RegDataChunkStart));
+	printf("DataChunkSize:  %8.8x\n", otransport->readReg(nvmeRegbase + RegDataChunkSize));
+	printf("Error:          %8.8x\n", otransport->readReg(nvmeRegbase + RegWriteError));
+	printf("NumBlocks:      %8.8x\n", otransport->readReg(nvmeRegbase + RegWriteNumBlocks));
+	printf("TimeUs:         %8.8x\n", otransport->readReg(nvmeRegbase + RegWriteTime));
+	printf("PeakLatencyUs:  %8.8x\n", otransport->readReg(nvmeRegbase + RegWritePeakLatency));
+
+	printf("Test0:          %8.8x\n", otransport->readReg(nvmeRegbase + 0x058));
+	printf("Test1:          %8.8x\n", otransport->readReg(nvmeRegbase + 0x05C));
+
+	printf("ReadControl:    %8.8x\n", otransport->readReg(nvmeRegbase + RegReadControl));
+	printf("ReadStatus:     %8.8x\n", otransport->readReg(nvmeRegbase + RegReadStatus));
+	printf("ReadBlock:      %8.8x\n", otransport->readReg(nvmeRegbase + RegReadBlock));
+	printf("ReadNumBlocks:  %8.8x\n", otransport->readReg(nvmeRegbase + RegReadNumBlocks));
 
 #ifdef ZAP	
 	for(r = 16; r < 21; r++){
-		printf("Reg%2.2d:    %8.8x\n", r, oregs[nvmeRegbase/4 + r]);
+		printf("Reg%2.2d:    %8.8x\n", r, otransport->readReg(nvmeRegbase + r * 4));
 	}
 #endif
 }
@@ -697,23 +1305,21 @@ void NvmeAccess::dumpRegs(int nvmeNum){
 void  NvmeAccess::dumpDmaRegs(bool c2h, int chan){
 	int			regsAddress = (c2h << 12) | (chan << 8);
 	int			sgregsAddress = ((4 + c2h) << 12) | (chan << 8);
-	volatile BUInt32*	regs = &odmaRegs[regsAddress / 4];
-	volatile BUInt32*	sgregs = &odmaRegs[sgregsAddress / 4];
 	
 	printf("DMA Channel:    %d.%d\n", c2h, chan);
 	//printf("DMA regs:       0x%x\n", regsAddress);
-	printf("DMA_ID:		%x\n", regs[DMA_ID / 4]);
-	printf("DMA_CONTROL:	%x\n", regs[DMA_CONTROL / 4]);
-	printf("DMA_STATUS:	%x\n", regs[DMA_STATUS / 4]);
-	printf("DMA_COMPLETE:	%x\n", regs[DMA_COMPLETE / 4]);
-	printf("DMA_INT_MASK:	%x\n", regs[DMA_INT_MASK / 4]);
+	printf("DMA_ID:		%x\n", otransport->readDmaReg(regsAddress + DMA_ID));
+	printf("DMA_CONTROL:	%x\n", otransport->readDmaReg(regsAddress + DMA_CONTROL));
+	printf("DMA_STATUS:	%x\n", otransport->readDmaReg(regsAddress + DMA_STATUS));
+	printf("DMA_COMPLETE:	%x\n", otransport->readDmaReg(regsAddress + DMA_COMPLETE));
+	printf("DMA_INT_MASK:	%x\n", otransport->readDmaReg(regsAddress + DMA_INT_MASK));
 
 	if(0){	
-		printf("DMASC_ID:		%x\n", sgregs[DMASC_ID / 4]);
+		printf("DMASC_ID:		%x\n", otransport->readDmaReg(sgregsAddress + DMASC_ID));
 		//printf("DMASC regs:             0x%x\n", sgregsAddress);
-		printf("DMASC_ADDRESS_LOW:	%x\n", sgregs[DMASC_ADDRESS_LOW / 4]);
-		printf("DMASC_ADDRESS_HIGH:	%x\n", sgregs[DMASC_ADDRESS_HIGH / 4]);
-		printf("DMASC_NEXT:		%x\n", sgregs[DMASC_NEXT / 4]);
+		printf("DMASC_ADDRESS_LOW:	%x\n", otransport->readDmaReg(sgregsAddress + DMASC_ADDRESS_LOW));
+		printf("DMASC_ADDRESS_HIGH:	%x\n", otransport->readDmaReg(sgregsAddress + DMASC_ADDRESS_HIGH));
+		printf("DMASC_NEXT:		%x\n", otransport->readDmaReg(sgregsAddress + DMASC_NEXT));
 #ifdef ZAP
 		printf("SGmemory\n");
 		if(chan)
@@ -20,6 +20,9 @@
  *  - Configuration of the NVMe's registers.
  *  - Sending Admin commands to the NVMe via the admin request/completion shared memory queues. This includes configuration commands.
  *  - Sending of read and write IO commands to the NVMe via IO request/completion shared memory queues.
+ *  - A pool of host data slots for the data of concurrent host issued IO commands.
+ *  - Describing IO command data with SGL descriptors on Nvme's that support them, otherwise with PRP entries and PRP
+ *    lists for commands that transfer more than two memory pages.
  *
  * There is access to the memory mappend NvmeStorage registers and there is one bi-directional DMA stream used for communication.
  * The send and receive DMA streams are multiplexed between requests from the host and replies from the Nvme and also
@@ -27,6 +30,8 @@
  * The packets sent have a 128bit multiplexing stream number headerand are then encapsulated in the Xilinx PCIe DMA IP's headers.
  *
  * The class accesses the FPGA system over the hosts PCIe bus using the Beam bfpga Linux driver. This interfaces with the Xilinx PCIe DMA IP.
+ * The access is performed through a NvmeTransport, by default NvmeTransportBfpga. An alternative transport, such as
+ * the NvmeTransportLoopback, can be set with setTransport() before init() is called.
  * The class uses a thread to respond to Nvme requests.
  *
  * @copyright GNU GPL License
@@ -55,13 +60,25 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
-#include <bfpga_driver/bfpga.h>
+#include <NvmeTransport.h>
 
 const Bool	UseFpgaConfigure = 0;			///< Expect the NvmeStorage module to have configured the Nvme's
 const Bool	UseConfigEngine = 0;			///< Use the FPGA configuration engine
 const Bool	UseQueueEngine = 1;			///< Use the FPGA queue engine implementation
 const BUInt	PcieMaxPayloadSize = 32;		///< The Pcie maximim packet payload in 32bit DWords
+const BUInt	NvmeRecvBufferSize = 65536;		///< The size of the receive buffer in bytes
 const BUInt	BlockSize = 4096;			///< The NvmeStorage block size in bytes
+const BUInt	NvmeMaxTags = 256;			///< The number of PCIe request tags
+const BUInt	NvmeMaxCommands = 256;			///< The number of Nvme command id's
+const BUInt	NvmeMaxQueues = 4;			///< The number of Nvme queues supported by the queue engine
+const BUInt	NvmeQueueEngineNum = 16;		///< The queue engine's fixed number of entries in each queue, NvmeQueueNum
+const BUInt	NvmePageSize = 4096;			///< The Nvme memory page size in bytes
+const BUInt	NvmeLbaSize = 512;			///< The Nvme logical block size in bytes
+const BUInt	NvmeListSize = 1024;			///< The size of a command's PRP list or SGL segment in bytes
+const BUInt	NvmePrpListEntries = NvmeListSize / 8;	///< The number of entries in a command's PRP list
+const BUInt	NvmeSlotSize = 131072;			///< The size of a host data slot in bytes
+const BUInt	NvmeSlotsAddress = 0x00200000;		///< The address of the host data slots in the host's address window
+const BUInt	NvmeSlotsMax = 48;			///< The maximum number of host data slots
 
 const BUInt	RegIdent		= 0x000;	///< The ident and version
 const BUInt	RegControl		= 0x004;	///< The control register
@@ -123,14 +140,95 @@ public:
 	BUInt32		data[PcieMaxPayloadSize];	///< The data words (Max of 1024 bytes but can be increased)
 };
 
-const BUInt NvmeSglTypeData	= 0;
+BUInt nvmePacketSize(const void* packet);		///< The size in bytes of a request or reply packet from its header
 
+const BUInt	NvmeSglTypeData		= 0x0;		///< SGL data block descriptor
+const BUInt	NvmeSglTypeSegment	= 0x2;		///< SGL segment descriptor, the last entry of a segment that is followed by another
+const BUInt	NvmeSglTypeLastSegment	= 0x3;		///< SGL last segment descriptor
+const BUInt	NvmeSglMaxDescriptors	= NvmeListSize / 16;	///< The number of descriptors in a command's SGL segment
+
+/// An Nvme scatter gather list descriptor
 class NvmeSgl {
-	BUInt64		address;
-	BUInt32		length;
-	BUInt8		fill0[2];
-	BUInt8		subtype:4;
-	BUInt8		type:4;
+public:
+			NvmeSgl(BUInt64 address = 0, BUInt32 length = 0, BUInt8 type = NvmeSglTypeData){
+				memset(this, 0, sizeof(*this));
+				this->address = address;
+				this->length = length;
+				this->type = type;
+			}
+
+	BUInt64		address;		///< The address of the data or segment
+	BUInt32		length;			///< The length in bytes
+	BUInt8		fill0[3];		///< 
+	BUInt8		subtype:4;		///< The descriptor sub type
+	BUInt8		type:4;			///< The descriptor type
+};
+
+class NvmeAccess;
+
+const BUInt	NvmeMaxRegions		= 16;		///< The maximum number of host memory regions
+const BUInt	NvmeRegionRead		= 0x01;		///< The region may be read by the Nvme's
+const BUInt	NvmeRegionWrite		= 0x02;		///< The region may be written by the Nvme's
+
+typedef int	(NvmeAccess::*NvmeRegionHandler)(NvmeRequestPacket& request);	///< Handles a write to a region. Returns 0 on success
+
+/// A region of host memory accessed by the Nvme's bus master reads and writes.
+/// Regions are 64k aligned within the host's 16 MByte address window and are either host memory or have a write handler.
+class NvmeRegion {
+public:
+	BUInt32			base;			///< The base address within the host's address window
+	BUInt32			size;			///< The size in bytes
+	BUInt			access;			///< The NvmeRegionRead and NvmeRegionWrite accesses allowed
+	BUInt32*		data;			///< The host memory or 0 when the handler is used
+	NvmeRegionHandler	handler;		///< The handler for writes when there is no host memory
+};
+
+/// A PCIe request awaiting its reply
+class NvmeOutstanding {
+public:
+	Bool		inUse;				///< The tag is in use
+	BSemaphore	sem;				///< Set when the reply is complete
+	BUInt32*	data;				///< Buffer for the reply data
+	BUInt32		numWords;			///< The number of data words expected
+	BUInt32		received;			///< The number of data words received
+	BUInt8		error;				///< The replies error number
+};
+
+/// An Nvme command awaiting its completion
+class NvmeCommand {
+public:
+	Bool		inUse;				///< The command id is in use
+	Bool		detached;			///< No one will wait for the completion, free the id when complete
+	Bool		complete;			///< The completion has been received
+	BUInt		nvme;				///< The Nvme the command was sent to
+	BUInt		queue;				///< The submission queue used
+	int		slot;				///< The data slot freed when a detached command completes, -1 for none
+	BSemaphore	sem;				///< Set when the completion has been received
+	BUInt32		completion[4];			///< The completion queue entry DWords
+};
+
+/// The commands of an Nvme queue pair. Each queue has its own command id space and lock so that queues used by
+/// different threads do not contend.
+class NvmeQueue {
+public:
+	BUInt8			cmdId;				///< The last command id allocated
+	NvmeCommand		cmds[NvmeMaxCommands];		///< The commands awaiting completion indexed by command id
+	BUInt			cmdsFree;			///< The number of free command id's
+	BUInt			queued;				///< The number of submission queue slots in use
+	pthread_mutex_t		lock;				///< Lock for the queue's commands
+	pthread_cond_t		cond;				///< Signaled when a command completes
+};
+
+/// The state of one Nvme. The Nvme's have independent contexts so that they can be driven from separate threads.
+class NvmeDevice {
+public:
+	BUInt			num;				///< The Nvme number, 0 or 1
+	BUInt32			regbase;			///< The NvmeStorage unit's register base address
+	BUInt32			busAddress;			///< The address bits selecting the Nvme on the PCIe bus
+	NvmeQueue		queues[NvmeMaxQueues];		///< The commands of the Nvme's queues
+	BUInt32			maxTransfer;			///< The maximum data transfer size in bytes, 0 is unlimited
+	Bool			sgl;				///< SGL data transfers are supported
+	BUInt32			identifyMem[1024];		///< The identify data buffer, the 0x00900000 + num * 0x10000 window
 };
 
 /// Nvme access class
@@ -139,38 +237,71 @@ public:
 			NvmeAccess();
 			~NvmeAccess();
 	
+	void		setTransport(NvmeTransport* transport);			///< Set the transport to use. Takes ownership of the transport
+	void		setSendBatch(BUInt nbytes);				///< Batch sent packets into transfers of up to nbytes. 0 disables
+	void		setDataSlots(BUInt num, Bool hugePages);		///< Set the number of host data slots and if they use huge pages. Used by init()
+	void		setIoQueues(BUInt num);					///< Set the number of IO queue pairs created on each Nvme, 1 to NvmeMaxQueues - 1
+	BUInt		getIoQueues();						///< The number of IO queue pairs on each Nvme
 	int		init();
 	void		close();
 
-	void		setNvme(BUInt n);
+	void		setNvme(BUInt n);						///< Set the current Nvme used by functions without an Nvme argument. 2 is both
 	BUInt		getNvme();
+	BUInt32		nvmeIdentifyAddress(BUInt nvme);				///< The Nvme's bus address of its identify data buffer
+	BUInt32*	nvmeIdentifyData(BUInt nvme);					///< The host memory of the Nvme's identify data buffer
 	void		reset();
 	void		start();							///< Start NVMe request processing thread
 
-	// Send a queued request to the NVMe
-	int		nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11 = 0, BUInt32 arg12 = 0);
+	// Send a queued request to the NVMe. Commands are identified by a handle of the Nvme, queue and command id.
+	// Each IO queue may be used by a different thread. Functions with an nvme argument of -1 use the current Nvme.
+	int		nvmeRequest(Bool wait, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11 = 0, BUInt32 arg12 = 0, int nvme = -1);
+	int		nvmeRequestStart(int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id);	///< Submit a command, waiting for a free queue slot. Sets the command id to wait on
+	int		nvmeRequestStartNvme(BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id);	///< As nvmeRequestStart() to the given Nvme. May be used from a number of threads
+	int		nvmeRequestWait(BUInt id, BUInt32* completion = 0);		///< Wait for a command to complete. Returns its status, optionally with the 4 completion DWords
+	BUInt		nvmeQueueSlots(int queue);					///< The number of free submission queue slots on a queue of the current Nvme
+	int		nvmeRequestStartSgl(BUInt nvme, int queue, int opcode, BUInt nameSpace, const NvmeSgl* sgl, BUInt num, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id);	///< As nvmeRequestStartNvme() for an IO read or write with the data described by a list of SGL data block descriptors
+	BUInt32		nvmeMaxTransfer(BUInt nvme);					///< The maximum data transfer size of an IO read or write command in bytes
+	int		nvmeRequestSlot(BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt slot, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12);	///< Submit a command using a data slot without waiting. The slot is freed when the command completes or on error
+
+	// Host data slots
+	BUInt		nvmeSlotsNum();							///< The number of host data slots
+	int		nvmeSlotAllocate(BUInt& slot);					///< Allocate a host data slot, waiting until one is free. Returns 0 on success
+	void		nvmeSlotFree(BUInt slot);					///< Free a host data slot
+	BUInt32*	nvmeSlotData(BUInt slot);					///< The host memory of a data slot
+	BUInt32		nvmeSlotAddress(BUInt slot);					///< The Nvme's bus address of a data slot
+	int		nvmeSlotsWait();						///< Wait until all the data slots are free. Returns the number of nvmeRequestSlot() commands that failed since the last call
+
+	int		nvmeRegionAdd(BUInt32 base, BUInt32 size, BUInt access, BUInt32* data, NvmeRegionHandler handler = 0);	///< Add a host memory region for Nvme bus master accesses. Returns 0 on success
+	Bool		nvmeSglSupported(BUInt nvme);					///< The Nvme supports SGL data transfers
 	
 	// NVMe process received requests thread
 	int		nvmeProcess();
-	virtual void	nvmeDataPacket(NvmeRequestPacket& packet);			///< Called when read data packet received
+	int		nvmeProcessPacket(BUInt32* packet, BUInt nbytes);		///< Process a single received packet
+	virtual void	nvmeDataPacket(NvmeRequestPacket& packet);			///< Called when read data packet received. The packet is only valid during the call
 	
 	// NvmeStorage units register access
-	BUInt32		readNvmeStorageReg(BUInt32 address);
-	void		writeNvmeStorageReg(BUInt32 address, BUInt32 data);
+	BUInt32		readNvmeStorageReg(BUInt32 address, int nvme = -1);		///< Read a register of Nvme 0, 1 or 2 for the common registers
+	void		writeNvmeStorageReg(BUInt32 address, BUInt32 data, int nvme = -1);
 	
 	// NVMe register access
-	int		readNvmeReg32(BUInt32 address, BUInt32& data);
-	int		writeNvmeReg32(BUInt32 address, BUInt32 data);
-	int		readNvmeReg64(BUInt32 address, BUInt64& data);
-	int		writeNvmeReg64(BUInt32 address, BUInt64 data);
+	int		readNvmeReg32(BUInt32 address, BUInt32& data, int nvme = -1);
+	int		writeNvmeReg32(BUInt32 address, BUInt32 data, int nvme = -1);
+	int		readNvmeReg64(BUInt32 address, BUInt64& data, int nvme = -1);
+	int		writeNvmeReg64(BUInt32 address, BUInt64 data, int nvme = -1);
+	int		readNvmeRegs(BUInt num, const BUInt32* addresses, BUInt32* data, int nvme = -1);	///< Read a set of 32bit registers with the requests overlapped
 
 	// Perform register access over PCIe both config and NVMe registers
-	int		pcieWrite(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data);
-	int		pcieRead(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data);
+	int		pcieWrite(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, int nvme = -1);
+	int		pcieWriteNvme(BUInt nvme, BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data);	///< Write to the given Nvme rather than the current one
+	int		pcieRead(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, int nvme = -1);
+	int		pcieReadStart(BUInt8 request, BUInt32 address, BUInt32 num, BUInt32* data, BUInt8& tag, int nvme = -1);	///< Send a read request without waiting
+	int		pcieWait(BUInt8 tag);						///< Wait for the reply to a request
 
 	// Packet send and receive
 	int		packetSend(const NvmeRequestPacket& packet);
 	int		packetSend(const NvmeReplyPacket& packet);
+	int		packetQueue(const void* packet, BUInt nbytes);		///< Queue a packet for sending. Sent immediately if batching is disabled
+	int		flush();						///< Send any queued packets
 	int		readAvailable();						///< The number of bytes available on the receive stream
 	
 	// Debug
@@ -180,34 +311,60 @@ public:
 
 	
 protected:
-	int			oregsFd;			///< Device drive fd for register access
-	int			ohostSendFd;			///< Device driver fd for DMA send channel
-	int			ohostRecvFd;			///< Device driver fd for DMA receive channel
-	BFpgaInfo		oinfo;				///< Device driver information
-	volatile BUInt32*	oregs;				///< FPGA design's registers memory mapped
-	volatile BUInt32*	odmaRegs;			///< FPGA's PCIe XDMA modules DMA control registers memory mapped
-
-	BUInt32*		obufTx;
-	BUInt32*		obufRx;
-	BUInt8			otag;
+	BUInt			nvmeDevice(int nvme);				///< The Nvme device number for an nvme argument, -1 is the current Nvme
+	BUInt8			tagAllocate(BUInt32* data, BUInt32 numWords);	///< Allocate a tag for a request, waiting if none are free
+	void			tagFree(BUInt8 tag);
+	void			pcieReply(const NvmeReplyPacket& reply);	///< Process a reply packet from the receive stream
+	int			nvmeSubmit(Bool detach, BUInt nvme, int queue, int opcode, BUInt nameSpace, BUInt32 address, BUInt32 arg10, BUInt32 arg11, BUInt32 arg12, BUInt& id, const NvmeSgl* sgl = 0, BUInt sglNum = 0, int slot = -1);
+	void			nvmeCommandFree(BUInt id);
+	void			nvmeCompletion(BUInt nvme, const BUInt32* completion);	///< Process a completion queue entry from the Nvme
+	int			nvmeAdminCompletion(NvmeRequestPacket& request);	///< Region handler for the admin completion queue
+	int			nvmeIoCompletion(NvmeRequestPacket& request);	///< Region handler for the IO completion queues
+	int			nvmeStreamData(NvmeRequestPacket& request);	///< Region handler for the data stream from the NvmeRead engine
 
-	BSemaphore		opacketReplySem;		///< Semaphore when a reply packet has been received
-	NvmeReplyPacket		opacketReply;			///< Reply to request
-	BSemaphore		oqueueReplySem;			///< Semaphore when a queue reply packet has been received
+	NvmeTransport*		otransport;			///< The transport used to access the FPGA
+
+	BUInt32*		obufTx;				///< Send batch buffer
+	BUInt			obatchSize;			///< The send batch size in bytes, 0 is disabled
+	BUInt			otxUsed;			///< The number of bytes queued in the send batch buffer
+	pthread_mutex_t		otxLock;			///< Lock for the send batch buffer
+	BUInt32*		obufRx;
+	BUInt8			otag;				///< The last tag allocated
+	NvmeOutstanding		otags[NvmeMaxTags];		///< The requests awaiting replies indexed by tag
+	BUInt			otagsFree;			///< The number of free tags
+	pthread_mutex_t		otagsLock;			///< Lock for the tag table
+	pthread_cond_t		otagsCond;			///< Signaled when a tag is freed
+	NvmeDevice		odevices[2];			///< The state of each Nvme
+	BUInt			oioQueues;			///< The number of IO queue pairs on each Nvme
 
 	pthread_t		othread;
 	BUInt32			onvmeNum;			///< The nvme to communicate with, 0 is both
 	BUInt32			onvmeRegbase;			///< The register base address
-	BUInt32			oqueueNum;
+	BUInt32			oqueueNum;			///< The number of entries in each Nvme queue, the queue engine's fixed NvmeQueueEngineNum
 
-	BUInt32			oqueueAdminMem[4096];
+	// Without the queue engine there is a single host managed admin and IO queue pair, in these windows, whose
+	// positions are not per Nvme or per queue. This supports one Nvme and one submitting thread at a time.
+	BUInt32			oqueueAdminMem[4096];		///< The admin submission queue memory, the 0x00000000 window
 	BUInt32			oqueueAdminRx;
 	BUInt32			oqueueAdminTx;
-	BUInt32			oqueueAdminId;
 	
-	BUInt32			oqueueDataMem[4096];
+	BUInt32			oqueueDataMem[4096];		///< The IO submission queue memory, the 0x00010000 window
 	BUInt32			oqueueDataRx;
 	BUInt32			oqueueDataTx;
 
-	BUInt32			odataBlockMem[8192];
+	BUInt32			odataBlockMem[16384];		///< Host data memory, the 64k 0x00800000 window
+	BUInt32*		oslotsMem;			///< The host data slots memory, the 0x00200000 window
+	BUInt			oslotsNum;			///< The number of host data slots
+	Bool			oslotsHuge;			///< The host data slots use huge pages
+	BUInt			oslotsMemSize;			///< The size of the data slots memory in bytes
+	BUInt8			oslotsFree[NvmeSlotsMax];	///< The stack of free data slots
+	BUInt			oslotsFreeNum;			///< The number of free data slots
+	BUInt			oslotsErrors;			///< The number of nvmeRequestSlot() commands that completed with an error
+	pthread_mutex_t		oslotsLock;			///< Lock for the data slots
+	pthread_cond_t		oslotsCond;			///< Signaled when a data slot is freed
+	BUInt32*		olistMem;			///< The PRP lists or SGL segments indexed by command handle, the 0x00C00000 window
+
+	NvmeRegion		oregions[NvmeMaxRegions];	///< The host memory regions
+	BUInt			oregionsNum;			///< The number of host memory regions
+	NvmeRegion*		oregionMap[256];		///< The region for each 64k of the host's address window
 };
@@ -0,0 +1,1032 @@
+/*******************************************************************************
+ *	NvmeControllerSim.cpp	Software model of an Nvme controller
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeControllerSim
+ * @version	0.0.1
+ *
+ * @brief
+ * This is a software model of an Nvme controller as seen through the NvmeStorage queue engine.
+ *
+ * @details
+ * See NvmeControllerSim.h for details.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define	LDEBUG1		0		// High level debug
+#define	LDEBUG2		0		// Command debug
+
+#include <NvmeControllerSim.h>
+#include <time.h>
+
+const double	TimeNever		= 1e30;			///< A time that never arrives
+const double	BusMasterTimeout	= 1.0;			///< Bus master read timeout in seconds
+
+// The Nvme controller register numbers
+const BUInt	NvmeCapLow		= 0x00 / 4;
+const BUInt	NvmeCapHigh		= 0x04 / 4;
+const BUInt	NvmeVersion		= 0x08 / 4;
+const BUInt	NvmeCC			= 0x14 / 4;
+const BUInt	NvmeCSTS		= 0x1C / 4;
+const BUInt	NvmeAQA			= 0x24 / 4;
+
+// Nvme status codes
+const BUInt32	StatusSuccess		= 0x000;
+const BUInt32	StatusInvalidOpcode	= 0x001;
+const BUInt32	StatusInvalidField	= 0x002;
+const BUInt32	StatusDataTransferError	= 0x004;
+const BUInt32	StatusLbaOutOfRange	= 0x080;
+const BUInt32	StatusInvalidQueue	= 0x101;
+const BUInt32	StatusInvalidQueueSize	= 0x102;
+
+/// Start the command processing thread
+static void* controllerProcess(void* arg){
+	NvmeControllerSim*	controller = (NvmeControllerSim*)arg;
+
+	controller->process();
+	return 0;
+}
+
+/// Convert a time to a timespec for pthread_cond_timedwait()
+static struct timespec timeToTimespec(double t){
+	struct timespec	ts;
+
+	ts.tv_sec = time_t(t);
+	ts.tv_nsec = long((t - double(ts.tv_sec)) * 1e9);
+	if(ts.tv_nsec >= 1000000000)
+		ts.tv_nsec = 999999999;
+
+	return ts;
+}
+
+NvmeControllerSimProfile::NvmeControllerSimProfile(){
+	writeRate = 2000.0 * 1024 * 1024;
+	readRate = 3000.0 * 1024 * 1024;
+	latency = 20e-6;
+	gcInterval = 0;
+	gcStall = 0.02;
+	trimRate = 0;
+	trimRecovery = 0;
+	trimRecoveryRate = 0.5;
+	sgl = 1;
+}
+
+int NvmeControllerSimProfile::set(const char* params){
+	char	str[256];
+	char*	save = 0;
+	char*	p;
+	char*	v;
+	double	d;
+
+	strncpy(str, params, sizeof(str) - 1);
+	str[sizeof(str) - 1] = 0;
+
+	for(p = strtok_r(str, ",", &save); p; p = strtok_r(0, ",", &save)){
+		if(!(v = strchr(p, '='))){
+			fprintf(stderr, "Error: Nvme profile parameter has no value: %s\n", p);
+			return 1;
+		}
+		*v++ = 0;
+		d = atof(v);
+
+		if(!strcmp(p, "write"))
+			writeRate = d * 1024 * 1024;
+		else if(!strcmp(p, "read"))
+			readRate = d * 1024 * 1024;
+		else if(!strcmp(p, "latency"))
+			latency = d * 1e-6;
+		else if(!strcmp(p, "gcInterval"))
+			gcInterval = d * 1024 * 1024;
+		else if(!strcmp(p, "gcStall"))
+			gcStall = d * 1e-3;
+		else if(!strcmp(p, "trimRate"))
+			trimRate = d * 1024 * 1024;
+		else if(!strcmp(p, "trimRecovery"))
+			trimRecovery = d;
+		else if(!strcmp(p, "trimRecoveryRate"))
+			trimRecoveryRate = d;
+		else if(!strcmp(p, "sgl"))
+			sgl = (d != 0);
+		else {
+			fprintf(stderr, "Error: No such Nvme profile parameter: %s\n", p);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+NvmeControllerSim::NvmeControllerSim(){
+	onum = 0;
+	onumBlocks = 0;
+	othreadRunning = 0;
+	oexit = 0;
+	obmTag = 0;
+	obmData = 0;
+	obmNumWords = 0;
+	obmReceived = 0;
+	obusyTime = 0;
+	ogcBytes = 0;
+	ogcEnd = 0;
+	otrimRecoveryEnd = 0;
+	ostallMax = 0;
+	memset(ostore, 0, sizeof(ostore));
+	pthread_mutex_init(&omutex, 0);
+	pthread_cond_init(&ocond, 0);
+	reset();
+}
+
+NvmeControllerSim::~NvmeControllerSim(){
+	stop();
+	discard(0, ~BUInt64(0));
+	pthread_cond_destroy(&ocond);
+	pthread_mutex_destroy(&omutex);
+}
+
+void NvmeControllerSim::init(BUInt num, BUInt64 numBlocks){
+	onum = num;
+	onumBlocks = numBlocks;
+}
+
+void NvmeControllerSim::start(){
+	oexit = 0;
+	pthread_create(&othread, 0, ::controllerProcess, this);
+	othreadRunning = 1;
+}
+
+void NvmeControllerSim::stop(){
+	if(othreadRunning){
+		pthread_mutex_lock(&omutex);
+		oexit = 1;
+		pthread_cond_broadcast(&ocond);
+		pthread_mutex_unlock(&omutex);
+
+		pthread_join(othread, 0);
+		othreadRunning = 0;
+	}
+}
+
+void NvmeControllerSim::reset(){
+	BUInt	q;
+
+	pthread_mutex_lock(&omutex);
+	dl1printf("NvmeControllerSim::reset: %u\n", onum);
+
+	memset(oconfig, 0, sizeof(oconfig));
+	oconfig[0] = 0x00101B36;			// Vendor and device ID
+	oconfig[2] = 0x01080200;			// Class code: Nvme mass storage
+
+	memset(oregs, 0, sizeof(oregs));
+	oregs[NvmeCapLow] = 0x14010FFF;			// Timeout, contiguous queues required, 4096 entries max
+	oregs[NvmeCapHigh] = 0x00000020;		// NVM command set, 4k pages, doorbell stride 4
+	oregs[NvmeVersion] = 0x00010300;		// Version 1.3
+
+	for(q = 0; q < NvmeCtlSimNumQueues; q++){
+		oqueueSize[q] = 2;
+		oqueueHead[q] = 0;
+		ocqTail[q] = 0;
+		oqueuePhase[q] = 1;
+	}
+
+	ocommandsIn = 0;
+	ocommandsNum = 0;
+	opendingNum = 0;
+	pthread_cond_broadcast(&ocond);
+	pthread_mutex_unlock(&omutex);
+}
+
+void NvmeControllerSim::setProfile(const NvmeControllerSimProfile& profile){
+	pthread_mutex_lock(&omutex);
+	oprofile = profile;
+	ogcBytes = oprofile.gcInterval;
+	pthread_mutex_unlock(&omutex);
+}
+
+NvmeControllerSimProfile NvmeControllerSim::profile(){
+	NvmeControllerSimProfile	p;
+
+	pthread_mutex_lock(&omutex);
+	p = oprofile;
+	pthread_mutex_unlock(&omutex);
+
+	return p;
+}
+
+double NvmeControllerSim::stallMax(){
+	double	s;
+
+	pthread_mutex_lock(&omutex);
+	s = ostallMax;
+	pthread_mutex_unlock(&omutex);
+
+	return s;
+}
+
+void NvmeControllerSim::clearStats(){
+	pthread_mutex_lock(&omutex);
+	ostallMax = 0;
+	pthread_mutex_unlock(&omutex);
+}
+
+double NvmeControllerSim::trimRecoveryEnd(){
+	double	t;
+
+	pthread_mutex_lock(&omutex);
+	t = otrimRecoveryEnd;
+	pthread_mutex_unlock(&omutex);
+
+	return t;
+}
+
+void NvmeControllerSim::setTrimRecoveryEnd(double t){
+	pthread_mutex_lock(&omutex);
+	otrimRecoveryEnd = t;
+	pthread_mutex_unlock(&omutex);
+}
+
+double NvmeControllerSim::mediaWrite(double& t, double maxBytes, double tEnd){
+	double	b;
+
+	pthread_mutex_lock(&omutex);
+	b = media(t, maxBytes, tEnd);
+	pthread_mutex_unlock(&omutex);
+
+	return b;
+}
+
+// Writes at the media rate from time t until either maxBytes are written or tEnd is reached.
+// Garbage collection stalls and the reduced rate after a deallocate are applied as they occur.
+double NvmeControllerSim::media(double& t, double maxBytes, double tEnd){
+	double	done = 0;
+	double	rate;
+	double	tn;
+	double	b;
+
+	if(oprofile.writeRate <= 0)
+		return maxBytes;
+
+	while((done < maxBytes) && (t < tEnd)){
+		if(t < ogcEnd){
+			t = (ogcEnd < tEnd) ? ogcEnd : tEnd;
+			continue;
+		}
+
+		rate = oprofile.writeRate;
+		tn = tEnd;
+		if(t < otrimRecoveryEnd){
+			rate *= oprofile.trimRecoveryRate;
+			if(otrimRecoveryEnd < tn)
+				tn = otrimRecoveryEnd;
+		}
+		if(rate <= 0){
+			t = tn;
+			continue;
+		}
+
+		b = (tn - t) * rate;
+		if(b > (maxBytes - done))
+			b = maxBytes - done;
+		if((oprofile.gcInterval > 0) && (b > ogcBytes))
+			b = ogcBytes;
+
+		t += b / rate;
+		done += b;
+
+		if(oprofile.gcInterval > 0){
+			ogcBytes -= b;
+			if(ogcBytes <= 0){
+				dl1printf("NvmeControllerSim: %u: Garbage collection stall at: %f\n", onum, t);
+				ogcEnd = t + oprofile.gcStall;
+				ogcBytes = oprofile.gcInterval;
+				if(oprofile.gcStall > ostallMax)
+					ostallMax = oprofile.gcStall;
+			}
+		}
+	}
+
+	return done;
+}
+
+void NvmeControllerSim::hostPacket(const void* data, BUInt nbytes){
+	NvmeRequestPacket	request;
+	NvmeReplyPacket		reply;
+	BUInt32			address;
+	BUInt			w;
+	Bool			sendReply = 0;
+
+	if(((const BUInt32*)data)[2] & 0x80000000){
+		memcpy(&reply, data, (nbytes < sizeof(reply)) ? nbytes : sizeof(reply));
+		busMasterReply(reply);
+		return;
+	}
+
+	memcpy(&request, data, (nbytes < sizeof(request)) ? nbytes : sizeof(request));
+	address = request.address & 0x0FFFFFFF;
+
+	if((request.request == 1) && ((address & 0x0FF00000) == 0x02000000)){
+		if(request.numWords == 16)
+			queueWrite((address >> 16) & (NvmeCtlSimNumQueues - 1), request.data);
+		return;
+	}
+
+	reply.reply = 1;
+	reply.address = address & 0x0FFF;
+	reply.tag = request.tag;
+	reply.requesterId = request.requesterId;
+	reply.completerId = onum ? 0x0100 : 0x0000;
+
+	pthread_mutex_lock(&omutex);
+	if(request.request == 0){
+		// Nvme register read
+		reply.numWords = request.numWords;
+		reply.numBytes = request.numWords * 4;
+		for(w = 0; (w < request.numWords) && (w < PcieMaxPayloadSize); w++){
+			if((address / 4 + w) == NvmeCSTS)
+				reply.data[w] = oregs[NvmeCC] & 1;
+			else if((address / 4 + w) < 16)
+				reply.data[w] = oregs[address / 4 + w];
+			else
+				reply.data[w] = 0;
+		}
+		sendReply = 1;
+	}
+	else if(request.request == 1){
+		// Nvme register write
+		for(w = 0; (w < request.numWords) && (w < PcieMaxPayloadSize); w++){
+			if((address / 4 + w) < 16)
+				oregs[address / 4 + w] = request.data[w];
+		}
+		if(!(oregs[NvmeCC] & 1)){
+			// Controller disabled, reset the queues
+			for(w = 0; w < NvmeCtlSimNumQueues; w++){
+				oqueueHead[w] = 0;
+				ocqTail[w] = 0;
+				oqueuePhase[w] = 1;
+			}
+			ocommandsNum = 0;
+			opendingNum = 0;
+		}
+		oqueueSize[0] = (oregs[NvmeAQA] & 0xFFF) + 1;
+	}
+	else if(request.request == 8){
+		// PCIe configuration read
+		reply.numWords = request.numWords;
+		reply.numBytes = request.numWords * 4;
+		for(w = 0; (w < request.numWords) && (w < PcieMaxPayloadSize); w++)
+			reply.data[w] = oconfig[(address / 4 + w) & 63];
+		sendReply = 1;
+	}
+	else if(request.request == 10){
+		// PCIe configuration write
+		for(w = 0; (w < request.numWords) && (w < PcieMaxPayloadSize); w++)
+			oconfig[(address / 4 + w) & 63] = request.data[w];
+		reply.numWords = 0;
+		reply.numBytes = 0;
+		sendReply = 1;
+	}
+	pthread_mutex_unlock(&omutex);
+
+	// Sent outside of the lock as the receive stream may be full
+	if(sendReply)
+		send(&reply, 12 + (4 * reply.numWords));
+}
+
+void NvmeControllerSim::queueWrite(BUInt queue, const BUInt32* cmd){
+	NvmeControllerSimCommand*	c;
+
+	pthread_mutex_lock(&omutex);
+	if(!(oregs[NvmeCC] & 1)){
+		pthread_mutex_unlock(&omutex);
+		return;
+	}
+
+	while(!oexit && (ocommandsNum == NvmeCtlSimMaxCommands))
+		pthread_cond_wait(&ocond, &omutex);
+
+	c = &ocommands[ocommandsIn];
+	c->queue = queue;
+	memcpy(c->cmd, cmd, sizeof(c->cmd));
+	c->arrival = getTime();
+	ocommandsIn = (ocommandsIn + 1) % NvmeCtlSimMaxCommands;
+	ocommandsNum++;
+
+	oqueueHead[queue] = (oqueueHead[queue] + 1) % oqueueSize[queue];
+
+	pthread_cond_broadcast(&ocond);
+	pthread_mutex_unlock(&omutex);
+}
+
+void NvmeControllerSim::process(){
+	NvmeControllerSimCommand	command;
+	NvmeControllerSimCompletion	completion;
+	struct timespec			ts;
+	BUInt				p;
+
+	pthread_mutex_lock(&omutex);
+	while(!oexit){
+		if(opendingNum && (opending[0].time <= getTime())){
+			completion = opending[0];
+			opendingNum--;
+			memmove(&opending[0], &opending[1], opendingNum * sizeof(NvmeControllerSimCompletion));
+			pthread_mutex_unlock(&omutex);
+
+			postCompletion(completion);
+
+			pthread_mutex_lock(&omutex);
+		}
+		else if(ocommandsNum && (opendingNum < NvmeCtlSimMaxPending)){
+			command = ocommands[(ocommandsIn + NvmeCtlSimMaxCommands - ocommandsNum) % NvmeCtlSimMaxCommands];
+			ocommandsNum--;
+			pthread_cond_broadcast(&ocond);
+			pthread_mutex_unlock(&omutex);
+
+			completion.queue = command.queue;
+			completion.cid = command.cmd[0] >> 16;
+			completion.status = execute(command, completion.time);
+
+			// Insert in time order
+			pthread_mutex_lock(&omutex);
+			for(p = opendingNum; (p > 0) && (opending[p - 1].time > completion.time); p--)
+				opending[p] = opending[p - 1];
+			opending[p] = completion;
+			opendingNum++;
+		}
+		else if(opendingNum){
+			ts = timeToTimespec(opending[0].time);
+			pthread_cond_timedwait(&ocond, &omutex, &ts);
+		}
+		else {
+			pthread_cond_wait(&ocond, &omutex);
+		}
+	}
+	pthread_mutex_unlock(&omutex);
+}
+
+void NvmeControllerSim::postCompletion(const NvmeControllerSimCompletion& completion){
+	NvmeRequestPacket	packet;
+	BUInt			q = completion.queue;
+
+	pthread_mutex_lock(&omutex);
+
+	// The queue engine sends completions on to the originator given in the top byte of the command identifier
+	packet.request = 1;
+	packet.address = (onum ? 0x10000000 : 0) | ((completion.cid >> 8) << 24) | 0x00100000 | (q << 16);
+	packet.numWords = 4;
+	packet.requesterId = 2;
+	packet.data[0] = 0;
+	packet.data[1] = 0;
+	packet.data[2] = (q << 16) | oqueueHead[q];
+	packet.data[3] = (completion.status << 17) | (oqueuePhase[q] << 16) | completion.cid;
+
+	ocqTail[q]++;
+	if(ocqTail[q] >= oqueueSize[q]){
+		ocqTail[q] = 0;
+		oqueuePhase[q] ^= 1;
+	}
+	pthread_mutex_unlock(&omutex);
+
+	dl2printf("NvmeControllerSim::postCompletion: %u: queue: %u cid: %4.4x status: %x\n", onum, q, completion.cid, completion.status);
+	if((completion.cid >> 8) == 0x01)
+		send(&packet, 16 + (4 * packet.numWords));
+}
+
+BUInt32 NvmeControllerSim::execute(NvmeControllerSimCommand& command, double& time){
+	BUInt32	status;
+
+	dl2printf("NvmeControllerSim::execute: %u: queue: %u opcode: %2.2x cid: %4.4x\n", onum, command.queue, command.cmd[0] & 0xFF, command.cmd[0] >> 16);
+
+	time = command.arrival;
+
+	// The queue engine's head and tail positions wrap at its fixed queue size
+	if((command.queue == 0) && (oqueueSize[0] != NvmeCtlSimQueueNum)){
+		printf("NvmeControllerSim: %u: Error admin queue size %u does not match the queue engine's %u entries\n", onum, oqueueSize[0], NvmeCtlSimQueueNum);
+		return StatusInvalidQueueSize;
+	}
+
+	if(command.queue == 0)
+		status = executeAdmin(command.cmd, time);
+	else
+		status = executeIo(command.cmd, time);
+
+	return status;
+}
+
+BUInt32 NvmeControllerSim::executeAdmin(const BUInt32* cmd, double& time){
+	BUInt32		opcode = cmd[0] & 0xFF;
+	BUInt32		status = StatusSuccess;
+	BUInt32		q;
+	BUInt32		n;
+	BUInt32*	data;
+
+	switch(opcode){
+	case 0x00:			// Delete IO submission queue
+	case 0x04:			// Delete IO completion queue
+		break;
+
+	case 0x01:			// Create IO submission queue
+	case 0x05:			// Create IO completion queue
+		q = cmd[10] & 0xFFFF;
+		if((q == 0) || (q >= NvmeCtlSimNumQueues)){
+			status = StatusInvalidQueue;
+			break;
+		}
+		if(((cmd[10] >> 16) + 1) != NvmeCtlSimQueueNum){
+			printf("NvmeControllerSim: %u: Error IO queue %u size %u does not match the queue engine's %u entries\n", onum, q, (cmd[10] >> 16) + 1, NvmeCtlSimQueueNum);
+			status = StatusInvalidQueueSize;
+			break;
+		}
+		pthread_mutex_lock(&omutex);
+		oqueueSize[q] = (cmd[10] >> 16) + 1;
+		if(opcode == 0x01){
+			oqueueHead[q] = 0;
+		}
+		else {
+			ocqTail[q] = 0;
+			oqueuePhase[q] = 1;
+		}
+		pthread_mutex_unlock(&omutex);
+		break;
+
+	case 0x02:			// Get log page
+		n = ((cmd[10] >> 16) & 0xFFF) + 1;
+		data = new BUInt32[n];
+		memset(data, 0, n * 4);
+		if(busMasterWrite(cmd[6], n, data))
+			status = StatusDataTransferError;
+		delete [] data;
+		break;
+
+	case 0x06:			// Identify
+		data = new BUInt32[BlockSize / 4];
+		memset(data, 0, BlockSize);
+		if((cmd[10] & 0xFF) == 0){
+			// Namespace
+			data[0] = onumBlocks * (BlockSize / NvmeCtlSimLbaSize);
+			data[1] = (onumBlocks * (BlockSize / NvmeCtlSimLbaSize)) >> 32;
+			data[2] = data[0];
+			data[3] = data[1];
+			data[4] = data[0];
+			data[5] = data[1];
+			data[32] = 0x00090000;		// LBA format 0: 512 byte blocks
+		}
+		else if((cmd[10] & 0xFF) == 1){
+			// Controller
+			data[0] = 0x1B361B36;
+			strcpy((char*)&data[1], "NVMESIM0001");
+			strcpy((char*)&data[6], "NvmeControllerSim");
+			strcpy((char*)&data[16], "0.0.1");
+			data[19] = NvmeCtlSimMdts << 8;	// Maximum data transfer size
+			data[128] = 0x00004466;		// Submission and completion queue entry sizes
+			data[129] = 1;			// Number of namespaces
+			data[134] = oprofile.sgl ? 1 : 0;	// SGL support
+		}
+		else {
+			status = StatusInvalidField;
+		}
+		if(!status && busMasterWrite(cmd[6], BlockSize / 4, data))
+			status = StatusDataTransferError;
+		delete [] data;
+		break;
+
+	case 0x09:			// Set features
+	case 0x0A:			// Get features
+		break;
+
+	default:
+		status = StatusInvalidOpcode;
+		break;
+	}
+
+	time += oprofile.latency;
+
+	return status;
+}
+
+BUInt32 NvmeControllerSim::executeIo(const BUInt32* cmd, double& time){
+	BUInt32		opcode = cmd[0] & 0xFF;
+	BUInt32		status = StatusSuccess;
+	BUInt64		lba = (BUInt64(cmd[11]) << 32) | cmd[10];
+	BUInt32		num = (cmd[12] & 0xFFFF) + 1;
+	BUInt64		bytes = 0;
+	BUInt32*	data = 0;
+	BUInt32		nr;
+	BUInt32		r;
+	double		t;
+	Bool		trim = 0;
+
+	switch(opcode){
+	case 0x00:			// Flush
+		break;
+
+	case 0x01:			// Write
+	case 0x02:			// Read
+	case 0x08:			// Write zeroes
+		if((lba + num) > (onumBlocks * (BlockSize / NvmeCtlSimLbaSize))){
+			status = StatusLbaOutOfRange;
+			break;
+		}
+		bytes = BUInt64(num) * NvmeCtlSimLbaSize;
+		if((opcode != 0x08) && (bytes > (BUInt64(BlockSize) << NvmeCtlSimMdts))){
+			status = StatusInvalidField;
+			break;
+		}
+
+		if(((cmd[0] >> 14) & 0x03) && !oprofile.sgl){
+			status = StatusInvalidField;
+			break;
+		}
+
+		if(opcode == 0x01){
+			data = new BUInt32[bytes / 4];
+			if(((cmd[0] >> 14) & 0x03) ? sglTransfer(cmd, bytes, data, 0) : prpTransfer(cmd, bytes, data, 0))
+				status = StatusDataTransferError;
+			else
+				lbaWrite(lba, num, data);
+		}
+		else if(opcode == 0x02){
+			data = new BUInt32[bytes / 4];
+			lbaRead(lba, num, data);
+			if(((cmd[0] >> 14) & 0x03) ? sglTransfer(cmd, bytes, data, 1) : prpTransfer(cmd, bytes, data, 1))
+				status = StatusDataTransferError;
+		}
+		else {
+			lbaDeallocate(lba, num);
+			trim = 1;
+		}
+		break;
+
+	case 0x09:			// Dataset management
+		if(cmd[11] & 0x04){
+			nr = (cmd[10] & 0xFF) + 1;
+			data = new BUInt32[nr * 4];
+			if(busMasterRead(cmd[6], nr * 4, data)){
+				status = StatusDataTransferError;
+				break;
+			}
+			for(r = 0; r < nr; r++){
+				lba = (BUInt64(data[r * 4 + 3]) << 32) | data[r * 4 + 2];
+				lbaDeallocate(lba, data[r * 4 + 1]);
+				bytes += BUInt64(data[r * 4 + 1]) * NvmeCtlSimLbaSize;
+			}
+			trim = 1;
+		}
+		break;
+
+	default:
+		status = StatusInvalidOpcode;
+		break;
+	}
+	delete [] data;
+
+	// Service time
+	pthread_mutex_lock(&omutex);
+	t = (time > obusyTime) ? time : obusyTime;
+	if(status == StatusSuccess){
+		if(opcode == 0x01){
+			media(t, bytes, TimeNever);
+		}
+		else if(opcode == 0x02){
+			if(oprofile.readRate > 0)
+				t += bytes / oprofile.readRate;
+		}
+		else if(trim){
+			if(oprofile.trimRate > 0)
+				t += bytes / oprofile.trimRate;
+			if(oprofile.trimRecovery > 0)
+				otrimRecoveryEnd = t + oprofile.trimRecovery;
+		}
+	}
+	obusyTime = t;
+	time = t + oprofile.latency;
+	pthread_mutex_unlock(&omutex);
+
+	return status;
+}
+
+int NvmeControllerSim::busMasterRead(BUInt64 address, BUInt32 numWords, BUInt32* data){
+	NvmeRequestPacket	packet;
+	BUInt32			n;
+	struct timespec		ts;
+	int			e = 0;
+
+	while(!e && numWords){
+		n = (numWords > (BlockSize / 4)) ? (BlockSize / 4) : numWords;
+
+		pthread_mutex_lock(&omutex);
+		obmTag++;
+		obmData = data;
+		obmNumWords = n;
+		obmReceived = 0;
+		packet.tag = obmTag;
+		pthread_mutex_unlock(&omutex);
+
+		packet.request = 0;
+		packet.address = (onum ? 0x10000000 : 0) | address;
+		packet.numWords = n;
+		packet.requesterId = 2;
+		if(send(&packet, 16))
+			return 1;
+
+		pthread_mutex_lock(&omutex);
+		ts = timeToTimespec(getTime() + BusMasterTimeout);
+		while(!oexit && (obmReceived < obmNumWords)){
+			if(pthread_cond_timedwait(&ocond, &omutex, &ts) == ETIMEDOUT){
+				printf("NvmeControllerSim: %u: Bus master read timeout: address: %8.8lx\n", onum, address);
+				break;
+			}
+		}
+		if(obmReceived < obmNumWords)
+			e = 1;
+		obmData = 0;
+		pthread_mutex_unlock(&omutex);
+
+		address += 4 * n;
+		data += n;
+		numWords -= n;
+	}
+
+	return e;
+}
+
+void NvmeControllerSim::busMasterReply(const NvmeReplyPacket& reply){
+	BUInt32	n = reply.numWords;
+
+	pthread_mutex_lock(&omutex);
+	if(obmData && (reply.tag == obmTag)){
+		if(n > (obmNumWords - obmReceived))
+			n = obmNumWords - obmReceived;
+		memcpy(&obmData[obmReceived], reply.data, n * 4);
+		obmReceived += n;
+		pthread_cond_broadcast(&ocond);
+	}
+	pthread_mutex_unlock(&omutex);
+}
+
+int NvmeControllerSim::busMasterWrite(BUInt64 address, BUInt32 numWords, const BUInt32* data){
+	NvmeRequestPacket	packet;
+	BUInt32			n;
+
+	while(numWords){
+		n = (numWords > PcieMaxPayloadSize) ? PcieMaxPayloadSize : numWords;
+
+		packet.request = 1;
+		packet.address = (onum ? 0x10000000 : 0) | address;
+		packet.numWords = n;
+		packet.requesterId = 2;
+		memcpy(packet.data, data, n * 4);
+		if(send(&packet, 16 + (4 * n)))
+			return 1;
+
+		address += 4 * n;
+		data += n;
+		numWords -= n;
+	}
+
+	return 0;
+}
+
+/// PRP1 addresses the first memory page. PRP2 addresses the second page or, when the transfer spans more than two
+/// pages, a PRP list of the following pages. The list is expected to be within a single page. Only PRP1 may have a
+/// page offset, PRP2 and the list entries must be page aligned.
+int NvmeControllerSim::prpTransfer(const BUInt32* cmd, BUInt64 bytes, BUInt32* data, Bool toHost){
+	BUInt64		address = (BUInt64(cmd[7]) << 32) | cmd[6];
+	BUInt64		prp2 = (BUInt64(cmd[9]) << 32) | cmd[8];
+	BUInt32		list[((1 << NvmeCtlSimMdts) + 1) * 2];
+	BUInt		numPages = ((address % BlockSize) + bytes + BlockSize - 1) / BlockSize;
+	BUInt		p;
+	BUInt64		n;
+	int		e = 0;
+
+	if(numPages > 2){
+		if(((numPages - 1) * 2) > (sizeof(list) / 4))
+			return 1;
+		if(busMasterRead(prp2, (numPages - 1) * 2, list))
+			return 1;
+	}
+
+	for(p = 0; !e && bytes; p++){
+		if(p && (numPages > 2))
+			address = (BUInt64(list[(p - 1) * 2 + 1]) << 32) | list[(p - 1) * 2];
+		else if(p)
+			address = prp2;
+
+		if(p && (address % BlockSize)){
+			printf("NvmeControllerSim: %u: Error PRP entry %u is not page aligned: 0x%llx\n", onum, p, (unsigned long long)address);
+			return 1;
+		}
+
+		n = BlockSize - (address % BlockSize);
+		if(n > bytes)
+			n = bytes;
+
+		if(toHost)
+			e = busMasterWrite(address, n / 4, data);
+		else
+			e = busMasterRead(address, n / 4, data);
+
+		data += n / 4;
+		bytes -= n;
+	}
+
+	return e;
+}
+
+/// SGL1 is a data block descriptor or a segment descriptor pointing to a segment of descriptors. A segment is followed
+/// by the next when its last descriptor is a segment descriptor. The descriptors data blocks must total the transfer size.
+int NvmeControllerSim::sglTransfer(const BUInt32* cmd, BUInt64 bytes, BUInt32* data, Bool toHost){
+	NvmeSgl		desc;
+	NvmeSgl		segment[NvmeSglMaxDescriptors];
+	BUInt		num = 0;
+	BUInt		pos = 0;
+	Bool		last = 0;
+
+	memcpy(&desc, &cmd[6], sizeof(desc));
+	while(1){
+		if(desc.type == NvmeSglTypeData){
+			if((desc.length > bytes) || (desc.length % 4))
+				return 1;
+
+			if(toHost){
+				if(busMasterWrite(desc.address, desc.length / 4, data))
+					return 1;
+			}
+			else {
+				if(busMasterRead(desc.address, desc.length / 4, data))
+					return 1;
+			}
+			data += desc.length / 4;
+			bytes -= desc.length;
+		}
+		else if(!last && ((desc.type == NvmeSglTypeSegment) || (desc.type == NvmeSglTypeLastSegment))){
+			num = desc.length / sizeof(NvmeSgl);
+			if(!num || (num > NvmeSglMaxDescriptors))
+				return 1;
+			if(busMasterRead(desc.address, num * sizeof(NvmeSgl) / 4, (BUInt32*)segment))
+				return 1;
+			last = (desc.type == NvmeSglTypeLastSegment);
+			pos = 0;
+		}
+		else {
+			return 1;
+		}
+
+		if(pos >= num)
+			break;
+		desc = segment[pos++];
+	}
+
+	return bytes ? 1 : 0;
+}
+
+void NvmeControllerSim::blockData(BUInt64 block, BUInt32* data){
+	memset(data, 0, BlockSize);
+}
+
+void NvmeControllerSim::deallocated(BUInt64 block, BUInt64 num){
+}
+
+int NvmeControllerSim::lbaRead(BUInt64 lba, BUInt32 num, BUInt32* data){
+	BUInt32			blockData[BlockSize / 4];
+	BUInt64			pos = lba * NvmeCtlSimLbaSize;
+	BUInt64			end = pos + BUInt64(num) * NvmeCtlSimLbaSize;
+	BUInt64			block;
+	BUInt			offset;
+	BUInt			n;
+	NvmeControllerSimBlock*	b;
+
+	while(pos < end){
+		block = pos / BlockSize;
+		offset = pos % BlockSize;
+		n = ((end - pos) < (BlockSize - offset)) ? (end - pos) : (BlockSize - offset);
+
+		pthread_mutex_lock(&omutex);
+		if(b = storeFind(block))
+			memcpy(blockData, b->data, BlockSize);
+		pthread_mutex_unlock(&omutex);
+
+		if(!b)
+			this->blockData(block, blockData);
+
+		memcpy((char*)data + (pos - lba * NvmeCtlSimLbaSize), (char*)blockData + offset, n);
+		pos += n;
+	}
+
+	return 0;
+}
+
+int NvmeControllerSim::lbaWrite(BUInt64 lba, BUInt32 num, const BUInt32* data){
+	BUInt32			blockData[BlockSize / 4];
+	BUInt64			pos = lba * NvmeCtlSimLbaSize;
+	BUInt64			end = pos + BUInt64(num) * NvmeCtlSimLbaSize;
+	BUInt64			block;
+	BUInt			offset;
+	BUInt			n;
+	NvmeControllerSimBlock*	b;
+
+	while(pos < end){
+		block = pos / BlockSize;
+		offset = pos % BlockSize;
+		n = ((end - pos) < (BlockSize - offset)) ? (end - pos) : (BlockSize - offset);
+
+		// Partial block writes need the existing contents
+		if(n != BlockSize)
+			lbaRead(block * (BlockSize / NvmeCtlSimLbaSize), BlockSize / NvmeCtlSimLbaSize, blockData);
+
+		pthread_mutex_lock(&omutex);
+		if(!(b = storeFind(block))){
+			b = storeAdd(block);
+			memcpy(b->data, blockData, BlockSize);
+		}
+		memcpy((char*)b->data + offset, (const char*)data + (pos - lba * NvmeCtlSimLbaSize), n);
+		pthread_mutex_unlock(&omutex);
+
+		pos += n;
+	}
+
+	return 0;
+}
+
+void NvmeControllerSim::lbaDeallocate(BUInt64 lba, BUInt64 num){
+	BUInt32		zero[BlockSize / 4];
+	BUInt64		lbasPerBlock = BlockSize / NvmeCtlSimLbaSize;
+	BUInt64		first = (lba + lbasPerBlock - 1) / lbasPerBlock;
+	BUInt64		last = (lba + num) / lbasPerBlock;
+	BUInt64		n;
+
+	dl1printf("NvmeControllerSim::lbaDeallocate: %u: lba: %lu num: %lu\n", onum, lba, num);
+	memset(zero, 0, sizeof(zero));
+
+	// Deallocated blocks read as zero. Partial 4k blocks at the ends are zeroed.
+	if(first > last){
+		lbaWrite(lba, num, zero);
+		return;
+	}
+	if((first * lbasPerBlock) > lba){
+		n = first * lbasPerBlock - lba;
+		lbaWrite(lba, n, zero);
+	}
+	if((lba + num) > (last * lbasPerBlock)){
+		n = lba + num - last * lbasPerBlock;
+		lbaWrite(last * lbasPerBlock, n, zero);
+	}
+
+	if(last > first){
+		discard(first, last - first);
+		deallocated(first, last - first);
+	}
+}
+
+void NvmeControllerSim::discard(BUInt64 block, BUInt64 num){
+	NvmeControllerSimBlock**	p;
+	NvmeControllerSimBlock*		b;
+	BUInt				h;
+
+	pthread_mutex_lock(&omutex);
+	for(h = 0; h < NvmeCtlSimStoreHash; h++){
+		p = &ostore[h];
+		while(b = *p){
+			if((b->block >= block) && ((b->block - block) < num)){
+				*p = b->next;
+				delete b;
+			}
+			else {
+				p = &b->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&omutex);
+}
+
+NvmeControllerSimBlock* NvmeControllerSim::storeFind(BUInt64 block){
+	NvmeControllerSimBlock*	b;
+
+	for(b = ostore[block % NvmeCtlSimStoreHash]; b; b = b->next){
+		if(b->block == block)
+			return b;
+	}
+
+	return 0;
+}
+
+NvmeControllerSimBlock* NvmeControllerSim::storeAdd(BUInt64 block){
+	NvmeControllerSimBlock*	b = new NvmeControllerSimBlock;
+
+	b->block = block;
+	b->next = ostore[block % NvmeCtlSimStoreHash];
+	ostore[block % NvmeCtlSimStoreHash] = b;
+
+	return b;
+}
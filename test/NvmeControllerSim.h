@@ -0,0 +1,202 @@
+/*******************************************************************************
+ *	NvmeControllerSim.h	Software model of an Nvme controller
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeControllerSim
+ * @version	0.0.1
+ *
+ * @brief
+ * This is a software model of an Nvme controller as seen through the NvmeStorage queue engine.
+ *
+ * @details
+ * Unlike the VHDL NvmeSim module this handles multiple outstanding requests and models the time taken
+ * by the Nvme to service them. It communicates using the same NvmeRequestPacket and NvmeReplyPacket
+ * packets as the real Nvme's do via the NvmeStorage FPGA system:
+ *  - Nvme register and PCIe configuration reads and writes. Only the first 16 controller registers are kept,
+ *    doorbell writes are ignored.
+ *  - Admin and IO commands written to the queue engine at 0x02000000 | queue << 16. This is the only way commands
+ *    are accepted.
+ *  - Bus master reads and writes of the command data in the hosts memory regions served by NvmeAccess::nvmeProcess().
+ *    These are the data slots at 0x00200000, the identify buffers at 0x00900000, the PRP lists and SGL segments at
+ *    0x00C00000 and the older 0x00800000 and 0x00E00000 data windows.
+ *  - Completions posted to the host at 0x00100000 for the admin queue and 0x00110000 + for the IO queues.
+ *
+ * Host managed queues, where the host writes commands to its submission queue memory at 0x00000000 or 0x00010000
+ * and rings the doorbells, are not modelled. The model neither fetches submission queue entries nor acts on
+ * doorbells.
+ *
+ * Commands are executed, with their data transfers, in a separate thread when they arrive. Their completions are
+ * posted at the time determined by the service time model. This is set by a NvmeControllerSimProfile and includes:
+ *  - The sustained media write and read rates.
+ *  - Periodic garbage collection stalls after a given amount of data has been written.
+ *  - A deallocate (trim) rate and a recovery period after a deallocate during which the write rate is reduced.
+ *
+ * As the queue engine's queues have a fixed size of 16 entries, commands on an admin queue of a different size and
+ * requests to create IO queues of a different size fail.
+ *
+ * The media write model can also be used directly, by mediaWrite(), for writes that are not performed using
+ * queued commands such as those from the NvmeStorage NvmeWrite engine.
+ *
+ * Blocks written by the host are stored in memory. The contents of other blocks are provided by the blockData()
+ * function which can be overridden. IO read and write data buffers are described by PRP1 and PRP2 or a PRP list, or
+ * by an SGL when enabled in the profile, up to a MDTS of 128k. Other commands data buffers are assumed to be contiguous from PRP1.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <NvmeAccess.h>
+
+const BUInt	NvmeCtlSimNumQueues	= 4;			///< The number of Nvme queues supported
+const BUInt	NvmeCtlSimQueueNum	= 16;			///< The queue engine's fixed number of entries in each queue
+const BUInt	NvmeCtlSimMaxCommands	= 256;			///< The maximum number of commands awaiting execution
+const BUInt	NvmeCtlSimMaxPending	= 1024;			///< The maximum number of completions awaiting posting
+const BUInt	NvmeCtlSimStoreHash	= 4096;			///< The number of hash buckets for stored blocks
+const BUInt	NvmeCtlSimLbaSize	= 512;			///< The logical block size in bytes
+const BUInt	NvmeCtlSimMdts		= 5;			///< The maximum data transfer size as a power of two of the 4k page size
+
+/// The Nvme's service time parameters
+class NvmeControllerSimProfile {
+public:
+			NvmeControllerSimProfile();
+
+	int		set(const char* params);		///< Set parameters from a "name=value,..." string. Returns 0 on success
+
+	double		writeRate;				///< Sustained media write rate in bytes per second. 0 is unlimited
+	double		readRate;				///< Media read rate in bytes per second. 0 is unlimited
+	double		latency;				///< Command latency in seconds
+	double		gcInterval;				///< Bytes written between garbage collection stalls. 0 disables
+	double		gcStall;				///< Garbage collection stall time in seconds
+	double		trimRate;				///< Deallocate rate in bytes per second. 0 is unlimited
+	double		trimRecovery;				///< Period after a deallocate with a reduced write rate in seconds
+	double		trimRecoveryRate;			///< The fraction of the write rate available during the recovery period
+	Bool		sgl;					///< SGL data transfers are supported
+};
+
+/// A stored 4k block
+class NvmeControllerSimBlock {
+public:
+	BUInt64			block;				///< The 4k block number
+	NvmeControllerSimBlock*	next;				///< The next block in the hash bucket
+	BUInt32			data[BlockSize / 4];		///< The data
+};
+
+/// A command awaiting execution
+class NvmeControllerSimCommand {
+public:
+	BUInt		queue;					///< The submission queue
+	BUInt32		cmd[16];				///< The command
+	double		arrival;				///< The time the command arrived
+};
+
+/// A completion awaiting posting
+class NvmeControllerSimCompletion {
+public:
+	double		time;					///< The time to post the completion
+	BUInt		queue;					///< The submission queue
+	BUInt32		cid;					///< The command identifier
+	BUInt32		status;					///< The status
+};
+
+/// Nvme controller model
+class NvmeControllerSim {
+public:
+				NvmeControllerSim();
+	virtual			~NvmeControllerSim();
+
+	void			init(BUInt num, BUInt64 numBlocks);			///< Set the Nvme number and size in 4k blocks
+	void			start();						///< Start the command processing thread
+	void			stop();							///< Stop the command processing thread
+	void			reset();						///< Controller reset. The stored data is kept
+
+	void			setProfile(const NvmeControllerSimProfile& profile);	///< Set the service time parameters
+	NvmeControllerSimProfile profile();						///< The service time parameters
+
+	void			hostPacket(const void* data, BUInt nbytes);		///< Packet from the host to the Nvme
+
+	double			mediaWrite(double& t, double maxBytes, double tEnd);	///< Write to the media from time t. Returns bytes written
+	void			discard(BUInt64 block, BUInt64 num);			///< Discard any stored host data in the 4k blocks
+	double			stallMax();						///< The longest write stall since clearStats()
+	void			clearStats();						///< Clear the statistics
+
+	double			trimRecoveryEnd();					///< The time the current trim recovery period ends
+	void			setTrimRecoveryEnd(double t);				///< Set the time the trim recovery period ends
+
+	void			process();						///< The command processing thread
+
+protected:
+	virtual int		send(const void* data, BUInt nbytes) = 0;		///< Send a packet to the host
+	virtual void		blockData(BUInt64 block, BUInt32* data);		///< The contents of a 4k block not written by the host
+	virtual void		deallocated(BUInt64 block, BUInt64 num);		///< Called when 4k blocks have been deallocated
+
+	void			queueWrite(BUInt queue, const BUInt32* cmd);		///< Command written to the queue engine
+	BUInt32			execute(NvmeControllerSimCommand& command, double& time);	///< Execute a command. Returns the status
+	BUInt32			executeAdmin(const BUInt32* cmd, double& time);
+	BUInt32			executeIo(const BUInt32* cmd, double& time);
+	void			postCompletion(const NvmeControllerSimCompletion& completion);
+	double			media(double& t, double maxBytes, double tEnd);		///< Media write model, called with the lock held
+
+	int			busMasterRead(BUInt64 address, BUInt32 numWords, BUInt32* data);	///< Read host memory
+	int			busMasterWrite(BUInt64 address, BUInt32 numWords, const BUInt32* data);	///< Write host memory
+	void			busMasterReply(const NvmeReplyPacket& reply);		///< Reply to a bus master read
+	int			prpTransfer(const BUInt32* cmd, BUInt64 bytes, BUInt32* data, Bool toHost);	///< Transfer a commands data using its PRP entries
+	int			sglTransfer(const BUInt32* cmd, BUInt64 bytes, BUInt32* data, Bool toHost);	///< Transfer a commands data using its SGL
+
+	int			lbaRead(BUInt64 lba, BUInt32 num, BUInt32* data);	///< Read logical blocks
+	int			lbaWrite(BUInt64 lba, BUInt32 num, const BUInt32* data);	///< Write logical blocks
+	void			lbaDeallocate(BUInt64 lba, BUInt64 num);		///< Deallocate logical blocks
+	NvmeControllerSimBlock*	storeFind(BUInt64 block);
+	NvmeControllerSimBlock*	storeAdd(BUInt64 block);
+
+	BUInt			onum;				///< The Nvme number
+	BUInt64			onumBlocks;			///< The number of 4k blocks
+	NvmeControllerSimProfile oprofile;		///< The service time parameters
+	pthread_mutex_t		omutex;				///< Access lock
+	pthread_cond_t		ocond;				///< Signaled on state changes
+	pthread_t		othread;			///< Command processing thread
+	Bool			othreadRunning;			///< The command processing thread is running
+	Bool			oexit;				///< Request the thread to exit
+
+	// Registers and queues
+	BUInt32			oconfig[64];			///< PCIe configuration space registers
+	BUInt32			oregs[16];			///< Nvme controller registers
+	BUInt32			oqueueSize[NvmeCtlSimNumQueues];	///< Queue sizes
+	BUInt32			oqueueHead[NvmeCtlSimNumQueues];	///< Submission queue head positions
+	BUInt32			ocqTail[NvmeCtlSimNumQueues];	///< Completion queue tail positions
+	BUInt32			oqueuePhase[NvmeCtlSimNumQueues];	///< Completion queue phase bits
+
+	// Command processing
+	NvmeControllerSimCommand	ocommands[NvmeCtlSimMaxCommands];	///< Commands awaiting execution
+	BUInt			ocommandsIn;			///< Command fifo write position
+	BUInt			ocommandsNum;			///< Number of commands awaiting execution
+	NvmeControllerSimCompletion	opending[NvmeCtlSimMaxPending];	///< Completions awaiting posting, in time order
+	BUInt			opendingNum;			///< Number of completions awaiting posting
+
+	// Bus master reads
+	BUInt8			obmTag;				///< The tag of the bus master read in progress
+	BUInt32*		obmData;			///< The bus master read data buffer
+	BUInt32			obmNumWords;			///< The number of words to read
+	BUInt32			obmReceived;			///< The number of words received
+
+	// Service time model
+	double			obusyTime;			///< The time the media is busy until
+	double			ogcBytes;			///< The bytes to be written before the next garbage collection
+	double			ogcEnd;				///< The time the current garbage collection stall ends
+	double			otrimRecoveryEnd;		///< The time the current trim recovery period ends
+	double			ostallMax;			///< The longest write stall
+
+	// Storage
+	NvmeControllerSimBlock*	ostore[NvmeCtlSimStoreHash];	///< Blocks written by the host
+};
@@ -0,0 +1,743 @@
+/*******************************************************************************
+ *	NvmeStorageSim.cpp	Software model of the NvmeStorage FPGA system
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeStorageSim
+ * @version	0.0.1
+ *
+ * @brief
+ * This is a software model of the NvmeStorage FPGA system as seen from the host.
+ *
+ * @details
+ * See NvmeStorageSim.h for details.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define	LDEBUG1		0		// High level debug
+#define	LDEBUG2		0		// Nvme packet debug
+
+#include <NvmeStorageSim.h>
+
+const BUInt32	NvmeStorageUnitId	= 0x56010001;		///< The NvmeStorageUnit's ident register value
+
+// The NvmeStorageUnit register numbers
+const BUInt	UnitRegIdent		= 0;
+const BUInt	UnitRegControl		= 1;
+const BUInt	UnitRegStatus		= 2;
+const BUInt	UnitRegTotalBlocks	= 3;
+const BUInt	UnitRegLostBlocks	= 4;
+const BUInt	UnitRegWrite		= 16;
+const BUInt	UnitRegRead		= 32;
+
+NvmeStorageSimNvme::NvmeStorageSimNvme(){
+	ounit = 0;
+}
+
+void NvmeStorageSimNvme::setUnit(NvmeStorageSimUnit* unit){
+	ounit = unit;
+}
+
+int NvmeStorageSimNvme::send(const void* data, BUInt nbytes){
+	return ounit->send(data, nbytes);
+}
+
+void NvmeStorageSimNvme::blockData(BUInt64 block, BUInt32* data){
+	ounit->blockData(block, data);
+}
+
+void NvmeStorageSimNvme::deallocated(BUInt64 block, BUInt64 num){
+	ounit->deallocate(block, num);
+}
+
+
+/// Start the NvmeRead engine thread
+static void* readProcess(void* arg){
+	NvmeStorageSimUnit*	unit = (NvmeStorageSimUnit*)arg;
+
+	unit->readProcess();
+	return 0;
+}
+
+NvmeStorageSimUnit::NvmeStorageSimUnit(){
+	osim = 0;
+	onum = 0;
+	othreadRunning = 0;
+	oexit = 0;
+	oextentsNum = 0;
+	onvme.setUnit(this);
+	pthread_mutex_init(&omutex, 0);
+	pthread_cond_init(&ocond, 0);
+	reset();
+	oresetEnd = 0;
+}
+
+NvmeStorageSimUnit::~NvmeStorageSimUnit(){
+	stop();
+	pthread_cond_destroy(&ocond);
+	pthread_mutex_destroy(&omutex);
+}
+
+void NvmeStorageSimUnit::init(NvmeStorageSim* sim, BUInt num){
+	osim = sim;
+	onum = num;
+	onvme.init(num, NvmeSimTotalBlocks);
+
+	// Initial contents as from a dual Nvme capture starting at block 0
+	oextentsNum = 0;
+	addExtent(0, NvmeSimTotalBlocks, onum, 2);
+}
+
+void NvmeStorageSimUnit::start(){
+	oexit = 0;
+	pthread_create(&othread, 0, ::readProcess, this);
+	othreadRunning = 1;
+	onvme.start();
+}
+
+void NvmeStorageSimUnit::stop(){
+	if(othreadRunning){
+		pthread_mutex_lock(&omutex);
+		oexit = 1;
+		pthread_cond_broadcast(&ocond);
+		pthread_mutex_unlock(&omutex);
+
+		pthread_join(othread, 0);
+		othreadRunning = 0;
+	}
+	onvme.stop();
+}
+
+void NvmeStorageSimUnit::reset(){
+	dl1printf("NvmeStorageSimUnit::reset: %u\n", onum);
+	ocontrol = 0;
+
+	owriteStart = 0;
+	owriteSize = 0;
+	owriteNumBlocks = 0;
+	owriteTimeUs = 0;
+	owritePeakLatency = 0;
+	owriteEnabled = 0;
+	owriteStartTime = 0;
+	owriteTime = 0;
+	owriteBytes = 0;
+	owriteRampBlock = 0;
+	owriteRampStride = 1;
+	owriteExtent = -1;
+
+	oreadControl = 0;
+	oreadStart = 0;
+	oreadSize = 0;
+	oreadNumBlocks = 0;
+	oreadComplete = 0;
+
+	onvme.reset();
+}
+
+void NvmeStorageSimUnit::update(){
+	double	t;
+	double	stall;
+	BUInt32	n;
+
+	if(!owriteEnabled || (owriteNumBlocks == owriteSize))
+		return;
+
+	// The Nvme's media write model determines the progress
+	t = getTime();
+	owriteBytes += onvme.mediaWrite(owriteTime, double(BlockSize) * owriteSize - owriteBytes, t);
+	n = BUInt32(owriteBytes / BlockSize);
+	if(n > owriteSize)
+		n = owriteSize;
+
+	owriteNumBlocks = n;
+	if(owriteExtent >= 0)
+		oextents[owriteExtent].num = n;
+
+	if(n == owriteSize)
+		owriteTimeUs = BUInt32(1e6 * (owriteTime - owriteStartTime));
+	else
+		owriteTimeUs = BUInt32(1e6 * (t - owriteStartTime));
+
+	stall = 1e6 * onvme.stallMax();
+	owritePeakLatency = n ? ((stall > osim->owriteLatencyUs) ? BUInt32(stall) : osim->owriteLatencyUs) : 0;
+}
+
+void NvmeStorageSimUnit::addExtent(BUInt32 start, BUInt32 num, BUInt32 rampBlock, BUInt32 rampStride, Bool deallocated){
+	if(oextentsNum == NvmeSimMaxExtents){
+		// Forget the oldest region
+		memmove(&oextents[0], &oextents[1], (NvmeSimMaxExtents - 1) * sizeof(NvmeStorageSimExtent));
+		oextentsNum--;
+		if(owriteExtent >= 0)
+			owriteExtent--;
+	}
+
+	oextents[oextentsNum].start = start;
+	oextents[oextentsNum].num = num;
+	oextents[oextentsNum].rampBlock = rampBlock;
+	oextents[oextentsNum].rampStride = rampStride;
+	oextents[oextentsNum].deallocated = deallocated;
+	oextentsNum++;
+}
+
+void NvmeStorageSimUnit::compactExtents(){
+	int	e;
+	int	n;
+
+	// Remove regions completely overwritten by later ones
+	for(e = oextentsNum - 2; e >= 0; e--){
+		for(n = e + 1; n < int(oextentsNum); n++){
+			if((oextents[n].start <= oextents[e].start) && ((BUInt64(oextents[n].start) + oextents[n].num) >= (BUInt64(oextents[e].start) + oextents[e].num))){
+				memmove(&oextents[e], &oextents[e + 1], (oextentsNum - e - 1) * sizeof(NvmeStorageSimExtent));
+				oextentsNum--;
+				if(owriteExtent > e)
+					owriteExtent--;
+				break;
+			}
+		}
+	}
+}
+
+Bool NvmeStorageSimUnit::blockRamp(BUInt32 block, BUInt32& rampBlock){
+	int	e;
+
+	for(e = oextentsNum - 1; e >= 0; e--){
+		if((block >= oextents[e].start) && ((block - oextents[e].start) < oextents[e].num)){
+			rampBlock = oextents[e].rampBlock + (block - oextents[e].start) * oextents[e].rampStride;
+			return !oextents[e].deallocated;
+		}
+	}
+
+	return 0;
+}
+
+BUInt32 NvmeStorageSimUnit::readReg(BUInt reg){
+	BUInt32	v = 0xFFFFFFFF;
+
+	pthread_mutex_lock(&omutex);
+
+	// All registers return the reset active bit while in reset
+	if(getTime() < oresetEnd){
+		pthread_mutex_unlock(&omutex);
+		return 1;
+	}
+
+	update();
+
+	switch(reg){
+	case UnitRegIdent:		v = NvmeStorageUnitId;				break;
+	case UnitRegControl:		v = ocontrol;					break;
+	case UnitRegStatus:
+		v = (1 << 31) | (1 << 30) | (ocontrol & 0x06);
+		if(owriteEnabled && (owriteNumBlocks == owriteSize))
+			v |= (1 << 3);
+		break;
+	case UnitRegTotalBlocks:	v = NvmeSimTotalBlocks;				break;
+	case UnitRegLostBlocks:		v = 0;						break;
+	case UnitRegWrite + 0:		v = owriteStart;				break;
+	case UnitRegWrite + 1:		v = owriteSize;					break;
+	case UnitRegWrite + 2:		v = 0;						break;
+	case UnitRegWrite + 3:		v = owriteNumBlocks;				break;
+	case UnitRegWrite + 4:		v = owriteTimeUs;				break;
+	case UnitRegWrite + 5:		v = owritePeakLatency;				break;
+	case UnitRegWrite + 6:		v = 0;						break;
+	case UnitRegWrite + 7:		v = owriteNumBlocks & 0xFFFF;			break;
+	case UnitRegRead + 0:		v = oreadControl;				break;
+	case UnitRegRead + 1:		v = (oreadControl & 1) | (oreadComplete << 1);	break;
+	case UnitRegRead + 2:		v = oreadStart;					break;
+	case UnitRegRead + 3:		v = oreadSize;					break;
+	case UnitRegRead + 4:		v = 0;						break;
+	}
+
+	pthread_mutex_unlock(&omutex);
+
+	return v;
+}
+
+Bool NvmeStorageSimUnit::writeStarting(BUInt reg, BUInt32 data){
+	Bool	r;
+
+	pthread_mutex_lock(&omutex);
+	r = (reg == UnitRegControl) && !(data & 1) && (data & 4) && !(ocontrol & 4) && (getTime() >= oresetEnd);
+	pthread_mutex_unlock(&omutex);
+
+	return r;
+}
+
+Bool NvmeStorageSimUnit::readStarting(BUInt reg, BUInt32 data){
+	Bool	r;
+
+	pthread_mutex_lock(&omutex);
+	r = (reg == UnitRegRead) && (data & 1) && !(oreadControl & 1);
+	pthread_mutex_unlock(&omutex);
+
+	return r;
+}
+
+void NvmeStorageSimUnit::setRamp(BUInt32 rampBlock, BUInt32 rampStride){
+	pthread_mutex_lock(&omutex);
+	owriteRampBlock = rampBlock;
+	owriteRampStride = rampStride;
+	pthread_mutex_unlock(&omutex);
+}
+
+void NvmeStorageSimUnit::writeReg(BUInt reg, BUInt32 data){
+	BUInt32	prev;
+
+	pthread_mutex_lock(&omutex);
+
+	if(getTime() < oresetEnd){
+		pthread_mutex_unlock(&omutex);
+		return;
+	}
+
+	switch(reg){
+	case UnitRegControl:
+		if(data & 1){
+			reset();
+			oresetEnd = getTime() + osim->oresetTime;
+			break;
+		}
+
+		prev = ocontrol;
+		ocontrol = data;
+		if((data & 4) && !(prev & 4)){
+			// Start the NvmeWrite engine
+			owriteEnabled = 1;
+			owriteStartTime = getTime();
+			owriteTime = owriteStartTime;
+			owriteBytes = 0;
+			owriteNumBlocks = 0;
+			owriteTimeUs = 0;
+			owritePeakLatency = 0;
+			onvme.clearStats();
+			onvme.discard(owriteStart, owriteSize);
+			addExtent(owriteStart, 0, owriteRampBlock, owriteRampStride);
+			owriteExtent = oextentsNum - 1;
+			dl1printf("NvmeStorageSimUnit: %u: NvmeWrite start: %u num: %u\n", onum, owriteStart, owriteSize);
+		}
+		else if(!(data & 4) && (prev & 4)){
+			// Stop the NvmeWrite engine
+			update();
+			owriteEnabled = 0;
+			owriteExtent = -1;
+			compactExtents();
+		}
+		break;
+
+	case UnitRegWrite + 0:
+		owriteStart = data;
+		break;
+
+	case UnitRegWrite + 1:
+		owriteSize = (data > NvmeSimTotalBlocks) ? NvmeSimTotalBlocks : data;
+		break;
+
+	case UnitRegRead + 0:
+		// The engine leaves its complete state as soon as it is disabled
+		oreadControl = data;
+		if(!(data & 1))
+			oreadComplete = 0;
+		pthread_cond_broadcast(&ocond);
+		break;
+
+	case UnitRegRead + 2:
+		oreadStart = data;
+		break;
+
+	case UnitRegRead + 3:
+		oreadSize = data;
+		break;
+	}
+
+	pthread_mutex_unlock(&omutex);
+}
+
+int NvmeStorageSimUnit::send(const void* data, BUInt nbytes){
+	NvmeTransportLoopback*	transport = osim->transport();
+
+	if(!transport)
+		return 1;
+
+	return transport->deviceSend(data, nbytes);
+}
+
+void NvmeStorageSimUnit::nvmePacket(const void* data, BUInt nbytes){
+	pthread_mutex_lock(&omutex);
+	if(getTime() < oresetEnd){
+		pthread_mutex_unlock(&omutex);
+		return;
+	}
+	pthread_mutex_unlock(&omutex);
+
+	onvme.hostPacket(data, nbytes);
+}
+
+NvmeStorageSimNvme& NvmeStorageSimUnit::nvme(){
+	return onvme;
+}
+
+void NvmeStorageSimUnit::blockData(BUInt64 block, BUInt32* data){
+	BUInt32	rampBlock;
+	BUInt32	v;
+	BUInt	w;
+	Bool	valid;
+
+	pthread_mutex_lock(&omutex);
+	update();
+	valid = blockRamp(block, rampBlock);
+	pthread_mutex_unlock(&omutex);
+
+	v = rampBlock * (BlockSize / 4);
+	for(w = 0; w < BlockSize / 4; w++)
+		data[w] = valid ? v++ : 0;
+}
+
+void NvmeStorageSimUnit::deallocate(BUInt64 block, BUInt64 num){
+	if(block >= NvmeSimTotalBlocks)
+		return;
+	if(num > (NvmeSimTotalBlocks - block))
+		num = NvmeSimTotalBlocks - block;
+
+	pthread_mutex_lock(&omutex);
+	update();
+	addExtent(block, num, 0, 0, 1);
+	compactExtents();
+	pthread_mutex_unlock(&omutex);
+}
+
+void NvmeStorageSimUnit::save(FILE* file){
+	BUInt	e;
+
+	pthread_mutex_lock(&omutex);
+	update();
+	fprintf(file, "unit %u %u %.6f\n", onum, oextentsNum, onvme.trimRecoveryEnd());
+	for(e = 0; e < oextentsNum; e++)
+		fprintf(file, "extent %u %u %u %u %u\n", oextents[e].start, oextents[e].num, oextents[e].rampBlock, oextents[e].rampStride, oextents[e].deallocated);
+	pthread_mutex_unlock(&omutex);
+}
+
+int NvmeStorageSimUnit::load(FILE* file){
+	BUInt	num;
+	BUInt	n;
+	BUInt	e;
+	BUInt	d;
+	double	t;
+
+	if((fscanf(file, " unit %u %u %lf", &num, &n, &t) != 3) || (num != onum) || (n > NvmeSimMaxExtents))
+		return 1;
+
+	pthread_mutex_lock(&omutex);
+	for(e = 0; e < n; e++){
+		if(fscanf(file, " extent %u %u %u %u %u", &oextents[e].start, &oextents[e].num, &oextents[e].rampBlock, &oextents[e].rampStride, &d) != 5){
+			pthread_mutex_unlock(&omutex);
+			return 1;
+		}
+		oextents[e].deallocated = d;
+	}
+	oextentsNum = n;
+	pthread_mutex_unlock(&omutex);
+
+	onvme.setTrimRecoveryEnd(t);
+
+	return 0;
+}
+
+void NvmeStorageSimUnit::readProcess(){
+	NvmeRequestPacket	packet;
+	BUInt32			block;
+	BUInt32			rampBlock;
+	BUInt32			a;
+	BUInt32			w;
+	BUInt32			v;
+	Bool			valid;
+	double			ts;
+	double			t;
+
+	pthread_mutex_lock(&omutex);
+	while(!oexit){
+		if(!(oreadControl & 1) || oreadComplete){
+			if(!(oreadControl & 1))
+				oreadComplete = 0;
+			pthread_cond_wait(&ocond, &omutex);
+			continue;
+		}
+
+		dl1printf("NvmeStorageSimUnit: %u: NvmeRead start: %u num: %u\n", onum, oreadStart, oreadSize);
+		oreadNumBlocks = 0;
+		ts = getTime();
+		while(!oexit && (oreadControl & 1) && (oreadNumBlocks < oreadSize)){
+			update();
+			block = oreadNumBlocks;
+			valid = blockRamp(oreadStart + block, rampBlock);
+			pthread_mutex_unlock(&omutex);
+
+			// The NvmeStreamMux keeps the two Nvme's data streams roughly in step
+			if(osim->readMux(onum, block)){
+				pthread_mutex_lock(&omutex);
+				break;
+			}
+
+			// Limit the rate if required
+			if(osim->oreadRate > 0){
+				t = ts + (double(block + 1) * BlockSize / osim->oreadRate) - getTime();
+				if(t > 0.001)
+					usleep(BUInt(t * 1e6));
+			}
+
+			// Send the block to the host as Pcie write requests to the 0x01FXXXXX region
+			for(a = 0; a < BlockSize / 4; a += PcieMaxPayloadSize){
+				packet.request = 1;
+				packet.numWords = PcieMaxPayloadSize;
+				packet.address = (onum ? 0x11F00000 : 0x01F00000) | ((block & 0xFF) << 12) | (a * 4);
+
+				v = valid ? (rampBlock * (BlockSize / 4) + a) : 0;
+				for(w = 0; w < PcieMaxPayloadSize; w++)
+					packet.data[w] = valid ? v++ : 0;
+
+				if(send(&packet, 16 + (4 * PcieMaxPayloadSize))){
+					osim->readMuxDone(onum);
+					pthread_mutex_lock(&omutex);
+					oexit = 1;
+					pthread_mutex_unlock(&omutex);
+					return;
+				}
+			}
+
+			pthread_mutex_lock(&omutex);
+			oreadNumBlocks++;
+		}
+		osim->readMuxDone(onum);
+		if(oreadControl & 1)
+			oreadComplete = 1;
+	}
+	pthread_mutex_unlock(&omutex);
+}
+
+
+NvmeStorageSim::NvmeStorageSim(){
+	ostateFile = 0;
+	oreadRate = 0;
+	oresetTime = 0.1;
+	owriteLatencyUs = 100;
+	ocontrol = 0;
+	omuxExit = 0;
+	omuxActive[0] = omuxActive[1] = 0;
+	omuxBlock[0] = omuxBlock[1] = 0;
+	pthread_mutex_init(&omuxMutex, 0);
+	pthread_cond_init(&omuxCond, 0);
+	ounits[0].init(this, 0);
+	ounits[1].init(this, 1);
+}
+
+NvmeStorageSim::~NvmeStorageSim(){
+	detach();
+	pthread_cond_destroy(&omuxCond);
+	pthread_mutex_destroy(&omuxMutex);
+}
+
+void NvmeStorageSim::setWriteRate(double rate){
+	NvmeControllerSimProfile	profile = ounits[0].nvme().profile();
+
+	profile.writeRate = rate * 1024 * 1024;
+	ounits[0].nvme().setProfile(profile);
+	ounits[1].nvme().setProfile(profile);
+}
+
+void NvmeStorageSim::setReadRate(double rate){
+	oreadRate = rate * 1024 * 1024;
+}
+
+int NvmeStorageSim::setProfile(const char* params){
+	NvmeControllerSimProfile	profile = ounits[0].nvme().profile();
+
+	if(profile.set(params))
+		return 1;
+
+	ounits[0].nvme().setProfile(profile);
+	ounits[1].nvme().setProfile(profile);
+
+	return 0;
+}
+
+void NvmeStorageSim::setStateFile(const char* filename){
+	ostateFile = filename;
+}
+
+int NvmeStorageSim::load(){
+	FILE*	file;
+	int	e = 0;
+
+	if(!ostateFile)
+		return 0;
+
+	// No state file is the initial state
+	if(!(file = fopen(ostateFile, "r")))
+		return 0;
+
+	if(ounits[0].load(file) || ounits[1].load(file)){
+		fprintf(stderr, "Error: Bad NvmeStorageSim state file: %s\n", ostateFile);
+		e = 1;
+	}
+	fclose(file);
+
+	return e;
+}
+
+int NvmeStorageSim::save(){
+	FILE*	file;
+
+	if(!ostateFile)
+		return 0;
+
+	if(!(file = fopen(ostateFile, "w"))){
+		fprintf(stderr, "Error: Unable to write NvmeStorageSim state file: %s\n", ostateFile);
+		return 1;
+	}
+	ounits[0].save(file);
+	ounits[1].save(file);
+	fclose(file);
+
+	return 0;
+}
+
+NvmeTransportLoopback* NvmeStorageSim::transport(){
+	return otransport;
+}
+
+Bool NvmeStorageSim::readMux(BUInt unit, BUInt32 block){
+	Bool	r;
+
+	pthread_mutex_lock(&omuxMutex);
+	omuxActive[unit] = 1;
+	omuxBlock[unit] = block;
+	pthread_cond_broadcast(&omuxCond);
+
+	while(!omuxExit && omuxActive[!unit] && (block > (omuxBlock[!unit] + NvmeSimMuxSlack)))
+		pthread_cond_wait(&omuxCond, &omuxMutex);
+
+	r = omuxExit;
+	pthread_mutex_unlock(&omuxMutex);
+
+	return r;
+}
+
+void NvmeStorageSim::readMuxDone(BUInt unit){
+	pthread_mutex_lock(&omuxMutex);
+	omuxActive[unit] = 0;
+	pthread_cond_broadcast(&omuxCond);
+	pthread_mutex_unlock(&omuxMutex);
+}
+
+void NvmeStorageSim::attach(NvmeTransportLoopback* transport){
+	pthread_mutex_lock(&omuxMutex);
+	omuxExit = 0;
+	pthread_mutex_unlock(&omuxMutex);
+
+	load();
+
+	NvmeLoopbackDevice::attach(transport);
+	ounits[0].start();
+	ounits[1].start();
+}
+
+void NvmeStorageSim::detach(){
+	pthread_mutex_lock(&omuxMutex);
+	omuxExit = 1;
+	pthread_cond_broadcast(&omuxCond);
+	pthread_mutex_unlock(&omuxMutex);
+
+	ounits[0].stop();
+	ounits[1].stop();
+
+	if(otransport)
+		save();
+
+	NvmeLoopbackDevice::detach();
+}
+
+BUInt32 NvmeStorageSim::readReg(BUInt32 address){
+	BUInt	reg = (address >> 2) & 0x3F;
+
+	if(address == RegLostBlocks)
+		return 0;
+	else if(address >= 0x200)
+		return ounits[1].readReg(reg);
+	else
+		return ounits[0].readReg(reg);
+}
+
+void NvmeStorageSim::writeReg(BUInt32 address, BUInt32 data){
+	BUInt	reg = (address >> 2) & 0x3F;
+	Bool	write0 = (address < 0x200);
+	Bool	write1 = (address < 0x100) || (address >= 0x200);
+	Bool	start0;
+	Bool	start1;
+
+	if(address == RegControl)
+		ocontrol = data;
+
+	// The TestDataStream's blocks are passed alternately to the two units when both are enabled
+	start0 = write0 && ounits[0].writeStarting(reg, data);
+	start1 = write1 && ounits[1].writeStarting(reg, data);
+	if(start0 && start1){
+		ounits[0].setRamp(0, 2);
+		ounits[1].setRamp(1, 2);
+	}
+	else if(start0){
+		ounits[0].setRamp(0, 1);
+	}
+	else if(start1){
+		ounits[1].setRamp(0, 1);
+	}
+
+	// When both NvmeRead engines are started together neither may run ahead before the other has sent its first block
+	if(write0 && write1 && ounits[0].readStarting(reg, data) && ounits[1].readStarting(reg, data)){
+		pthread_mutex_lock(&omuxMutex);
+		omuxActive[0] = omuxActive[1] = 1;
+		omuxBlock[0] = omuxBlock[1] = 0;
+		pthread_mutex_unlock(&omuxMutex);
+	}
+
+	if(write0)
+		ounits[0].writeReg(reg, data);
+	if(write1)
+		ounits[1].writeReg(reg, data);
+}
+
+int NvmeStorageSim::hostSend(const void* data, BUInt nbytes){
+	const char*	p = (const char*)data;
+	const BUInt32*	d;
+	BUInt		unit;
+	BUInt		n;
+
+	// The host may send a number of packets back to back
+	while(nbytes){
+		d = (const BUInt32*)p;
+		if((nbytes < 12) || ((n = nvmePacketSize(d)) > nbytes))
+			return 1;
+
+		// The Nvme number is in bit 80 of reply packets and bit 28 of request packets
+		if(d[2] & 0x80000000)
+			unit = (d[2] >> 16) & 1;
+		else
+			unit = (d[0] >> 28) & 1;
+
+		ounits[unit].nvmePacket(d, n);
+
+		p += n;
+		nbytes -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*******************************************************************************
+ *	NvmeStorageSim.h	Software model of the NvmeStorage FPGA system
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeStorageSim
+ * @version	0.0.1
+ *
+ * @brief
+ * This is a software model of the NvmeStorage FPGA system as seen from the host.
+ *
+ * @details
+ * This models what the NvmeStorage module and its two NvmeStorageUnit's present to the host so that
+ * the host software can be run and its performance measured without the FPGA hardware.
+ * It is attached to a NvmeTransportLoopback transport and implements:
+ *  - The NvmeStorage register map. Writes below 0x100 go to both units, 0x100 to unit 0 and 0x200 to unit 1.
+ *  - The TestDataStream incrementing data ramp split into alternating 4k blocks for the two units.
+ *  - The NvmeWrite engine. This "writes" the data stream to the Nvme at a configurable rate.
+ *  - The NvmeRead engine. This sends the data blocks to the host as Pcie write packets to the 0x01F00000 region
+ *    at an optionally limited rate.
+ *  - The Nvme's themselves using NvmeControllerSim. This handles the host's Nvme register, configuration and
+ *    queued command accesses and provides the service time model, including for the NvmeWrite engine's writes.
+ *
+ * The captured data is not stored, rather the regions written by the NvmeWrite engine are recorded and
+ * the test data ramp regenerated when read. Initially the Nvme's contain the data of a dual Nvme
+ * capture starting at block 0. Blocks not written read as zero.
+ *
+ * The recorded regions and the Nvme's trim recovery state can be kept in a state file so that sequences of
+ * test_nvme runs, such as those in test_deallocate.sh, see the effects of earlier runs. Data written by the host's
+ * Nvme write commands is not saved.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <NvmeAccess.h>
+#include <NvmeControllerSim.h>
+
+const BUInt	NvmeSimMaxExtents	= 64;			///< The maximum number of written regions remembered per Nvme
+const BUInt32	NvmeSimTotalBlocks	= 104857600;		///< The total number of 4k blocks available on each Nvme (400G)
+const BUInt32	NvmeSimMuxSlack		= 16;			///< The number of blocks a NvmeRead engine may get ahead of the other
+
+/// A region of Nvme blocks containing test data ramp blocks
+class NvmeStorageSimExtent {
+public:
+	BUInt32		start;				///< The first Nvme block
+	BUInt32		num;				///< The number of blocks
+	BUInt32		rampBlock;			///< The data ramp block number for the first block
+	BUInt32		rampStride;			///< The data ramp block increment per Nvme block
+	Bool		deallocated;			///< The blocks have been deallocated and read as zero
+};
+
+class NvmeStorageSim;
+class NvmeStorageSimUnit;
+
+/// The model of a NvmeStorageUnit's Nvme
+class NvmeStorageSimNvme : public NvmeControllerSim {
+public:
+			NvmeStorageSimNvme();
+
+	void		setUnit(NvmeStorageSimUnit* unit);
+
+protected:
+	int		send(const void* data, BUInt nbytes);
+	void		blockData(BUInt64 block, BUInt32* data);
+	void		deallocated(BUInt64 block, BUInt64 num);
+
+	NvmeStorageSimUnit*	ounit;				///< The unit the Nvme is attached to
+};
+
+/// The model of a single NvmeStorageUnit and its Nvme
+class NvmeStorageSimUnit {
+public:
+			NvmeStorageSimUnit();
+			~NvmeStorageSimUnit();
+
+	void		init(NvmeStorageSim* sim, BUInt num);
+	void		start();						///< Start the units processing thread
+	void		stop();							///< Stop the units processing thread
+
+	BUInt32		readReg(BUInt reg);					///< Read the units register
+	void		writeReg(BUInt reg, BUInt32 data);			///< Write the units register
+	Bool		writeStarting(BUInt reg, BUInt32 data);			///< True if the register write would start the NvmeWrite engine
+	Bool		readStarting(BUInt reg, BUInt32 data);			///< True if the register write would start the NvmeRead engine
+	void		setRamp(BUInt32 rampBlock, BUInt32 rampStride);		///< Set the data ramp position for the next NvmeWrite
+
+	void		nvmePacket(const void* data, BUInt nbytes);		///< Packet from the host to the Nvme
+	NvmeStorageSimNvme&	nvme();						///< The units Nvme
+
+	void		readProcess();						///< The NvmeRead engine thread
+
+	int		send(const void* data, BUInt nbytes);			///< Send a packet to the host
+	void		blockData(BUInt64 block, BUInt32* data);		///< The contents of a Nvme block
+	void		deallocate(BUInt64 block, BUInt64 num);			///< Record a deallocated region
+
+	void		save(FILE* file);					///< Save the units state
+	int		load(FILE* file);					///< Load the units state
+
+protected:
+	void		reset();						///< Perform the units reset
+	void		update();						///< Update the NvmeWrite engine state to the current time
+	Bool		blockRamp(BUInt32 block, BUInt32& rampBlock);		///< Find the data ramp block written to an Nvme block
+	void		addExtent(BUInt32 start, BUInt32 num, BUInt32 rampBlock, BUInt32 rampStride, Bool deallocated = 0);
+	void		compactExtents();					///< Remove regions that have been completely overwritten
+
+	NvmeStorageSim*		osim;				///< The system
+	BUInt			onum;				///< The unit number
+	pthread_mutex_t		omutex;				///< Unit access lock
+	pthread_cond_t		ocond;				///< Signaled on control changes
+	pthread_t		othread;			///< NvmeRead engine thread
+	Bool			othreadRunning;			///< The NvmeRead engine thread is running
+	Bool			oexit;				///< Request the thread to exit
+
+	// Unit registers
+	BUInt32			ocontrol;			///< The control register
+	double			oresetEnd;			///< The time the reset completes
+
+	// NvmeWrite engine
+	BUInt32			owriteStart;			///< The data chunk start block
+	BUInt32			owriteSize;			///< The data chunk size in blocks
+	BUInt32			owriteNumBlocks;		///< The number of blocks written
+	BUInt32			owriteTimeUs;			///< The write time in microseconds
+	BUInt32			owritePeakLatency;		///< The peak write latency in microseconds
+	Bool			owriteEnabled;			///< The NvmeWrite engine is running
+	double			owriteStartTime;		///< The time the NvmeWrite engine was started
+	double			owriteTime;			///< The time the Nvme's writes have been modelled to
+	double			owriteBytes;			///< The number of bytes written
+	BUInt32			owriteRampBlock;		///< The data ramp block for the next NvmeWrite
+	BUInt32			owriteRampStride;		///< The data ramp stride for the next NvmeWrite
+	int			owriteExtent;			///< The extent being written to
+
+	// NvmeRead engine
+	BUInt32			oreadControl;			///< The read control register
+	BUInt32			oreadStart;			///< The read start block
+	BUInt32			oreadSize;			///< The read number of blocks
+	BUInt32			oreadNumBlocks;			///< The number of blocks read
+	Bool			oreadComplete;			///< The read is complete
+
+	// Nvme storage
+	NvmeStorageSimExtent	oextents[NvmeSimMaxExtents];	///< The regions of data written, newest last
+	BUInt			oextentsNum;			///< The number of regions
+
+	// Nvme model
+	NvmeStorageSimNvme	onvme;				///< The Nvme
+};
+
+/// The NvmeStorage system model
+class NvmeStorageSim : public NvmeLoopbackDevice {
+public:
+			NvmeStorageSim();
+			~NvmeStorageSim();
+
+	void		setWriteRate(double rate);				///< Set the per Nvme write rate in MBytes/s
+	void		setReadRate(double rate);				///< Set the per Nvme read rate in MBytes/s. 0 is unlimited
+	int		setProfile(const char* params);				///< Set the Nvme's service time profile parameters. Returns 0 on success
+	void		setStateFile(const char* filename);			///< Load and save the Nvme's state to the given file
+
+	void		attach(NvmeTransportLoopback* transport);
+	void		detach();
+
+	BUInt32		readReg(BUInt32 address);
+	void		writeReg(BUInt32 address, BUInt32 data);
+	int		hostSend(const void* data, BUInt nbytes);
+
+	NvmeTransportLoopback*	transport();				///< The transport attached to
+	Bool		readMux(BUInt unit, BUInt32 block);			///< Wait until the NvmeRead engine may send the block. Returns 1 on exit
+	void		readMuxDone(BUInt unit);				///< The units NvmeRead engine has stopped
+
+protected:
+	int		load();							///< Load the state from the state file
+	int		save();							///< Save the state to the state file
+
+public:
+	double			oreadRate;			///< The read rate in bytes per second, 0 is unlimited
+	double			oresetTime;			///< The reset period in seconds
+	BUInt32			owriteLatencyUs;		///< The modelled Nvme write latency in microseconds
+
+protected:
+	NvmeStorageSimUnit	ounits[2];			///< The two NvmeStorageUnits
+	BUInt32			ocontrol;			///< The NvmeStorage control register
+	const char*		ostateFile;			///< The state file
+	pthread_mutex_t		omuxMutex;			///< NvmeStreamMux access lock
+	pthread_cond_t		omuxCond;			///< Signaled on NvmeRead engine progress
+	Bool			omuxExit;			///< Stop waiting, the transport is closing
+	Bool			omuxActive[2];			///< The units NvmeRead engine is active
+	BUInt32			omuxBlock[2];			///< The units NvmeRead engine block position
+};
@@ -0,0 +1,382 @@
+/*******************************************************************************
+ *	NvmeTransport.cpp	Host to FPGA transports used by NvmeAccess
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeTransport
+ * @version	0.0.1
+ *
+ * @brief
+ * This provides the interface NvmeAccess uses to communicate with the NvmeStorage FPGA system.
+ *
+ * @details
+ * See NvmeTransport.h for details.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#define	LDEBUG1		0		// High level debug
+
+#include <NvmeTransport.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+const BUInt32	LoopbackNumRegs		= 1024;		///< The number of registers in the loopback register window
+const BUInt32	LoopbackWrap		= 0xFFFFFFFF;	///< Marker in the stream buffer for a wrap to its start
+
+NvmeTransport::NvmeTransport(){
+}
+
+NvmeTransport::~NvmeTransport(){
+}
+
+BUInt32 NvmeTransport::readDmaReg(BUInt32 address){
+	return 0;
+}
+
+
+NvmeTransportBfpga::NvmeTransportBfpga(){
+	oregsFd = -1;
+	ohostSendFd = -1;
+	ohostRecvFd = -1;
+	oregs = 0;
+	odmaRegs = 0;
+}
+
+NvmeTransportBfpga::~NvmeTransportBfpga(){
+	close();
+}
+
+int NvmeTransportBfpga::open(){
+	int	r;
+	void*	p;
+
+	if((oregsFd = ::open("/dev/bfpga0", O_RDWR | O_SYNC)) < 0){
+		fprintf(stderr, "Unable to open /dev/bfpga0\n");
+		return 1;
+	}
+
+	if((r = ioctl(oregsFd, BFPGA_CMD_GETINFO, &oinfo)) < 0){
+		fprintf(stderr, "Error ioctl: %s\n", strerror(errno));
+		return 1;
+	}
+	dl1printf("Driver Register Addresses: %x(%x)\n", oinfo.regs.physAddress, oinfo.regs.length);
+
+	if((p = mmap(0, oinfo.regs.length, PROT_READ|PROT_WRITE, MAP_SHARED, oregsFd, oinfo.regs.physAddress)) == MAP_FAILED){
+		fprintf(stderr, "Error mmap: %s\n", strerror(errno));
+		return 1;
+	}
+	oregs = (volatile BUInt32*)p;
+
+	if((p = mmap(0, oinfo.dmaRegs.length, PROT_READ|PROT_WRITE, MAP_SHARED, oregsFd, oinfo.dmaRegs.physAddress)) == MAP_FAILED){
+		fprintf(stderr, "Error mmap: %s\n", strerror(errno));
+		return 1;
+	}
+	odmaRegs = (volatile BUInt32*)p;
+
+	if((ohostSendFd = ::open("/dev/bfpga0-send0", O_RDWR)) < 0){
+		fprintf(stderr, "Unable to open /dev/bfpga0-send0\n");
+		return 1;
+	}
+
+	if((ohostRecvFd = ::open("/dev/bfpga0-recv0", O_RDWR)) < 0){
+		fprintf(stderr, "Unable to open /dev/bfpga0-recv0\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+void NvmeTransportBfpga::close(){
+	if(odmaRegs)
+		munmap((void*)odmaRegs, oinfo.dmaRegs.length);
+	if(oregs)
+		munmap((void*)oregs, oinfo.regs.length);
+	odmaRegs = 0;
+	oregs = 0;
+
+	if(ohostRecvFd >= 0)
+		::close(ohostRecvFd);
+	if(ohostSendFd >= 0)
+		::close(ohostSendFd);
+	if(oregsFd >= 0)
+		::close(oregsFd);
+	ohostRecvFd = -1;
+	ohostSendFd = -1;
+	oregsFd = -1;
+}
+
+BUInt32 NvmeTransportBfpga::readReg(BUInt32 address){
+	return oregs[address / 4];
+}
+
+void NvmeTransportBfpga::writeReg(BUInt32 address, BUInt32 data){
+	oregs[address / 4] = data;
+}
+
+BUInt32 NvmeTransportBfpga::readDmaReg(BUInt32 address){
+	return odmaRegs[address / 4];
+}
+
+int NvmeTransportBfpga::send(const void* data, BUInt nbytes){
+	if(write(ohostSendFd, data, nbytes) != nbytes){
+		printf("Send error\n");
+		return 1;
+	}
+	return 0;
+}
+
+int NvmeTransportBfpga::recv(void* data, BUInt nbytes){
+	return read(ohostRecvFd, data, nbytes);
+}
+
+int NvmeTransportBfpga::recvAvailable(){
+	unsigned long	n = 0;
+
+	if(ohostRecvFd >= 0){
+		if(ioctl(ohostRecvFd, FIONREAD, &n) < 0){
+			n = 0;
+		}
+	}
+
+	return n;
+}
+
+
+/// The loopback transports shared memory area. This holds the register window and a message
+/// stream buffer. Each message is stored as a 32bit length followed by the data padded to 32bits.
+class NvmeLoopbackMem {
+public:
+	pthread_mutex_t		mutex;				///< Access lock
+	pthread_cond_t		cond;				///< Signaled on any stream buffer change
+	Bool			closed;				///< The transport has been closed
+	BUInt32			regs[LoopbackNumRegs];		///< The register window
+	BUInt			size;				///< Stream buffer size in bytes
+	BUInt			used;				///< Stream buffer bytes used
+	BUInt			bytes;				///< Number of message data bytes in the stream buffer
+	BUInt			readPos;			///< Stream buffer read position
+	BUInt			readOffset;			///< Bytes already read from the message at the read position
+	BUInt			writePos;			///< Stream buffer write position
+	char			data[];				///< The stream buffer
+};
+
+NvmeLoopbackDevice::NvmeLoopbackDevice(){
+	otransport = 0;
+}
+
+NvmeLoopbackDevice::~NvmeLoopbackDevice(){
+}
+
+void NvmeLoopbackDevice::attach(NvmeTransportLoopback* transport){
+	otransport = transport;
+}
+
+void NvmeLoopbackDevice::detach(){
+	otransport = 0;
+}
+
+NvmeTransportLoopback::NvmeTransportLoopback(NvmeLoopbackDevice* device, BUInt size){
+	odevice = device;
+	osize = (size + 3) & ~3;
+	omem = 0;
+}
+
+NvmeTransportLoopback::~NvmeTransportLoopback(){
+	close();
+	delete odevice;
+	odevice = 0;
+}
+
+int NvmeTransportLoopback::open(){
+	pthread_mutexattr_t	mutexAttr;
+	pthread_condattr_t	condAttr;
+	void*			p;
+
+	if((p = mmap(0, sizeof(NvmeLoopbackMem) + osize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+		fprintf(stderr, "Error mmap: %s\n", strerror(errno));
+		return 1;
+	}
+	omem = (NvmeLoopbackMem*)p;
+	memset(omem, 0, sizeof(NvmeLoopbackMem));
+	omem->size = osize;
+
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&omem->mutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&omem->cond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+
+	if(odevice)
+		odevice->attach(this);
+
+	return 0;
+}
+
+void NvmeTransportLoopback::close(){
+	if(!omem)
+		return;
+
+	// Wake up any readers and writers
+	pthread_mutex_lock(&omem->mutex);
+	omem->closed = 1;
+	pthread_cond_broadcast(&omem->cond);
+	pthread_mutex_unlock(&omem->mutex);
+
+	if(odevice)
+		odevice->detach();
+
+	// Note the shared memory is left mapped as a receive thread may still be referencing it
+}
+
+BUInt32 NvmeTransportLoopback::readReg(BUInt32 address){
+	if(odevice)
+		return odevice->readReg(address);
+
+	return ((volatile BUInt32*)omem->regs)[(address / 4) % LoopbackNumRegs];
+}
+
+void NvmeTransportLoopback::writeReg(BUInt32 address, BUInt32 data){
+	if(odevice)
+		odevice->writeReg(address, data);
+	else
+		((volatile BUInt32*)omem->regs)[(address / 4) % LoopbackNumRegs] = data;
+}
+
+int NvmeTransportLoopback::send(const void* data, BUInt nbytes){
+	if(odevice)
+		return odevice->hostSend(data, nbytes);
+
+	// Loop back to the receive stream
+	if(deviceSend(data, nbytes)){
+		printf("Send error\n");
+		return 1;
+	}
+	return 0;
+}
+
+int NvmeTransportLoopback::deviceSend(const void* data, BUInt nbytes){
+	NvmeLoopbackMem*	m = omem;
+	BUInt			need = 4 + ((nbytes + 3) & ~3);
+	BUInt			waste;
+
+	if(need > m->size)
+		return 1;
+
+	pthread_mutex_lock(&m->mutex);
+	while(1){
+		if(m->closed){
+			pthread_mutex_unlock(&m->mutex);
+			return 1;
+		}
+
+		// Messages are kept contiguous, so the space at the end of the buffer may need to be skipped
+		waste = ((m->writePos + need) > m->size) ? (m->size - m->writePos) : 0;
+		if((m->used + waste + need) <= m->size)
+			break;
+
+		pthread_cond_wait(&m->cond, &m->mutex);
+	}
+
+	if(waste){
+		*((BUInt32*)&m->data[m->writePos]) = LoopbackWrap;
+		m->used += waste;
+		m->writePos = 0;
+	}
+
+	*((BUInt32*)&m->data[m->writePos]) = nbytes;
+	memcpy(&m->data[m->writePos + 4], data, nbytes);
+	m->used += need;
+	m->bytes += nbytes;
+	m->writePos += need;
+	if(m->writePos == m->size)
+		m->writePos = 0;
+
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+
+	return 0;
+}
+
+int NvmeTransportLoopback::recv(void* data, BUInt nbytes){
+	NvmeLoopbackMem*	m = omem;
+	char*			p = (char*)data;
+	BUInt			num = 0;
+	BUInt32			n;
+	BUInt32			c;
+
+	pthread_mutex_lock(&m->mutex);
+	while(!m->used){
+		if(m->closed){
+			pthread_mutex_unlock(&m->mutex);
+			return -1;
+		}
+		pthread_cond_wait(&m->cond, &m->mutex);
+	}
+
+	// As with a DMA stream the messages available are returned back to back. A message that does not fit
+	// is continued in the next read.
+	while(m->used && (num < nbytes)){
+		n = *((BUInt32*)&m->data[m->readPos]);
+		if(n == LoopbackWrap){
+			m->used -= (m->size - m->readPos);
+			m->readPos = 0;
+			continue;
+		}
+
+		c = n - m->readOffset;
+		if(c > (nbytes - num))
+			c = nbytes - num;
+
+		memcpy(&p[num], &m->data[m->readPos + 4 + m->readOffset], c);
+		num += c;
+		m->bytes -= c;
+		m->readOffset += c;
+
+		if(m->readOffset == n){
+			m->readOffset = 0;
+			m->used -= 4 + ((n + 3) & ~3);
+			m->readPos += 4 + ((n + 3) & ~3);
+			if(m->used == 0){
+				m->readPos = 0;
+				m->writePos = 0;
+			}
+			else if(m->readPos == m->size){
+				m->readPos = 0;
+			}
+		}
+	}
+
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+
+	return num;
+}
+
+int NvmeTransportLoopback::recvAvailable(){
+	int	n;
+
+	pthread_mutex_lock(&omem->mutex);
+	n = omem->bytes;
+	pthread_mutex_unlock(&omem->mutex);
+
+	return n;
+}
@@ -0,0 +1,137 @@
+/*******************************************************************************
+ *	NvmeTransport.h	Host to FPGA transports used by NvmeAccess
+ *******************************************************************************
+ */
+/**
+ * @class	NvmeTransport
+ * @version	0.0.1
+ *
+ * @brief
+ * This provides the interface NvmeAccess uses to communicate with the NvmeStorage FPGA system.
+ *
+ * @details
+ * A transport provides three things:
+ *  - A register window giving access to the NvmeStorage registers.
+ *  - A send stream that carries request and reply packets from the host to the FPGA.
+ *  - A receive stream that carries request and reply packets from the FPGA to the host.
+ *
+ * The streams are byte streams. A single send or receive may carry a number of packets back to back
+ * and a packet may be split across receives. The packet headers delimit the packets.
+ *
+ * Two implementations are provided:
+ *  - NvmeTransportBfpga: The real hardware accessed using the Beam bfpga Linux driver's /dev/bfpga0 devices.
+ *  - NvmeTransportLoopback: An in-process, shared memory, loopback transport. Without an attached device
+ *    the send stream is looped back to the receive stream. A NvmeLoopbackDevice can be attached to
+ *    this to model the FPGA system. The transport takes ownership of the device.
+ *
+ * The loopback transport allows the host side code paths to be exercised, profiled and benchmarked without
+ * the FPGA hardware.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <BeamLibBasic.h>
+#include <pthread.h>
+#include <bfpga_driver/bfpga.h>
+
+/// Transport interface
+class NvmeTransport {
+public:
+				NvmeTransport();
+	virtual			~NvmeTransport();
+
+	virtual int		open() = 0;						///< Open the transport
+	virtual void		close() = 0;						///< Close the transport
+
+	// Register window
+	virtual BUInt32		readReg(BUInt32 address) = 0;				///< Read a register
+	virtual void		writeReg(BUInt32 address, BUInt32 data) = 0;		///< Write a register
+	virtual BUInt32		readDmaReg(BUInt32 address);				///< Read a PCIe DMA IP register. Returns 0 if not available
+
+	// Packet streams
+	virtual int		send(const void* data, BUInt nbytes) = 0;		///< Send data on the send stream. Returns 0 on success
+	virtual int		recv(void* data, BUInt nbytes) = 0;			///< Receive data from the receive stream. Returns number of bytes or < 0 on error
+	virtual int		recvAvailable() = 0;					///< The number of bytes available on the receive stream
+};
+
+/// Transport using the Beam bfpga Linux driver
+class NvmeTransportBfpga : public NvmeTransport {
+public:
+				NvmeTransportBfpga();
+				~NvmeTransportBfpga();
+
+	int			open();
+	void			close();
+
+	BUInt32			readReg(BUInt32 address);
+	void			writeReg(BUInt32 address, BUInt32 data);
+	BUInt32			readDmaReg(BUInt32 address);
+
+	int			send(const void* data, BUInt nbytes);
+	int			recv(void* data, BUInt nbytes);
+	int			recvAvailable();
+
+protected:
+	int			oregsFd;			///< Device drive fd for register access
+	int			ohostSendFd;			///< Device driver fd for DMA send channel
+	int			ohostRecvFd;			///< Device driver fd for DMA receive channel
+	BFpgaInfo		oinfo;				///< Device driver information
+	volatile BUInt32*	oregs;				///< FPGA design's registers memory mapped
+	volatile BUInt32*	odmaRegs;			///< FPGA's PCIe XDMA modules DMA control registers memory mapped
+};
+
+class NvmeTransportLoopback;
+class NvmeLoopbackMem;
+
+/// A device model that can be attached to the loopback transport
+class NvmeLoopbackDevice {
+public:
+				NvmeLoopbackDevice();
+	virtual			~NvmeLoopbackDevice();
+
+	virtual void		attach(NvmeTransportLoopback* transport);		///< Called when attached to a transport
+	virtual void		detach();						///< Called when the transport is closed
+
+	virtual BUInt32		readReg(BUInt32 address) = 0;				///< Host register read
+	virtual void		writeReg(BUInt32 address, BUInt32 data) = 0;		///< Host register write
+	virtual int		hostSend(const void* data, BUInt nbytes) = 0;		///< Data sent by the host on the send stream
+
+protected:
+	NvmeTransportLoopback*	otransport;					///< The transport attached to
+};
+
+/// In-process shared memory loopback transport
+class NvmeTransportLoopback : public NvmeTransport {
+public:
+				NvmeTransportLoopback(NvmeLoopbackDevice* device = 0, BUInt size = 1024 * 1024);
+				~NvmeTransportLoopback();
+
+	int			open();
+	void			close();
+
+	BUInt32			readReg(BUInt32 address);
+	void			writeReg(BUInt32 address, BUInt32 data);
+
+	int			send(const void* data, BUInt nbytes);
+	int			recv(void* data, BUInt nbytes);
+	int			recvAvailable();
+
+	int			deviceSend(const void* data, BUInt nbytes);		///< Device side send of data to the hosts receive stream
+
+protected:
+	NvmeLoopbackDevice*	odevice;			///< Optional device model
+	BUInt			osize;				///< The receive stream buffer size in bytes
+	NvmeLoopbackMem*	omem;				///< The shared memory area
+};
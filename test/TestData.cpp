@@ -0,0 +1,458 @@
+/*******************************************************************************
+ *	TestData.cpp	Validation of the FPGA TestDataStream data
+ *******************************************************************************
+ */
+/**
+ * @class	TestData
+ * @version	0.0.1
+ *
+ * @brief
+ * This provides the validation of the data produced by the FPGA's TestDataStream module.
+ *
+ * @details
+ * See TestData.h for details.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <TestData.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	TestDataX86	1
+#include <immintrin.h>
+#endif
+
+/// Returns true if any of the words do not match the ramp
+typedef Bool	(*TestDataCheck)(const BUInt32* data, BUInt32 startWord, BUInt numWords);
+
+static Bool checkScalar(const BUInt32* data, BUInt32 startWord, BUInt numWords){
+	BUInt32	diff = 0;
+	BUInt	w;
+
+	for(w = 0; w < numWords; w++)
+		diff |= data[w] ^ (startWord + w);
+
+	return diff != 0;
+}
+
+#if TestDataX86
+__attribute__((target("sse2"))) static Bool checkSse2(const BUInt32* data, BUInt32 startWord, BUInt numWords){
+	__m128i	expected = _mm_add_epi32(_mm_set1_epi32(startWord), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i	step = _mm_set1_epi32(4);
+	__m128i	diff = _mm_setzero_si128();
+	BUInt	w;
+
+	for(w = 0; (w + 4) <= numWords; w += 4){
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i*)&data[w]), expected));
+		expected = _mm_add_epi32(expected, step);
+	}
+
+	if(_mm_movemask_epi8(_mm_cmpeq_epi32(diff, _mm_setzero_si128())) != 0xFFFF)
+		return 1;
+
+	return checkScalar(&data[w], startWord + w, numWords - w);
+}
+
+__attribute__((target("avx2"))) static Bool checkAvx2(const BUInt32* data, BUInt32 startWord, BUInt numWords){
+	__m256i	expected = _mm256_add_epi32(_mm256_set1_epi32(startWord), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i	step = _mm256_set1_epi32(8);
+	__m256i	diff = _mm256_setzero_si256();
+	BUInt	w;
+
+	for(w = 0; (w + 8) <= numWords; w += 8){
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&data[w]), expected));
+		expected = _mm256_add_epi32(expected, step);
+	}
+
+	if(!_mm256_testz_si256(diff, diff))
+		return 1;
+
+	return checkScalar(&data[w], startWord + w, numWords - w);
+}
+
+__attribute__((target("avx512f"))) static Bool checkAvx512(const BUInt32* data, BUInt32 startWord, BUInt numWords){
+	__m512i	expected = _mm512_add_epi32(_mm512_set1_epi32(startWord), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	__m512i	step = _mm512_set1_epi32(16);
+	__m512i	diff = _mm512_setzero_si512();
+	BUInt	w;
+
+	for(w = 0; (w + 16) <= numWords; w += 16){
+		diff = _mm512_or_si512(diff, _mm512_xor_si512(_mm512_loadu_si512((const void*)&data[w]), expected));
+		expected = _mm512_add_epi32(expected, step);
+	}
+
+	if(_mm512_test_epi32_mask(diff, diff))
+		return 1;
+
+	return checkScalar(&data[w], startWord + w, numWords - w);
+}
+#endif
+
+/// The vector implementation for this CPU
+class TestDataImplementation {
+public:
+	TestDataImplementation(){
+		name = "scalar";
+		check = checkScalar;
+#if TestDataX86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")){
+			name = "avx512";
+			check = checkAvx512;
+		}
+		else if(__builtin_cpu_supports("avx2")){
+			name = "avx2";
+			check = checkAvx2;
+		}
+		else if(__builtin_cpu_supports("sse2")){
+			name = "sse2";
+			check = checkSse2;
+		}
+#endif
+	}
+
+	const char*	name;				///< The implementation's name
+	TestDataCheck	check;				///< The block check function
+};
+
+static TestDataImplementation	implementation;
+
+BUInt testDataValidate(const void* data, BUInt32 startWord, BUInt numWords, BUInt& firstError){
+	const BUInt32*	d = (const BUInt32*)data;
+	BUInt		n = 0;
+	BUInt		w;
+
+	firstError = 0;
+	if(!implementation.check(d, startWord, numWords))
+		return 0;
+
+	// The words are 32 bit so the ramp wraps correctly
+	for(w = 0; w < numWords; w++){
+		if(d[w] != (startWord + w)){
+			if(!n++)
+				firstError = w;
+		}
+	}
+
+	return n;
+}
+
+const char* testDataValidateImplementation(){
+	return implementation.name;
+}
+
+Bool TestDataErrors::bad(){
+	return misplaced || errors;
+}
+
+int testDataAnalyse(const void* data, BUInt32 startWord, TestDataErrors& errors){
+	const BUInt32*	d = (const BUInt32*)data;
+	BUInt32		x;
+	BUInt		w;
+
+	errors.errors = 0;
+	errors.firstError = 0;
+	errors.misplaced = 0;
+	errors.offset = 0;
+	if(!implementation.check(d, startWord, TestDataBlockWords))
+		return 0;
+
+	// A whole ramp block from elsewhere in the stream
+	if(!(d[0] % TestDataBlockWords) && (d[0] != startWord) && !implementation.check(d, d[0], TestDataBlockWords)){
+		errors.misplaced = 1;
+		errors.offset = int(d[0] - startWord) / int(TestDataBlockWords);
+		return 1;
+	}
+
+	memset(errors.bits, 0, sizeof(errors.bits));
+	memset(errors.lines, 0, sizeof(errors.lines));
+	for(w = 0; w < TestDataBlockWords; w++){
+		if(x = d[w] ^ (startWord + w)){
+			if(!errors.errors++)
+				errors.firstError = w;
+			errors.lines[w / TestDataLineWords]++;
+			while(x){
+				errors.bits[__builtin_ctz(x)]++;
+				x &= x - 1;
+			}
+		}
+	}
+
+	return 1;
+}
+
+TestDataStats::TestDataStats(){
+	clear();
+}
+
+void TestDataStats::clear(){
+	blocks = 0;
+	errorBlocks = 0;
+	errorWords = 0;
+	misplacedBlocks = 0;
+	lostRuns = 0;
+	lostBlocks = 0;
+	duplicateRuns = 0;
+	duplicateBlocks = 0;
+	firstErrorBlock = 0;
+	lastErrorBlock = 0;
+	offset = 0;
+	memset(bits, 0, sizeof(bits));
+	memset(lines, 0, sizeof(lines));
+	memset(blockErrors, 0, sizeof(blockErrors));
+}
+
+void TestDataStats::add(BUInt32 blockNum, const TestDataErrors& errors){
+	BUInt	b;
+	int	o;
+
+	blocks++;
+	if(!errors.misplaced && !errors.errors){
+		o = 0;
+	}
+	else {
+		if(!bad())
+			firstErrorBlock = blockNum;
+		lastErrorBlock = blockNum;
+
+		if(errors.misplaced){
+			misplacedBlocks++;
+			o = errors.offset;
+		}
+		else {
+			// Corrupted blocks leave the stream's offset unchanged
+			o = offset;
+			errorBlocks++;
+			errorWords += errors.errors;
+			for(b = 0; b < 32; b++)
+				bits[b] += errors.bits[b];
+			for(b = 0; b < TestDataBlockLines; b++)
+				lines[b] += errors.lines[b];
+			for(b = 0; (b < (TestDataErrorBuckets - 1)) && ((2U << b) <= errors.errors); b++)
+				;
+			blockErrors[b]++;
+		}
+	}
+
+	// A change in the stream's offset is a run of lost or duplicated blocks
+	if(o > offset){
+		lostRuns++;
+		lostBlocks += o - offset;
+	}
+	else if(o < offset){
+		duplicateRuns++;
+		duplicateBlocks += offset - o;
+	}
+	offset = o;
+}
+
+Bool TestDataStats::bad(){
+	return errorBlocks || misplacedBlocks;
+}
+
+void TestDataStats::print(){
+	BUInt	b;
+
+	printf("ValidateStats: blocks: %lu errorBlocks: %lu errorWords: %lu misplacedBlocks: %lu lostRuns: %lu lostBlocks: %lu duplicateRuns: %lu duplicateBlocks: %lu",
+		blocks, errorBlocks, errorWords, misplacedBlocks, lostRuns, lostBlocks, duplicateRuns, duplicateBlocks);
+	if(bad())
+		printf(" firstErrorBlock: %u lastErrorBlock: %u", firstErrorBlock, lastErrorBlock);
+	printf("\n");
+
+	if(errorBlocks){
+		printf("ValidateBits:");
+		for(b = 0; b < 32; b++)
+			printf(" %lu", bits[b]);
+		printf("\n");
+
+		printf("ValidateLines:");
+		for(b = 0; b < TestDataBlockLines; b++)
+			printf(" %lu", lines[b]);
+		printf("\n");
+
+		printf("ValidateBlockErrors:");
+		for(b = 0; b < TestDataErrorBuckets; b++)
+			printf(" %lu", blockErrors[b]);
+		printf("\n");
+	}
+}
+
+int testDataCheckEdges(const void* data, BUInt32 startWord){
+	const BUInt32*	d = (const BUInt32*)data;
+	BUInt		last = TestDataBlockWords - TestDataLineWords;
+
+	return implementation.check(d, startWord, TestDataLineWords) || implementation.check(&d[last], startWord + last, TestDataLineWords);
+}
+
+TestDataSampling::TestDataSampling(){
+	set(1, 1.0, 0, 0);
+}
+
+void TestDataSampling::set(BUInt32 every, double fraction, BUInt32 seed, Bool edges){
+	oevery = every ? every : 1;
+	ofraction = (fraction > 1.0) ? 1.0 : ((fraction < 0.0) ? 0.0 : fraction);
+	oseed = seed;
+	oedges = edges;
+	clear();
+}
+
+Bool TestDataSampling::full(){
+	return (oevery == 1) && (ofraction >= 1.0) && !oedges;
+}
+
+/// The pseudo random selection hashes the seed and block number, so that it is repeatable and needs no shared state
+Bool TestDataSampling::sample(BUInt32 blockNum){
+	BUInt64	x;
+
+	if(blockNum % oevery)
+		return 0;
+	if(ofraction >= 1.0)
+		return 1;
+
+	// SplitMix64 finaliser
+	x = ((BUInt64(oseed) << 32) | blockNum) + 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	x = x ^ (x >> 31);
+
+	return (double(x >> 11) / double(BUInt64(1) << 53)) < ofraction;
+}
+
+void TestDataSampling::clear(){
+	blocks = 0;
+	sampled = 0;
+}
+
+void TestDataSampling::add(Bool s){
+	blocks++;
+	if(s)
+		sampled++;
+}
+
+/// The figures printed, and what each assumes:
+///  - pBlock is the probability a single corrupted block is validated, the fraction of the blocks sampled. It assumes
+///    the corruption reaches the validated words, with -vl the first or last cache line.
+///  - pWord is the probability a single corrupted word is found. It assumes the word is equally likely to be anywhere
+///    in the block, so with -vl only the two edge cache lines of a sampled block find it.
+///  - run999 is the length of a run of consecutive corrupted blocks that is detected with a probability of at least
+///    0.999, 0 if never. With -vn alone it is exact: every run of -vn blocks holds a sampled block, so it is always
+///    detected. With -vp it assumes the pseudo random selection is independent for each block. It is then -vn times
+///    k, the number of -vp draws needed, as every run of that length holds k of the every -vn'th blocks. Like pBlock it
+///    assumes each block of the run is corrupted where it is validated.
+/// Misplaced, lost and duplicated blocks are found by TestDataSequence whatever the sampling.
+void TestDataSampling::print(){
+	double	blockFraction = ofraction / oevery;
+	double	wordFraction = oedges ? (2.0 * TestDataLineWords / TestDataBlockWords) : 1.0;
+	double	run;
+
+	if(ofraction <= 0.0)
+		run = 0;
+	else if(ofraction >= 1.0)
+		run = oevery;				// Exact, every run of oevery blocks holds one sampled block
+	else
+		run = oevery * ceil(log(0.001) / log(1.0 - ofraction));
+
+	printf("ValidateSampling: blocks: %lu sampled: %lu every: %u fraction: %f seed: %u edges: %u pBlock: %f pWord: %f run999: %.0f\n",
+		blocks, sampled, oevery, ofraction, oseed, oedges, blockFraction, blockFraction * wordFraction, run);
+}
+
+TestDataSequence::TestDataSequence(){
+	start(0, 1);
+}
+
+void TestDataSequence::start(BUInt32 rampBlock, BUInt32 step){
+	blocks = 0;
+	gaps = 0;
+	missingBlocks = 0;
+	duplicates = 0;
+	outOfOrder = 0;
+	unknown = 0;
+	ostep = step ? step : 1;
+	onext = rampBlock % TestDataRampBlocks;
+	oposition = 0;
+	oseen = 0;
+}
+
+/// The ramp wraps every TestDataRampBlocks blocks, so the block's position is taken from its ramp block's signed
+/// difference, modulo TestDataRampBlocks, from the next ramp block expected.
+void TestDataSequence::add(BUInt32 firstWord){
+	BUInt32	rampBlock = firstWord / TestDataBlockWords;
+	int	d = (rampBlock - onext) & (TestDataRampBlocks - 1);
+	int	i;
+	BUInt32	n;
+
+	if(d >= int(TestDataRampBlocks / 2))
+		d -= TestDataRampBlocks;
+	i = d / int(ostep);
+
+	blocks++;
+	if((firstWord % TestDataBlockWords) || (d % int(ostep))){
+		unknown++;
+	}
+	else if(i == 0){
+		oseen = (oseen << 1) | 1;
+		onext = (onext + ostep) % TestDataRampBlocks;
+		oposition++;
+	}
+	else if(i > 0){
+		n = i;
+		gaps++;
+		missingBlocks += n;
+		oseen = (n < 63) ? ((oseen << (n + 1)) | 1) : 1;
+		onext = (rampBlock + ostep) % TestDataRampBlocks;
+		oposition += n + 1;
+	}
+	else {
+		// An earlier block. The blocks seen are only known for the last 64
+		n = -i - 1;
+		if((n < 64) && (oseen & (BUInt64(1) << n))){
+			duplicates++;
+		}
+		else {
+			outOfOrder++;
+			if((n < 64) && (n < oposition)){
+				oseen |= BUInt64(1) << n;
+				if(missingBlocks)
+					missingBlocks--;
+			}
+		}
+	}
+}
+
+Bool TestDataSequence::bad(){
+	return gaps || duplicates || outOfOrder || unknown;
+}
+
+void TestDataSequence::print(){
+	printf("SequenceStats: blocks: %lu gaps: %lu missingBlocks: %lu duplicates: %lu outOfOrder: %lu unknown: %lu\n",
+		blocks, gaps, missingBlocks, duplicates, outOfOrder, unknown);
+}
+
+TestDataLayout::TestDataLayout(){
+	ostartBlock = 0;
+	onumNvme = 1;
+}
+
+void TestDataLayout::set(BUInt32 startBlock, BUInt numNvme){
+	ostartBlock = startBlock;
+	onumNvme = (numNvme == 2) ? 2 : 1;
+}
+
+BUInt32 TestDataLayout::rampBlock(BUInt nvme, BUInt32 nvmeBlock){
+	if(onumNvme == 2)
+		return 2 * (nvmeBlock - (ostartBlock / 2)) + (nvme & 1);
+
+	return nvmeBlock - ostartBlock;
+}
@@ -0,0 +1,166 @@
+/*******************************************************************************
+ *	TestData.h	Validation of the FPGA TestDataStream data
+ *******************************************************************************
+ */
+/**
+ * @class	TestData
+ * @version	0.0.1
+ *
+ * @brief
+ * This provides the validation of the data produced by the FPGA's TestDataStream module.
+ *
+ * @details
+ * The TestDataStream module produces a ramp of 32 bit words, each word holding its word index in the stream.
+ * The check of a block is vectorised, using SSE2, AVX2 or AVX-512 as selected at run time by the CPU's features, with
+ * a plain C++ version for other CPU's. The block is first checked by comparing and OR'ing all of its words with the
+ * expected ramp. Only when this shows a mismatch are the words checked individually to find the exact position and
+ * number of the mismatches.
+ *
+ * The ramp starts at 0 at the start of a capture. When a capture uses both Nvme's the TestDataStream's blocks are
+ * passed to them alternately, so each Nvme holds every other ramp block from half the capture's start block.
+ * TestDataLayout describes this so that the ramp block held in any of an Nvme's blocks can be found directly.
+ *
+ * For long soak tests testDataAnalyse() and TestDataStats collect error statistics rather than stopping at the
+ * first error. A block that holds a whole, correct ramp block from elsewhere in the stream is counted as misplaced,
+ * and the changes in its offset from the expected position give the runs of lost and duplicated blocks. Other
+ * mismatches are counted by their bit positions, the cache lines of the block they are in and their number per block.
+ * Only blocks that fail the vectorised check are analysed, so this adds little to the cost of good blocks.
+ *
+ * TestDataSequence is a much lighter check of the order of the blocks. As the ramp holds the word index, the first
+ * word of a block identifies it. This is used to find gaps, duplicates and out of order blocks without validation.
+ * The ramp wraps every TestDataRampBlocks blocks, so blocks are compared by their ramp block difference modulo that.
+ *
+ * To validate at line rate on slower hosts TestDataSampling selects a sample of the blocks: every n'th block, a
+ * seeded pseudo random fraction of the blocks or both. It can also limit the check to the first and last cache lines
+ * of each block. The probabilities of detecting corrupted blocks and words with the sampling used are reported.
+ *
+ * @copyright GNU GPL License
+ * Copyright (c) Beam Ltd, All rights reserved. <br>
+ * This code is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License
+ * along with this code. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <BeamLibBasic.h>
+#include <stdio.h>
+
+const BUInt	TestDataBlockWords	= 1024;			///< The number of 32 bit words in a 4k block
+const BUInt	TestDataLineWords	= 16;			///< The number of 32 bit words in a 64 byte cache line
+const BUInt	TestDataBlockLines	= TestDataBlockWords / TestDataLineWords;	///< The number of cache lines in a block
+const BUInt32	TestDataRampBlocks	= 1 << 22;		///< The number of blocks in the 32 bit ramp before it wraps
+const BUInt	TestDataErrorBuckets	= 11;			///< The number of power of two buckets of errors per block
+
+/// Check numWords 32 bit words hold the ramp starting at startWord. Returns the number of mismatching words with the
+/// position of the first in firstError.
+BUInt testDataValidate(const void* data, BUInt32 startWord, BUInt numWords, BUInt& firstError);
+
+const char* testDataValidateImplementation();		///< The name of the vector implementation in use
+
+/// The errors found in a 4k block
+class TestDataErrors {
+public:
+	Bool		bad();						///< The block is misplaced or has mismatching words
+
+	BUInt		errors;						///< The number of mismatching words
+	BUInt		firstError;					///< The position of the first mismatching word
+	Bool		misplaced;					///< The block holds a whole ramp block from elsewhere in the stream
+	int		offset;						///< The misplaced block's offset in blocks from its expected position
+	BUInt32		bits[32];					///< Mismatching bit counts by bit position
+	BUInt32		lines[TestDataBlockLines];			///< Mismatching word counts by cache line
+};
+
+/// Analyse a 4k block that should hold the ramp from startWord. Returns 1 if it does not
+int testDataAnalyse(const void* data, BUInt32 startWord, TestDataErrors& errors);
+
+/// Error statistics for a stream of 4k blocks
+class TestDataStats {
+public:
+			TestDataStats();
+
+	void		clear();					///< Clear the statistics
+	void		add(BUInt32 blockNum, const TestDataErrors& errors);	///< Add a block's errors. Called in block order
+	Bool		bad();						///< There have been errors
+	void		print();					///< Print a summary, as "name: value" pairs
+
+	BUInt64		blocks;						///< The number of blocks validated
+	BUInt64		errorBlocks;					///< The number of blocks with mismatching words
+	BUInt64		errorWords;					///< The number of mismatching words
+	BUInt64		misplacedBlocks;				///< The number of misplaced blocks
+	BUInt64		lostRuns;					///< The number of runs of lost blocks
+	BUInt64		lostBlocks;					///< The number of lost blocks
+	BUInt64		duplicateRuns;					///< The number of runs of duplicated blocks
+	BUInt64		duplicateBlocks;				///< The number of duplicated blocks
+	BUInt32		firstErrorBlock;				///< The first block with an error
+	BUInt32		lastErrorBlock;					///< The last block with an error
+	int		offset;						///< The current offset of the stream from its expected position
+	BUInt64		bits[32];					///< Mismatching bit counts by bit position
+	BUInt64		lines[TestDataBlockLines];			///< Mismatching word counts by cache line
+	BUInt64		blockErrors[TestDataErrorBuckets];		///< Blocks by mismatching words, 1, 2-3, 4-7 ... 1024
+};
+
+/// Check the first and last cache lines of a 4k block hold the ramp from startWord. Returns 1 if they do not
+int testDataCheckEdges(const void* data, BUInt32 startWord);
+
+/// Selection of the blocks to validate
+class TestDataSampling {
+public:
+			TestDataSampling();
+
+	void		set(BUInt32 every, double fraction, BUInt32 seed, Bool edges);	///< Set the sampling
+	Bool		full();						///< All of every block is validated
+	Bool		sample(BUInt32 blockNum);			///< The block is to be validated
+	void		clear();					///< Clear the counts
+	void		add(Bool sampled);				///< Count the next block
+	void		print();					///< Print a summary with the detection probabilities, as "name: value" pairs
+
+	BUInt32		oevery;						///< Validate every n'th block
+	double		ofraction;					///< The fraction of the blocks to validate
+	BUInt32		oseed;						///< The seed for the pseudo random selection
+	Bool		oedges;						///< Only validate the first and last cache lines of each block
+	BUInt64		blocks;						///< The number of blocks
+	BUInt64		sampled;					///< The number of blocks validated
+};
+
+/// Block sequence checker using the first word of each 4k block
+class TestDataSequence {
+public:
+			TestDataSequence();
+
+	void		start(BUInt32 rampBlock, BUInt32 step);		///< Start with the expected first ramp block and the ramp block step between blocks
+	void		add(BUInt32 firstWord);				///< Add the next block, given its first word
+	Bool		bad();						///< There have been sequence errors
+	void		print();					///< Print a summary, as "name: value" pairs
+
+	BUInt64		blocks;						///< The number of blocks
+	BUInt64		gaps;						///< The number of gaps
+	BUInt64		missingBlocks;					///< The number of blocks missing from gaps and not seen later
+	BUInt64		duplicates;					///< The number of duplicated blocks
+	BUInt64		outOfOrder;					///< The number of blocks seen after a later block
+	BUInt64		unknown;					///< The number of blocks whose first word is not a ramp block of the sequence
+
+private:
+	BUInt32		ostep;						///< The ramp block step between blocks
+	BUInt32		onext;						///< The next ramp block expected
+	BUInt64		oposition;					///< The number of blocks in the sequence before onext
+	BUInt64		oseen;						///< The blocks seen before onext, bit n is the block n + 1 steps before onext
+};
+
+/// The layout of a capture's ramp on the Nvme's
+class TestDataLayout {
+public:
+			TestDataLayout();
+
+	void		set(BUInt32 startBlock, BUInt numNvme);		///< Set the capture's start block and the number of Nvme's it is striped across
+	BUInt32		rampBlock(BUInt nvme, BUInt32 nvmeBlock);	///< The ramp block held in an Nvme's block
+
+	BUInt32		ostartBlock;					///< The capture's start block
+	BUInt		onumNvme;					///< The number of Nvme's the capture is striped across
+};
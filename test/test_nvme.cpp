@@ -45,6 +45,8 @@
 #define	LDEBUG1		0		// High level debug
 
 #include <NvmeAccess.h>
+#include <NvmeStorageSim.h>
+#include <TestData.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <stdarg.h>
@@ -52,6 +54,24 @@
 
 #define VERSION		"1.0.0"
 
+const BUInt	ReadPipeDepth		= 256;			///< The maximum number of blocks in the read pipeline
+const BUInt	ReadPipeMaxWorkers	= 8;			///< The maximum number of validation worker threads
+const BUInt	ReadStageAssemble	= 0;			///< Read pipeline block assembly stage
+const BUInt	ReadStageValidate	= 1;			///< Read pipeline validation stage
+const BUInt	ReadStageWrite		= 2;			///< Read pipeline ordered writer stage
+const BUInt	ReadStageNum		= 3;			///< The number of read pipeline stages after the receive stage
+const BUInt32	CaptureDefault		= 0xFFFFFFFF;		///< Validate using the operation's own start block or Nvme's
+
+/// A data block in the read pipeline
+class ReadBlock {
+public:
+	BUInt8*		data;				///< The block's data, in place in its read fifo
+	Bool		validated;			///< The block has passed through the validation stage
+	BUInt32		rampBlock;			///< The ramp block the block should hold
+	Bool		sampled;			///< The block was selected for validation
+	TestDataErrors	errors;				///< The validation errors
+};
+
 /// Overal program control class
 class Control : public NvmeAccess {
 public:
@@ -63,11 +83,26 @@ public:
 	void		setNumBlocks(BUInt32 numBlocks);	///< Set the number of blocks to operate on
 	void		setReadStartBlock(BUInt32 startBlock);	///< Set the starting block number for capture and read's read
 	void		setReadNumBlocks(BUInt32 numBlocks);	///< Set the number of blocks to operate on for capture and read's read
+	void		setVerifyStride(BUInt32 stride);	///< Set the block stride for verify
+	void		setReadWindow(BUInt32 numBlocks);	///< Set the number of blocks per NvmeRead engine request, 0 for half the read fifo
+	void		setValidateWorkers(BUInt num);		///< Set the number of read pipeline validation worker threads
+	void		setCapture(BUInt32 startBlock, BUInt32 nvme);	///< Set the start block and Nvme's of the capture being validated
+	void		setWrite(BUInt32 commandBlocks, BUInt32 depth);	///< Set the host write command size in 4k blocks and queue depth
 	void		setFilename(const char* filename);	///< Set the file name for read data
 
 	int		nvmeInit();				///< Reset and configure Nvme's for operation
-	int		nvmeConfigure();			///< Configure single Nvme for operation
+	int		nvmeConfigure(BUInt nvme);		///< Configure single Nvme for operation
+	int		nvmeConfigureBoth();			///< Configure both Nvme's for operation concurrently
 	void		nvmeDataPacket(NvmeRequestPacket& packet);	///< Called when read data packet receiver
+	int		nvmeReadBlocks(BUInt32 startBlock, BUInt32 numBlocks);	///< Read blocks using the NvmeRead engines with flow control
+
+	// Read data pipeline
+	void		readPipelineStart(BUInt32 startBlock);	///< Start the read pipeline for oreadNumBlocks blocks
+	void		readPipelineStop();			///< Stop the read pipeline and print its stage utilisation
+	void		readAssemble();				///< Block assembly stage thread
+	void		readValidate();				///< Validation worker stage thread
+	void		readWrite();				///< Ordered writer stage thread
+	BUInt32		readRampBlock(BUInt32 blockNum);	///< The ramp block expected in a block of the read
 
 	// Normal test functions
 	int		nvmeCapture();				///< Capture FPGA datastream writing to Nvme
@@ -75,8 +110,14 @@ public:
 	int		nvmeRead();				///< Read blocks from Nvme
 	int		nvmeCaptureAndRead();			///< Capture FPGA datastream writing to Nvme
 	int		nvmeWrite();				///< Write blocks to Nvme
+	int		nvmeWriteQueue(BUInt nvme, BUInt queue, BUInt32& errors);	///< Write an IO queue's share of a single Nvme's blocks
 	int		nvmeTrim();				///< Trim blocks on Nvme
 	int		nvmeTrim1();				///< Trim blocks on Nvme using Write0 command
+	int		nvmeTrim1Queue(BUInt nvme, BUInt queue, BUInt32& errors);	///< Trim an IO queue's share of the blocks
+	int		nvmeVerify();				///< Verify blocks using host reads at queue depth
+	int		nvmeVerifyQueue(BUInt nvme, BUInt queue, BUInt32& errors);	///< Verify an IO queue's share of the blocks
+	void		nvmeVerifyBlock(BUInt nvmeSel, BUInt32 index, BUInt32& block, BUInt& nvme, BUInt32& nvmeBlock);	///< The block, Nvme and Nvme block of a verify index
+	int		nvmeVerifyUnaligned(BUInt32& errors);	///< Verify reads to host memory that is not page aligned or is scattered
 	int		nvmeRegs();				///< Print register contents
 	int		nvmeInfoDevice(int device);		///< Print NVMe device info for a particular device
 	int		nvmeInfo();				///< Print NVMe device info
@@ -92,11 +133,16 @@ public:
 	int		test8();				///< Run test8
 	int		test9();				///< Run test9
 	int		test10();				///< Run test10
+	int		test11();				///< Run test11
 	int		test_misc();				///< Collection of misc tests
 
 	// Support functions
+	typedef int	(Control::*QueueFunc)(BUInt nvme, BUInt queue, BUInt32& errors);	///< A function run for an IO queue
+	int		nvmeQueueThreads(QueueFunc func, Bool perNvme, BUInt32& errors);	///< Run a function in a thread per IO queue
 	void		uprintf(const char* fmt, ...);		///< User verbose printf
-	int		validateBlock(BUInt32 blockNum, void* data);	///< Validate a data block
+	void		validateLayout(BUInt32 startBlock, BUInt nvme);	///< Set the capture layout used for validation
+	int		validateBlock(BUInt32 blockNum, BUInt32 rampBlock, void* data);	///< Validate a data block
+	void		validateError(BUInt32 blockNum, BUInt32 rampBlock, void* data, TestDataErrors& errors);	///< Print a block's validation errors
 	void		dumpDataBlock(void* data, Bool full);	///< Print out a data blocks contents
 	void		dumpNvmeRegisters();			///< Dump the Nvme registers to stdout
 
@@ -105,36 +151,92 @@ public:
 	BUInt		overbose;				///< Verbose operation
 	Bool		oreset;					///< Perform reset/config
 	Bool		ovalidate;				///< Validate data
+	Bool		ovalidateContinue;			///< Continue reading after validation errors, collecting error statistics
+	BUInt32		ocaptureStart;				///< The start block of the capture being validated, or CaptureDefault
+	BUInt32		ocaptureNvme;				///< The Nvme's of the capture being validated, or CaptureDefault
+	TestDataLayout	olayout;				///< The layout of the capture being validated
+	TestDataStats	ostats;					///< The read's validation error statistics
+	TestDataSequence osequence;				///< The read's block sequence check
+	TestDataSampling osampling;				///< The selection of the read's blocks to validate
 	Bool		omachine;				///< Return machine readable data only
 	BUInt32		ostartBlock;				///< The starting block number
 	BUInt32		onumBlocks;				///< The number of blocks
 	BUInt32		oreadStartBlock;			///< The read starting block number
 	BUInt32		oreadNumBlocks;				///< The read number of blocks
+	BUInt32		overifyStride;				///< Verify every n'th block
+	BUInt32		oreadWindow;				///< The number of blocks per NvmeRead engine request, 0 for half the read fifo
+	volatile Bool	oreadAbort;				///< Abort nvmeReadBlocks()
+	BUInt32		owriteBlocks;				///< The number of 4k blocks per host write command
+	BUInt32		owriteDepth;				///< The number of host write commands outstanding per Nvme
+	BUInt32		owriteCommandBlocks;			///< The number of 4k blocks per host write command in use, after limiting
+	BUInt32		owriteQueueDepth;			///< The number of host write commands outstanding per IO queue in use, after limiting
 	const char*	ofilename;				///< Output file name
 	
-	BFifoBytes	ofifo0;					///< Fifo for Nvme0 read data
-	BFifoBytes	ofifo1;					///< Fifo for Nvme1 read data
+	BFifoRing	ofifo0;					///< Fifo for Nvme0 read data
+	BFifoRing	ofifo1;					///< Fifo for Nvme1 read data
+	BUInt32		ofifoOverflows;				///< The number of data packets lost as the fifo was full
 	BUInt32		oblockNum;				///< The output block number
-	BUInt8		odataBlock[BlockSize];			///< Data block's from NVme's
 	BSemaphore	oreadComplete;				///< The read process is complete
 	FILE*		ofile;					///< The output file
+
+	// Read data pipeline
+	BUInt		opipeWorkers;				///< The number of validation worker threads
+	ReadBlock	opipeBlocks[ReadPipeDepth];		///< The blocks in the pipeline, indexed by block number
+	pthread_mutex_t	opipeLock;				///< Pipeline access lock
+	pthread_cond_t	opipeAssembleCond;			///< Signalled when blocks are received or output
+	pthread_cond_t	opipeValidateCond;			///< Signalled when blocks are assembled
+	pthread_cond_t	opipeWriteCond;				///< Signalled when the next block to output has been validated
+	pthread_t	opipeThreads[ReadPipeMaxWorkers + 2];	///< The pipeline's stage threads
+	BUInt		opipeThreadsNum;			///< The number of stage threads running
+	Bool		opipeExit;				///< Request the stage threads to exit
+	BUInt64		opipeReceivedBytes[2];			///< The bytes received into each fifo, used by the receive thread
+	BUInt32		opipeReceived[2];			///< The number of whole blocks received into each fifo
+	BUInt32		opipeAssembled;				///< The number of blocks passed to the validation stage
+	BUInt32		opipeValidateNext;			///< The next block for a validation worker
+	BUInt32		opipeReleased;				///< The number of blocks released from the fifos, the NvmeRead engine's credit
+	BUInt32		opipeFifoPeak;				///< The peak number of blocks held in a fifo
+	BUInt32		opipeStartBlock;			///< The read's start block
+	double		opipeBusy[ReadStageNum];		///< The time each stage has been busy
+	double		opipeStart;				///< The time the pipeline was started
 };
 
-Control::Control() : ofifo0(1024*1024), ofifo1(1024*1024){
+Control::Control() : ofifo0(4*1024*1024), ofifo1(4*1024*1024){
 	overbose = 0;
 	omachine = 0;
 	oreset = 1;
 	ovalidate = 1;
+	ovalidateContinue = 0;
+	ocaptureStart = CaptureDefault;
+	ocaptureNvme = CaptureDefault;
 	ostartBlock = 0;
 	onumBlocks = 2;
 	oreadStartBlock = 0;
 	oreadNumBlocks = 2;
+	overifyStride = 1;
+	oreadWindow = 0;
+	oreadAbort = 0;
+	owriteBlocks = 2;
+	owriteDepth = 16;
+	owriteCommandBlocks = owriteBlocks;
+	owriteQueueDepth = owriteDepth;
 	ofilename = 0;
+	ofifoOverflows = 0;
 	oblockNum = 0;
 	ofile = 0;
+	opipeWorkers = 2;
+	opipeThreadsNum = 0;
+	opipeExit = 0;
+	pthread_mutex_init(&opipeLock, 0);
+	pthread_cond_init(&opipeAssembleCond, 0);
+	pthread_cond_init(&opipeValidateCond, 0);
+	pthread_cond_init(&opipeWriteCond, 0);
 }
 
 Control::~Control(){
+	pthread_cond_destroy(&opipeWriteCond);
+	pthread_cond_destroy(&opipeValidateCond);
+	pthread_cond_destroy(&opipeAssembleCond);
+	pthread_mutex_destroy(&opipeLock);
 }
 
 int Control::init(){
@@ -157,6 +259,39 @@ void Control::setReadNumBlocks(BUInt32 numBlocks){
 	oreadNumBlocks = numBlocks;
 }
 
+void Control::setReadWindow(BUInt32 numBlocks){
+	oreadWindow = numBlocks;
+}
+
+void Control::setValidateWorkers(BUInt num){
+	if(num < 1)
+		num = 1;
+	if(num > ReadPipeMaxWorkers)
+		num = ReadPipeMaxWorkers;
+
+	opipeWorkers = num;
+}
+
+void Control::setCapture(BUInt32 startBlock, BUInt32 nvme){
+	ocaptureStart = startBlock;
+	ocaptureNvme = nvme;
+}
+
+void Control::setVerifyStride(BUInt32 stride){
+	overifyStride = stride ? stride : 1;
+}
+
+void Control::setWrite(BUInt32 commandBlocks, BUInt32 depth){
+	// The command size is further limited by the Nvme's maximum data transfer size and the data slots when writing
+	if(commandBlocks < 1)
+		commandBlocks = 1;
+	if(depth < 1)
+		depth = 1;
+
+	owriteBlocks = commandBlocks;
+	owriteDepth = depth;
+}
+
 void Control::setFilename(const char* filename){
 	ofilename = filename;
 }
@@ -164,6 +299,7 @@ void Control::setFilename(const char* filename){
 int Control::nvmeInit(){
 	int	e = 0;
 	BUInt	n;
+	char	buf[4096];
 	
 	if(oreset){
 		uprintf("Initialise Nvme's for operation\n");
@@ -171,12 +307,12 @@ int Control::nvmeInit(){
 		// Perform reset
 		reset();
 
-		// Flush DMA receive stream
+		// Flush DMA receive stream. The receive buffer belongs to the nvmeProcess thread so a local buffer is used.
 		while(n = readAvailable()){
-			if(n > 4096)
-				n = 4096;
+			if(n > sizeof(buf))
+				n = sizeof(buf);
 
-			read(ohostRecvFd, obufRx, n);
+			otransport->recv(buf, n);
 			usleep(2000);
 		}
 
@@ -184,19 +320,16 @@ int Control::nvmeInit(){
 		start();
 
 		if(!UseFpgaConfigure){
-			if(onvmeNum == 2){
-				setNvme(0);
-				if(e = nvmeConfigure())
-					return e;
-
-				setNvme(1);
-				if(e = nvmeConfigure())
+			if((onvmeNum == 2) && UseQueueEngine){
+				e = nvmeConfigureBoth();
+			}
+			else if(onvmeNum == 2){
+				if(e = nvmeConfigure(0))
 					return e;
-
-				setNvme(2);
+				e = nvmeConfigure(1);
 			}
 			else {
-				e = nvmeConfigure();
+				e = nvmeConfigure(onvmeNum);
 			}
 		}
 	}
@@ -208,12 +341,53 @@ int Control::nvmeInit(){
 	return e;
 }
 
-int Control::nvmeConfigure(){
+/// Nvme configure thread argument
+class ConfigureNvme {
+public:
+	Control*	control;			///< The control object
+	BUInt		nvme;				///< The Nvme to configure
+	int		error;				///< The error returned
+};
+
+static void* nvmeConfigureThread(void* arg){
+	ConfigureNvme*	c = (ConfigureNvme*)arg;
+
+	c->error = c->control->nvmeConfigure(c->nvme);
+	return 0;
+}
+
+/// The Nvme's are configured concurrently, each from its own thread. The host submission queue memory used without
+/// the queue engine is shared, so this requires the queue engine.
+int Control::nvmeConfigureBoth(){
+	int		e = 0;
+	ConfigureNvme	configs[2];
+	pthread_t	threads[2];
+	BUInt		n;
+
+	for(n = 0; n < 2; n++){
+		configs[n].control = this;
+		configs[n].nvme = n;
+		configs[n].error = 0;
+		pthread_create(&threads[n], 0, nvmeConfigureThread, &configs[n]);
+	}
+	for(n = 0; n < 2; n++){
+		pthread_join(threads[n], 0);
+		if(configs[n].error)
+			e = configs[n].error;
+	}
+
+	return e;
+}
+
+int Control::nvmeConfigure(BUInt nvme){
 	int	e;
 	BUInt32	data;
 	BUInt32	cmd0;
+	BUInt	q;
+	BUInt32	queueAddress;
+	BUInt32*	identify;
 
-	uprintf("nvmeConfigure: Configure Nvme %u for operation\n", onvmeNum);
+	uprintf("nvmeConfigure: Configure Nvme %u for operation\n", nvme);
 	
 #ifdef ZAP
 	dumpNvmeRegisters();
@@ -222,18 +396,18 @@ int Control::nvmeConfigure(){
 
 	if(UseConfigEngine){	
 		uprintf("Start configuration\n");
-		writeNvmeStorageReg(4, 0x00000002);
+		writeNvmeStorageReg(4, 0x00000002, nvme);
 
 		data = 0;
 		while(! (data & 2)){
-			data = readNvmeStorageReg(RegStatus);
+			data = readNvmeStorageReg(RegStatus, nvme);
 			usleep(1000);
 		}
-		uprintf("Configuration complete: Status: %8.8x\n", readNvmeStorageReg(RegStatus));
+		uprintf("Configuration complete: Status: %8.8x\n", readNvmeStorageReg(RegStatus, nvme));
 	}
 	else {
 		data = 0x06;
-		pcieWrite(10, 4, 1, &data);			///< Set PCIe config command for memory accesses
+		pcieWrite(10, 4, 1, &data, nvme);			///< Set PCIe config command for memory accesses
 
 #ifdef ZAP
 		// Setup Max payload, hardcoded for Seagate Nvme
@@ -268,7 +442,7 @@ int Control::nvmeConfigure(){
 #endif
 
 		// Stop controller
-		if(e = writeNvmeReg32(0x14, 0x00460000)){
+		if(e = writeNvmeReg32(0x14, 0x00460000, nvme)){
 			printf("Error: %d\n", e);
 			return e;
 		}
@@ -276,41 +450,50 @@ int Control::nvmeConfigure(){
 
 		// Setup Nvme registers
 		// Disable interrupts
-		if(e = writeNvmeReg32(0x0C, 0xFFFFFFFF)){
+		if(e = writeNvmeReg32(0x0C, 0xFFFFFFFF, nvme)){
+			return e;
+		}
+
+		// The queue engine's fixed queue size must be within the Nvme's maximum queue entries supported, CAP.MQES
+		if(e = readNvmeReg32(NvmeRegCapLow, data, nvme)){
 			return e;
 		}
+		if(oqueueNum > ((data & 0xFFFF) + 1)){
+			printf("nvmeConfigure: Nvme %u supports %u queue entries, the queue engine needs %u\n", nvme, (data & 0xFFFF) + 1, oqueueNum);
+			return 1;
+		}
 
 		// Admin queue lengths
-		if(e = writeNvmeReg32(0x24, ((oqueueNum - 1) << 16) | (oqueueNum - 1))){
+		if(e = writeNvmeReg32(0x24, ((oqueueNum - 1) << 16) | (oqueueNum - 1), nvme)){
 			return e;
 		}
 
 		if(UseQueueEngine){
 			// Admin request queue base address
-			if(e = writeNvmeReg64(0x28, 0x02000000)){
+			if(e = writeNvmeReg64(0x28, 0x02000000, nvme)){
 				return e;
 			}
 
 			// Admin reply queue base address
-			//if(e = writeNvmeReg64(0x30, 0x01100000)){		// Get replies sent directly to host
-			if(e = writeNvmeReg64(0x30, 0x02100000)){		// Get replies sent via QueueEngine
+			//if(e = writeNvmeReg64(0x30, 0x01100000, nvme)){		// Get replies sent directly to host
+			if(e = writeNvmeReg64(0x30, 0x02100000, nvme)){		// Get replies sent via QueueEngine
 				return e;
 			}
 		}
 		else {
 			// Admin request queue base address
-			if(e = writeNvmeReg64(0x28, 0x01000000)){
+			if(e = writeNvmeReg64(0x28, 0x01000000, nvme)){
 				return e;
 			}
 
 			// Admin reply queue base address
-			if(e = writeNvmeReg64(0x30, 0x01100000)){
+			if(e = writeNvmeReg64(0x30, 0x01100000, nvme)){
 				return e;
 			}
 		}
 
 		// Start controller
-		if(e = writeNvmeReg32(0x14, 0x00460001)){
+		if(e = writeNvmeReg32(0x14, 0x00460001, nvme)){
 			return e;
 		}
 		
@@ -321,40 +504,36 @@ int Control::nvmeConfigure(){
 
 		cmd0 = ((oqueueNum - 1) << 16);
 
-		if(UseQueueEngine){
-			// Create an IO queue
-			uprintf("Create IO queue 1 for replies\n");
-			nvmeRequest(1, 0, 0x05, 0, 0x02110000, cmd0 | 1, 0x00000001);
+		// Create the IO queue pairs. Without the queue engine only queue pair 1 can be used.
+		if(!UseQueueEngine)
+			oioQueues = 1;
 
-			// Create an IO queue
-			uprintf("Create IO queue 1 for requests\n");
-			nvmeRequest(1, 0, 0x01, 0, 0x02010000, cmd0 | 1, 0x00010001);
+		for(q = 1; q <= oioQueues; q++){
+			queueAddress = (UseQueueEngine ? 0x02000000 : 0x01000000) | (q << 16);
 
-			// Create an IO queue
-			uprintf("Create IO queue 2 for replies\n");
-			nvmeRequest(1, 0, 0x05, 0, 0x02120000, cmd0 | 2, 0x00000001);
+			uprintf("Create IO queue %u for replies\n", q);
+			if(e = nvmeRequest(1, 0, 0x05, 0, queueAddress | 0x00100000, cmd0 | q, 0x00000001, 0, nvme)){
+				printf("nvmeConfigure: Error creating IO completion queue %u: 0x%x\n", q, e);
+				return e;
+			}
 
-			// Create an IO queue
-			uprintf("Create IO queue 2 for requests\n");
-			nvmeRequest(1, 0, 0x01, 0, 0x02020000, cmd0 | 2, 0x00020001);
+			uprintf("Create IO queue %u for requests\n", q);
+			if(e = nvmeRequest(1, 0, 0x01, 0, queueAddress, cmd0 | q, (q << 16) | 0x0001, 0, nvme)){
+				printf("nvmeConfigure: Error creating IO submission queue %u: 0x%x\n", q, e);
+				return e;
+			}
 		}
-		else {
-			// Create an IO queue
-			uprintf("Create IO queue 1 for replies\n");
-			nvmeRequest(1, 0, 0x05, 0, 0x01110000, cmd0 | 1, 0x00000001);
 
-			// Create an IO queue
-			uprintf("Create IO queue 1 for requests\n");
-			nvmeRequest(1, 0, 0x01, 0, 0x01010000, cmd0 | 1, 0x00010001);
-
-			// Create an IO queue
-			uprintf("Create IO queue 2 for replies\n");
-			nvmeRequest(1, 0, 0x05, 0, 0x01120000, cmd0 | 2, 0x00000001);
-
-			// Create an IO queue
-			uprintf("Create IO queue 2 for requests\n");
-			nvmeRequest(1, 0, 0x01, 0, 0x01020000, cmd0 | 2, 0x00020001);
+		// Get the maximum data transfer size, MDTS, in units of the 4k memory page size and SGL support, SGLS
+		if(e = nvmeRequest(1, 0, 0x06, 0, nvmeIdentifyAddress(nvme), 0x00000001, 0, 0, nvme)){		// Controller info
+			printf("nvmeConfigure: Error identifying Nvme %u: 0x%x\n", nvme, e);
+			return e;
 		}
+		identify = nvmeIdentifyData(nvme);
+		data = ((BUInt8*)identify)[77];
+		odevices[nvme].maxTransfer = (data && (data < 16)) ? (NvmePageSize << data) : 0;
+		odevices[nvme].sgl = ((identify[134] & 0x03) == 1) || ((identify[134] & 0x03) == 2);
+		uprintf("Maximum data transfer size: %u SGL: %u\n", odevices[nvme].maxTransfer, odevices[nvme].sgl);
 	}
 	// Make sure all is settled
 	usleep(100000);
@@ -365,127 +544,332 @@ int Control::nvmeConfigure(){
 }
 
 
-/// This function is called from the Nvme request processing thread when PciWrite to memory requests arrive
+/// This function is called from the Nvme request processing thread when PciWrite to memory requests arrive.
+/// This is the receive stage of the read pipeline. It only stores the data, so that the DMA path is not held up by the
+/// later stages, and tells the block assembly stage as each whole block arrives.
 void Control::nvmeDataPacket(NvmeRequestPacket& packet){
+	BUInt		f = (packet.address & 0xF0000000) ? 1 : 0;
+	BFifoRing&	fifo = f ? ofifo1 : ofifo0;
+	BUInt32		blocks;
+
 	dl2printf("Control::nvmeDataPacket: Address: %x\n", packet.address);
 	dl2hd32(packet.data, packet.numWords);
 
 	// The data is written to the approprate Nvme's fifo. This assumes the PcieWrites are in order
-	if(packet.address & 0xF0000000){
-		// Nvme 1
-		ofifo1.write(packet.data, packet.numWords * 4);
+	if(fifo.write(packet.data, packet.numWords * 4)){
+		if(!ofifoOverflows++)
+			printf("Error: Nvme%u read data fifo overflow, data lost\n", f);
+		return;
 	}
-	else {
-		// Nvme 0
-		ofifo0.write(packet.data, packet.numWords * 4);
+
+	opipeReceivedBytes[f] += packet.numWords * 4;
+	blocks = opipeReceivedBytes[f] / BlockSize;
+	if(blocks != opipeReceived[f]){
+		pthread_mutex_lock(&opipeLock);
+		opipeReceived[f] = blocks;
+		if(((fifo.size() - fifo.writeAvailable()) / BlockSize) > opipeFifoPeak)
+			opipeFifoPeak = (fifo.size() - fifo.writeAvailable()) / BlockSize;
+		pthread_cond_signal(&opipeAssembleCond);
+		pthread_mutex_unlock(&opipeLock);
 	}
+}
 
-	if(onvmeNum == 0){
-		// Output data blocks from FIFO's
-		while(ofifo0.readAvailable() >= BlockSize){
-			ofifo0.read(odataBlock, BlockSize);
-			if(overbose){
-				printf("Block: %u\n", oblockNum);
-				dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-			}
-			if(ovalidate){
-				if(validateBlock(oblockNum, odataBlock)){
-					printf("Error in block: %u startAddress(0x%8.8x)\n", oblockNum, (oblockNum * BlockSize / 4));
-					dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-					exit(1);
-				}
-			}
-			
-			if(ofile){
-				if(fwrite(odataBlock, 1, BlockSize, ofile) != BlockSize){
-					fprintf(stderr, "Error: file write\n");
-					exit(1);
-				}
-			}
+static void* readAssembleThread(void* arg){
+	((Control*)arg)->readAssemble();
+	return 0;
+}
 
-			oblockNum++;
-		}
+static void* readValidateThread(void* arg){
+	((Control*)arg)->readValidate();
+	return 0;
+}
+
+static void* readWriteThread(void* arg){
+	((Control*)arg)->readWrite();
+	return 0;
+}
+
+/// The read data is processed by a pipeline of threads so that readback throughput is set by the DMA path rather than
+/// the slowest consumer: receive (nvmeDataPacket), block assembly, validation workers and an ordered writer.
+/// The blocks stay in place in the read fifos. At most ReadPipeDepth blocks are in the stages after the receive stage.
+void Control::readPipelineStart(BUInt32 startBlock){
+	BUInt	n;
+
+	opipeStartBlock = startBlock;
+	ostats.clear();
+	osampling.clear();
+	osequence.start(readRampBlock(0), readRampBlock(1) - readRampBlock(0));
+	oblockNum = 0;
+	ofifoOverflows = 0;
+	ofifo0.clear();
+	ofifo1.clear();
+
+	opipeExit = 0;
+	opipeReceivedBytes[0] = opipeReceivedBytes[1] = 0;
+	opipeReceived[0] = opipeReceived[1] = 0;
+	opipeAssembled = 0;
+	opipeValidateNext = 0;
+	opipeReleased = 0;
+	opipeFifoPeak = 0;
+	for(n = 0; n < ReadStageNum; n++)
+		opipeBusy[n] = 0;
+	opipeStart = getTime();
+
+	uprintf("Read pipeline: validation workers: %u validator: %s\n", opipeWorkers, testDataValidateImplementation());
+	opipeThreadsNum = 0;
+	pthread_create(&opipeThreads[opipeThreadsNum++], 0, readAssembleThread, this);
+	for(n = 0; n < opipeWorkers; n++)
+		pthread_create(&opipeThreads[opipeThreadsNum++], 0, readValidateThread, this);
+	pthread_create(&opipeThreads[opipeThreadsNum++], 0, readWriteThread, this);
+}
+
+void Control::readPipelineStop(){
+	BUInt	n;
+	double	t;
+
+	pthread_mutex_lock(&opipeLock);
+	opipeExit = 1;
+	pthread_cond_broadcast(&opipeAssembleCond);
+	pthread_cond_broadcast(&opipeValidateCond);
+	pthread_cond_broadcast(&opipeWriteCond);
+	pthread_mutex_unlock(&opipeLock);
+
+	for(n = 0; n < opipeThreadsNum; n++)
+		pthread_join(opipeThreads[n], 0);
+	opipeThreadsNum = 0;
+
+	t = getTime() - opipeStart;
+	if(t > 0){
+		printf("NvmeRead: pipeline utilisation: assemble: %.1f%% validate: %.1f%% (%u workers) write: %.1f%% peak fifo: %u blocks\n",
+			100 * opipeBusy[ReadStageAssemble] / t, 100 * opipeBusy[ReadStageValidate] / (t * opipeWorkers), opipeWorkers,
+			100 * opipeBusy[ReadStageWrite] / t, opipeFifoPeak);
 	}
-	else if(onvmeNum == 1){
-		// Output data blocks from FIFO's
-		while(ofifo1.readAvailable() >= BlockSize){
-			ofifo1.read(odataBlock, BlockSize);
-			if(overbose){
-				printf("Block: %u\n", oblockNum);
-				dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-			}
-			if(ovalidate){
-				if(validateBlock(oblockNum, odataBlock)){
-					printf("Error in block: %u startAddress(0x%8.8x)\n", oblockNum, (oblockNum * BlockSize / 4));
-					dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-					exit(1);
-				}
-			}
 
-			if(ofile){
-				if(fwrite(odataBlock, 1, BlockSize, ofile) != BlockSize){
-					fprintf(stderr, "Error: file write\n");
-					exit(1);
-				}
-			}
+	osequence.print();
+	if(ovalidate && !osampling.full())
+		osampling.print();
+	if(ovalidate && ovalidateContinue)
+		ostats.print();
+}
 
-			oblockNum++;
+/// The block assembly stage passes the received blocks, in block order, to the validation stage. When both Nvme's are
+/// used the blocks alternate between the two fifos. It is the only reader of the fifos, releasing the blocks that have
+/// been output, which returns credit to the NvmeRead engines.
+void Control::readAssemble(){
+	BFifoRing*	fifos[2] = { &ofifo0, &ofifo1 };
+	BUInt32		assembled[2] = { 0, 0 };
+	BUInt32		held[2] = { 0, 0 };
+	ReadBlock*	b;
+	BUInt		f;
+	Bool		progress;
+	double		t;
+
+	pthread_mutex_lock(&opipeLock);
+	t = getTime();
+	while(!opipeExit){
+		progress = 0;
+
+		// Release the blocks that have been output
+		while(opipeReleased < oblockNum){
+			f = (onvmeNum == 2) ? (opipeReleased & 1) : onvmeNum;
+			fifos[f]->readRelease(BlockSize);
+			held[f]--;
+			__atomic_store_n(&opipeReleased, opipeReleased + 1, __ATOMIC_RELEASE);
+			progress = 1;
+		}
+
+		// Pass on the next blocks received
+		while((opipeAssembled < oreadNumBlocks) && ((opipeAssembled - opipeReleased) < ReadPipeDepth)){
+			f = (onvmeNum == 2) ? (opipeAssembled & 1) : onvmeNum;
+			if(assembled[f] >= opipeReceived[f])
+				break;
+
+			// The fifo size is a multiple of the block size so the block is always contiguous
+			b = &opipeBlocks[opipeAssembled % ReadPipeDepth];
+			b->data = (BUInt8*)fifos[f]->readPeek(BlockSize, held[f] * BlockSize);
+			b->validated = 0;
+			b->errors.errors = 0;
+			b->errors.misplaced = 0;
+			assembled[f]++;
+			held[f]++;
+			opipeAssembled++;
+			progress = 1;
+		}
+
+		if(progress){
+			pthread_cond_broadcast(&opipeValidateCond);
+		}
+		else {
+			opipeBusy[ReadStageAssemble] += getTime() - t;
+			pthread_cond_wait(&opipeAssembleCond, &opipeLock);
+			t = getTime();
 		}
 	}
-	else {
-		// Output data blocks from FIFO's
-		while((ofifo0.readAvailable() >= BlockSize) && (ofifo1.readAvailable() >= BlockSize)){
-			ofifo0.read(odataBlock, BlockSize);
+	pthread_mutex_unlock(&opipeLock);
+}
+
+/// The validation workers validate blocks concurrently, in any order. Only the blocks, or parts of blocks, selected by
+/// osampling are validated. When only a block's edges are checked and fail the whole block is analysed.
+void Control::readValidate(){
+	ReadBlock*	b;
+	BUInt32		blockNum;
+	BUInt32		rampBlock;
+	double		t;
+
+	pthread_mutex_lock(&opipeLock);
+	while(!opipeExit){
+		if(opipeValidateNext < opipeAssembled){
+			blockNum = opipeValidateNext++;
+			b = &opipeBlocks[blockNum % ReadPipeDepth];
+			pthread_mutex_unlock(&opipeLock);
+
+			rampBlock = readRampBlock(blockNum);
+
+			t = getTime();
+			b->sampled = ovalidate && osampling.sample(blockNum);
+			if(b->sampled && (!osampling.oedges || testDataCheckEdges(b->data, rampBlock * (BlockSize / 4))))
+				testDataAnalyse(b->data, rampBlock * (BlockSize / 4), b->errors);
+			t = getTime() - t;
+
+			pthread_mutex_lock(&opipeLock);
+			opipeBusy[ReadStageValidate] += t;
+			b->rampBlock = rampBlock;
+			b->validated = 1;
+			if(blockNum == oblockNum)
+				pthread_cond_signal(&opipeWriteCond);
+		}
+		else {
+			pthread_cond_wait(&opipeValidateCond, &opipeLock);
+		}
+	}
+	pthread_mutex_unlock(&opipeLock);
+}
+
+BUInt32 Control::readRampBlock(BUInt32 blockNum){
+	// The read's blocks alternate between the Nvme's when both are used
+	if(onvmeNum == 2)
+		return olayout.rampBlock(blockNum & 1, (opipeStartBlock / 2) + (blockNum / 2));
+	else
+		return olayout.rampBlock(onvmeNum, opipeStartBlock + blockNum);
+}
+
+/// The ordered writer outputs the validated blocks in block order. Validation errors stop the read unless
+/// ovalidateContinue is set, when the error statistics, which need the blocks in order, are collected instead.
+/// The block sequence is checked here from the first word of each block, even when not validating.
+void Control::readWrite(){
+	ReadBlock*	b;
+	BUInt32		blockNum;
+	double		t;
+
+	pthread_mutex_lock(&opipeLock);
+	t = getTime();
+	while(!opipeExit){
+		blockNum = oblockNum;
+		b = &opipeBlocks[blockNum % ReadPipeDepth];
+		if((blockNum < opipeAssembled) && b->validated){
+			pthread_mutex_unlock(&opipeLock);
+
 			if(overbose){
-				printf("Block: %u\n", oblockNum);
-				dumpDataBlock(odataBlock, (overbose > 1)?1:0);
+				printf("Block: %u\n", blockNum);
+				dumpDataBlock(b->data, (overbose > 1)?1:0);
 			}
-			if(ovalidate){
-				if(validateBlock(oblockNum, odataBlock)){
-					printf("Error in block: %u startAddress(0x%8.8x)\n", oblockNum, (oblockNum * BlockSize / 4));
-					dumpDataBlock(odataBlock, (overbose > 1)?1:0);
+			if(b->errors.bad()){
+				if(!ovalidateContinue || overbose)
+					validateError(blockNum, b->rampBlock, b->data, b->errors);
+
+				if(!ovalidateContinue){
+					printf("Error in block: %u startAddress(0x%8.8x)\n", blockNum, (blockNum * BlockSize / 4));
+					dumpDataBlock(b->data, (overbose > 1)?1:0);
 					exit(1);
 				}
 			}
+			if(ovalidate){
+				osampling.add(b->sampled);
+				if(b->sampled)
+					ostats.add(blockNum, b->errors);
+			}
+			osequence.add(((BUInt32*)b->data)[0]);
 
 			if(ofile){
-				if(fwrite(odataBlock, 1, BlockSize, ofile) != BlockSize){
+				if(fwrite(b->data, 1, BlockSize, ofile) != BlockSize){
 					fprintf(stderr, "Error: file write\n");
 					exit(1);
 				}
 			}
 
+			pthread_mutex_lock(&opipeLock);
 			oblockNum++;
+			pthread_cond_signal(&opipeAssembleCond);
 
-			ofifo1.read(odataBlock, BlockSize);
-			if(overbose){
-				printf("Block: %u\n", oblockNum);
-				dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-			}
-			if(ovalidate){
-				if(validateBlock(oblockNum, odataBlock)){
-					printf("Error in block: %u startAddress(0x%8.8x)\n", oblockNum, (oblockNum * BlockSize / 4));
-					dumpDataBlock(odataBlock, (overbose > 1)?1:0);
-					exit(1);
-				}
+			// Check if the last block of a Nvme read operation
+			if(oblockNum == oreadNumBlocks){
+				printf("Read complete at: %u blocks\n", oreadNumBlocks);
+				oreadComplete.set();
 			}
+		}
+		else {
+			opipeBusy[ReadStageWrite] += getTime() - t;
+			pthread_cond_wait(&opipeWriteCond, &opipeLock);
+			t = getTime();
+		}
+	}
+	pthread_mutex_unlock(&opipeLock);
+}
 
-			if(ofile){
-				if(fwrite(odataBlock, 1, BlockSize, ofile) != BlockSize){
-					fprintf(stderr, "Error: file write\n");
-					exit(1);
+/// The NvmeRead engines are given windows of blocks to read. A window is only started when there is space in the
+/// read fifos for all of its blocks, with credit returned as the read pipeline releases the blocks from the fifos.
+/// The engines are paused between windows by clearing their enable. When both Nvme's are used their windows are
+/// started together.
+int Control::nvmeReadBlocks(BUInt32 startBlock, BUInt32 numBlocks){
+	BUInt		numNvme = (onvmeNum == 2) ? 2 : 1;
+	BUInt32		nvmeStart = startBlock / numNvme;
+	BUInt32		nvmeBlocks = numBlocks / numNvme;
+	BUInt32		fifoBlocks = ofifo0.size() / BlockSize;
+	BUInt32		window = fifoBlocks / 2;
+	BUInt32		requested = 0;
+	BUInt32		num;
+	BUInt		n;
+
+	if(oreadWindow && (oreadWindow < fifoBlocks))
+		window = oreadWindow;
+
+	while(requested < nvmeBlocks){
+		num = ((nvmeBlocks - requested) < window) ? (nvmeBlocks - requested) : window;
+
+		// Wait for credit for the window's blocks
+		while((requested + num - (__atomic_load_n(&opipeReleased, __ATOMIC_ACQUIRE) / numNvme)) > fifoBlocks){
+			if(oreadAbort)
+				return 1;
+			usleep(100);
+		}
+
+		dl1printf("nvmeReadBlocks: window: %u num: %u\n", nvmeStart + requested, num);
+		writeNvmeStorageReg(RegReadBlock, nvmeStart + requested);
+		writeNvmeStorageReg(RegReadNumBlocks, num);
+		writeNvmeStorageReg(RegReadControl, 0x00000001);
+		requested += num;
+
+		// Wait for the engines to complete the window then pause them
+		for(n = 0; n < numNvme; n++){
+			while(!(readNvmeStorageReg(RegReadStatus, (numNvme == 2) ? n : onvmeNum) & 0x02)){
+				if(oreadAbort){
+					writeNvmeStorageReg(RegReadControl, 0x00000000);
+					return 1;
 				}
+				usleep(100);
 			}
-
-			oblockNum++;
 		}
+		writeNvmeStorageReg(RegReadControl, 0x00000000);
 	}
 
-	// Check if the last block of a Nvme read operation	
-	if(oblockNum >= oreadNumBlocks){
-		printf("Read complete at: %u blocks\n", oreadNumBlocks);
-		oreadComplete.set();
-	}
+	return 0;
+}
+
+static void* nvmeReadBlocksThread(void* arg){
+	Control*	c = (Control*)arg;
+
+	c->nvmeReadBlocks(c->oreadStartBlock, c->oreadNumBlocks);
+	return 0;
 }
 
 int Control::nvmeCapture(){
@@ -545,13 +929,10 @@ int Control::nvmeCapture(){
 	r = ((double(BlockSize) * onumBlocks) / (1e-6 * t));
 
 	if(onvmeNum == 2){
-		setNvme(1);
-		if(!e && readNvmeStorageReg(RegWriteError))
-			e = readNvmeStorageReg(RegWriteError);
-		if(readNvmeStorageReg(RegWritePeakLatency) > l)
-			l = readNvmeStorageReg(RegWritePeakLatency);
-
-		setNvme(2);
+		if(!e && readNvmeStorageReg(RegWriteError, 1))
+			e = readNvmeStorageReg(RegWriteError, 1);
+		if(readNvmeStorageReg(RegWritePeakLatency, 1) > l)
+			l = readNvmeStorageReg(RegWritePeakLatency, 1);
 	}
 
 	uprintf("Time: %u\n", t);
@@ -628,9 +1009,8 @@ int Control::nvmeCaptureRepeat(){
 			if((getTime() - ts) > tExpected){
 				e = readNvmeStorageReg(RegWriteError);
 				if(onvmeNum == 2){
-					setNvme(1);
-					if(!e && readNvmeStorageReg(RegWriteError))
-					e = readNvmeStorageReg(RegWriteError);
+					if(!e && readNvmeStorageReg(RegWriteError, 1))
+						e = readNvmeStorageReg(RegWriteError, 1);
 				}
 				printf("Took to long %f secs. At block: %u ErrorStatus: 0x%x\n", getTime() - ts, b, e);
 				printf("Registers\n");
@@ -646,13 +1026,10 @@ int Control::nvmeCaptureRepeat(){
 		r = ((double(BlockSize) * onumBlocks) / (1e-6 * t));
 
 		if(onvmeNum == 2){
-			setNvme(1);
-			if(!e && readNvmeStorageReg(RegWriteError))
-				e = readNvmeStorageReg(RegWriteError);
-			if(readNvmeStorageReg(RegWritePeakLatency) > l)
-				l = readNvmeStorageReg(RegWritePeakLatency);
-
-			setNvme(2);
+			if(!e && readNvmeStorageReg(RegWriteError, 1))
+				e = readNvmeStorageReg(RegWriteError, 1);
+			if(readNvmeStorageReg(RegWritePeakLatency, 1) > l)
+				l = readNvmeStorageReg(RegWritePeakLatency, 1);
 		}
 
 		uprintf("Process time: %u\n", t);
@@ -689,25 +1066,17 @@ int Control::nvmeRead(){
 	if(e = nvmeInit())
 		return e;
 
-	oblockNum = 0;
 	oreadNumBlocks = onumBlocks;
+	validateLayout(ostartBlock, onvmeNum);
+	readPipelineStart(ostartBlock);
 
-	if(onvmeNum == 2){
-		writeNvmeStorageReg(RegReadBlock, ostartBlock / 2);
-		writeNvmeStorageReg(RegReadNumBlocks, onumBlocks / 2);
-	}
-	else {
-		writeNvmeStorageReg(RegReadBlock, ostartBlock);
-		writeNvmeStorageReg(RegReadNumBlocks, onumBlocks);
-	}
-	
 	if(overbose > 2)
 		dumpRegs();
 	
-	// Start off NvmeRead engine
+	// Run the NvmeRead engine
 	uprintf("Start NvmeRead engine\n");
 	ts = getTime();
-	writeNvmeStorageReg(RegReadControl, 0x00000001);
+	nvmeReadBlocks(ostartBlock, onumBlocks);
 
 	if(overbose > 2){
 		dumpRegs(0);
@@ -717,6 +1086,7 @@ int Control::nvmeRead(){
 	// Wait for complete
 	oreadComplete.wait();
 	te = getTime();
+	readPipelineStop();
 	
 	uprintf("Read time: %f\n", te - ts);
 
@@ -726,8 +1096,13 @@ int Control::nvmeRead(){
 	uprintf("Stop NvmeRead engine\n");
 	writeNvmeStorageReg(RegReadControl, 0x00000000);
 	
+	if(ofifoOverflows){
+		printf("NvmeRead: Error %u data packets lost on fifo overflow\n", ofifoOverflows);
+		return 1;
+	}
 	
-	return 0;
+	// Without validation the block sequence is only reported
+	return (ostats.bad() || (ovalidate && osequence.bad())) ? 1 : 0;
 }
 
 int Control::nvmeCaptureAndRead(){
@@ -738,6 +1113,7 @@ int Control::nvmeCaptureAndRead(){
 	double	ts;
 	double	te;
 	BUInt	numBlocks;
+	pthread_t	readThread;
 	
 	printf("nvmeCaptureAndRead: Write FPGA data stream to Nvme devices while reading. nvme: %u startBlock: %u numBlocks: %u\n", onvmeNum, ostartBlock, onumBlocks);
 
@@ -757,11 +1133,11 @@ int Control::nvmeCaptureAndRead(){
 
 	// Start off read operation
 	uprintf("Start off read operation from block: %u num: %u\n", oreadStartBlock, oreadNumBlocks);
-	oblockNum = 0;
+	validateLayout(ostartBlock, 2);
+	readPipelineStart(oreadStartBlock);
+	oreadAbort = 0;
 	ts = getTime();
-	writeNvmeStorageReg(RegReadBlock, oreadStartBlock / 2);
-	writeNvmeStorageReg(RegReadNumBlocks, oreadNumBlocks / 2);
-	writeNvmeStorageReg(RegReadControl, 0x00000001);
+	pthread_create(&readThread, 0, nvmeReadBlocksThread, this);
 
 	// Set number of blocks to write
 	uprintf("Start NvmeWrite engine to block: %u\n", ostartBlock);
@@ -782,16 +1158,22 @@ int Control::nvmeCaptureAndRead(){
 	r = ((double(BlockSize) * onumBlocks) / (1e-6 * t));
 	printf("Time: %u\n", t);
 	printf("NvmeWrite: rate: %f MBytes/s\n", r / (1024 * 1024));
+	printf("NvmeWrite: lostBlocks: %u\n", readNvmeStorageReg(RegLostBlocks));
 
 	e = readNvmeStorageReg(RegWriteError);
 	if(overbose || e){
 		printf("Error status: 0x%x\n", e);
+		oreadAbort = 1;
+		pthread_join(readThread, 0);
+		readPipelineStop();
 		return 1;
 	}
 
 	// Wait for read complete
 	oreadComplete.wait();
+	pthread_join(readThread, 0);
 	te = getTime();
+	readPipelineStop();
 	
 	uprintf("Read time: %f\n", te - ts);
 	r = ((double(BlockSize) * oreadNumBlocks) / (te - ts));
@@ -800,128 +1182,471 @@ int Control::nvmeCaptureAndRead(){
 	writeNvmeStorageReg(RegReadControl, 0x00000000);
 	writeNvmeStorageReg(RegControl, 0x00000000);
 	
+	if(ofifoOverflows){
+		printf("NvmeRead: Error %u data packets lost on fifo overflow\n", ofifoOverflows);
+		return 1;
+	}
+	
+	// Without validation the block sequence is only reported
+	return (ostats.bad() || (ovalidate && osequence.bad())) ? 1 : 0;
+}
+
+/// Host IO queue thread argument
+class QueueThread {
+public:
+	Control*		control;		///< The control object
+	Control::QueueFunc	func;			///< The function to run
+	BUInt			nvme;			///< The Nvme to use, 2 for both
+	BUInt			queue;			///< The IO queue to use
+	BUInt32			errors;			///< The number of errors found
+	int			error;			///< The error returned
+};
+
+static void* nvmeQueueThread(void* arg){
+	QueueThread*	t = (QueueThread*)arg;
+
+	t->error = (t->control->*t->func)(t->nvme, t->queue, t->errors);
 	return 0;
 }
 
+/// Run the function in a thread for each of the Nvme's IO queues. If perNvme is set each Nvme has its own threads,
+/// otherwise each thread uses both Nvme's when both are selected.
+int Control::nvmeQueueThreads(QueueFunc func, Bool perNvme, BUInt32& errors){
+	int		e = 0;
+	QueueThread	threads[2 * NvmeMaxQueues];
+	pthread_t	ids[2 * NvmeMaxQueues];
+	BUInt		nvmes[2];
+	BUInt		numNvme = 1;
+	BUInt		numThreads = 0;
+	BUInt		n;
+	BUInt		q;
+	BUInt		t;
+
+	if(perNvme && (onvmeNum == 2)){
+		nvmes[0] = 0;
+		nvmes[1] = 1;
+		numNvme = 2;
+	}
+	else {
+		nvmes[0] = perNvme ? ((onvmeNum == 1) ? 1 : 0) : onvmeNum;
+	}
+
+	for(n = 0; n < numNvme; n++){
+		for(q = 1; q <= oioQueues; q++){
+			threads[numThreads].control = this;
+			threads[numThreads].func = func;
+			threads[numThreads].nvme = nvmes[n];
+			threads[numThreads].queue = q;
+			threads[numThreads].errors = 0;
+			threads[numThreads].error = 0;
+			pthread_create(&ids[numThreads], 0, nvmeQueueThread, &threads[numThreads]);
+			numThreads++;
+		}
+	}
+
+	errors = 0;
+	for(t = 0; t < numThreads; t++){
+		pthread_join(ids[t], 0);
+		errors += threads[t].errors;
+		if(threads[t].error)
+			e = threads[t].error;
+	}
+
+	return e;
+}
+
+/// The data is written using host issued Nvme write commands from the host data slots.
+/// Each Nvme's IO queue has its own submitting thread and its share of the slots.
+/// The command size and queue depth are limited once, before starting the queue threads, so that the values printed
+/// are those used. Each command's data must fit in a data slot and in each Nvme's maximum transfer size. The Nvme's
+/// IO queues share the data slots and each holds at most oqueueNum - 1 commands.
 int Control::nvmeWrite(){
-	int	e = 0;
-	BUInt32	block;
-	BUInt32	numBlocks = 8;
-	BUInt32	data = 0;
-	BUInt	a;
+	int		e = 0;
+	BUInt		numNvme = (onvmeNum == 2) ? 2 : 1;
+	BUInt32		errors;
+	BUInt		nvme;
+	double		ts;
+	double		te;
+	double		r;
 
-	printf("NvmeWrite: nvme: %u startBlock: %u numBlocks: %u\n", onvmeNum, ostartBlock, onumBlocks);
-	
 	if(e = nvmeInit())
 		return e;
 
-	if(getNvme() == 2){
-		for(block = 0; block < onumBlocks/2; block++){
-			for(a = 0; a < BlockSize/4; a++)
-				odataBlockMem[a] = data++;
+	owriteCommandBlocks = owriteBlocks;
+	for(nvme = 0; nvme < 2; nvme++){
+		if(((numNvme == 2) || (nvme == ((onvmeNum == 1) ? 1 : 0))) && (owriteCommandBlocks > (nvmeMaxTransfer(nvme) / BlockSize)))
+			owriteCommandBlocks = nvmeMaxTransfer(nvme) / BlockSize;
+	}
+	if(owriteCommandBlocks > (NvmeSlotSize / BlockSize))
+		owriteCommandBlocks = NvmeSlotSize / BlockSize;
+	if(owriteCommandBlocks < 1)
+		owriteCommandBlocks = 1;
+
+	owriteQueueDepth = owriteDepth;
+	if(owriteQueueDepth > (nvmeSlotsNum() / (numNvme * oioQueues)))
+		owriteQueueDepth = nvmeSlotsNum() / (numNvme * oioQueues);
+	if(owriteQueueDepth > (oqueueNum - 1))
+		owriteQueueDepth = oqueueNum - 1;
+	if(owriteQueueDepth < 1)
+		owriteQueueDepth = 1;
+
+	printf("NvmeWrite: nvme: %u startBlock: %u numBlocks: %u commandBlocks: %u queueDepth: %u ioQueues: %u\n", onvmeNum, ostartBlock, onumBlocks, owriteCommandBlocks, owriteQueueDepth, oioQueues);
+
+	ts = getTime();
+	e = nvmeQueueThreads(&Control::nvmeWriteQueue, 1, errors);
+	te = getTime();
 
-			setNvme(0);
-			nvmeRequest(1, 1, 0x01, 1, 0x01800000, (ostartBlock + block) * numBlocks, 0x00000000, numBlocks-1);	// Perform write
+	r = ((double(BlockSize) * onumBlocks) / (te - ts));
+	printf("NvmeWrite: errors: %u rate: %f MBytes/s\n", errors, r / (1024 * 1024));
 
-			for(a = 0; a < BlockSize/4; a++)
-				odataBlockMem[a] = data++;
+	return (e || errors) ? 1 : 0;
+}
 
-			setNvme(1);
-			nvmeRequest(1, 1, 0x01, 1, 0x01800000, (ostartBlock + block) * numBlocks, 0x00000000, numBlocks-1);	// Perform write
+/// Write this IO queue's share of the Nvme's data blocks keeping up to owriteQueueDepth commands outstanding, each with its
+/// own data slot. The queues take alternate commands.
+int Control::nvmeWriteQueue(BUInt nvme, BUInt queue, BUInt32& errors){
+	int		s;
+	BUInt		numNvme = (onvmeNum == 2) ? 2 : 1;
+	BUInt		commandBlocks = owriteCommandBlocks;
+	BUInt		stream = (numNvme == 2) ? nvme : 0;
+	BUInt		depth = owriteQueueDepth;
+	BUInt		ids[NvmeMaxCommands];
+	BUInt		slots[NvmeMaxCommands];
+	BUInt32		nvmeBlocks = onumBlocks / numNvme;
+	BUInt32		numCommands;
+	BUInt32		in = queue - 1;
+	BUInt32		out = queue - 1;
+	BUInt32		num;
+	BUInt32		block;
+	BUInt32		v;
+	BUInt32*	d;
+	BUInt		slot;
+	BUInt		k;
+	BUInt		a;
+
+	numCommands = (nvmeBlocks + commandBlocks - 1) / commandBlocks;
+
+	while(out < numCommands){
+		// Fill data slots with the next blocks of the data ramp and submit their writes
+		while((in < numCommands) && (((in - out) / oioQueues) < depth)){
+			slot = (in / oioQueues) % depth;
+			block = in * commandBlocks;
+			num = ((nvmeBlocks - block) < commandBlocks) ? (nvmeBlocks - block) : commandBlocks;
+
+			if(s = nvmeSlotAllocate(slots[slot]))
+				return s;
+			d = nvmeSlotData(slots[slot]);
+
+			for(k = 0; k < num; k++){
+				v = ((block + k) * numNvme + stream) * (BlockSize / 4);
+				for(a = 0; a < BlockSize / 4; a++)
+					*d++ = v++;
+			}
 
-			setNvme(2);
+			if(s = nvmeRequestStartNvme(nvme, queue, 0x01, 1, nvmeSlotAddress(slots[slot]), (ostartBlock / numNvme + block) * 8, 0x00000000, (num * 8) - 1, ids[slot])){
+				nvmeSlotFree(slots[slot]);
+				return s;
+			}
+			in += oioQueues;
 		}
-	}
-	else {
-		for(block = 0; block < onumBlocks; block++){
-			for(a = 0; a < BlockSize/4; a++)
-				odataBlockMem[a] = data++;
 
-			nvmeRequest(1, 1, 0x01, 1, 0x01800000, (ostartBlock + block) * numBlocks, 0x00000000, numBlocks-1);	// Perform write
+		// Wait for the oldest write, freeing its slot
+		slot = (out / oioQueues) % depth;
+		if(s = nvmeRequestWait(ids[slot])){
+			printf("NvmeWrite: Error nvme: %u block: %u status: 0x%x\n", nvme, out * commandBlocks, s);
+			errors++;
 		}
+		nvmeSlotFree(slots[slot]);
+		out += oioQueues;
 	}
 
 	return 0;
 }
 
+/// Each Nvme is sent a data set management deallocate command with its range in a data slot. The Nvme's perform
+/// their deallocates concurrently.
 int Control::nvmeTrim(){
 	int	e = 0;
+	int	s;
+	BUInt	numNvme = (onvmeNum == 2) ? 2 : 1;
+	BUInt	nvme;
+	BUInt	slot;
+	BUInt32*	d;
 
 	printf("NvmeTrim: nvme: %u startBlock: %u numBlocks: %u\n", onvmeNum, ostartBlock, onumBlocks);
 	
 	if(e = nvmeInit())
 		return e;
 	
-	// Note this 
-	if(onvmeNum == 2){
-		memset(odataBlockMem, 0, sizeof(odataBlockMem));
-		odataBlockMem[0] = ((8 * 8) << 24) | 0x0634;	// Optimisation parameters
-		odataBlockMem[1] = (onumBlocks / 2) * 8;
-		odataBlockMem[2] = (ostartBlock / 2) * 8;
-		odataBlockMem[3] = 0;
-			
-		setNvme(0);
-		nvmeRequest(1, 1, 0x09, 1, 0x01E00000, 0, 0x06);	// Perform data set deallocate and optimise
-		setNvme(1);
-		nvmeRequest(1, 1, 0x09, 1, 0x01E00000, 0, 0x06);	// Perform data set deallocate and optimise
-		setNvme(2);
+	// The range list slots are freed as the commands complete
+	for(nvme = 0; nvme < numNvme; nvme++){
+		if(e = nvmeSlotAllocate(slot))
+			break;
+
+		d = nvmeSlotData(slot);
+		memset(d, 0, BlockSize);
+		d[0] = ((8 * 8) << 24) | 0x0634;	// Optimisation parameters
+		d[1] = (onumBlocks / numNvme) * 8;
+		d[2] = (ostartBlock / numNvme) * 8;
+		d[3] = 0;
+
+		// Perform data set deallocate and optimise
+		if(e = nvmeRequestSlot((numNvme == 2) ? nvme : ((onvmeNum == 1) ? 1 : 0), 1, 0x09, 1, slot, 0, 0x06, 0))
+			break;
 	}
-	else {
-		memset(odataBlockMem, 0, sizeof(odataBlockMem));
-		odataBlockMem[0] = ((8 * 8) << 24) | 0x0634;	// Optimisation parameters
-		odataBlockMem[1] = onumBlocks * 8;
-		odataBlockMem[2] = ostartBlock * 8;
-		odataBlockMem[3] = 0;
-			
-		nvmeRequest(1, 1, 0x09, 1, 0x01E00000, 0, 0x06);	// Perform data set deallocate and optimise
+
+	if(s = nvmeSlotsWait()){
+		printf("NvmeTrim: Error %d deallocate commands failed\n", s);
+		e = 1;
 	}
 	
-	return 0;
+	return e;
 }
 
+/// The write zeroes commands are spread over the IO queues, each with its own submitting thread
 int Control::nvmeTrim1(){
 	int	e = 0;
+	BUInt32	errors;
+
+	printf("NvmeTrim1: nvme: %u startBlock: %u numBlocks: %u ioQueues: %u\n", onvmeNum, ostartBlock, onumBlocks, oioQueues);
+	
+	if(e = nvmeInit())
+		return e;
+
+	e = nvmeQueueThreads(&Control::nvmeTrim1Queue, 0, errors);
+
+	return (e || errors) ? 1 : 0;
+}
+
+/// Trim this IO queue's share of the 32k 512 byte block chunks. The queues take alternate chunks.
+int Control::nvmeTrim1Queue(BUInt nvmeSel, BUInt queue, BUInt32& errors){
+	int	e = 0;
+	int	s;
 	BUInt32	b;
 	BUInt32	block;
 	BUInt	trimBlocks = 32768;
+	BUInt	nvme;
+	BUInt	numNvme = (nvmeSel == 2) ? 2 : 1;
+	BUInt	nvmeBlocks = onumBlocks / numNvme;
+	BUInt	depth = numNvme * (oqueueNum - 1);
+	BUInt	ids[NvmeMaxCommands];
+	BUInt	in = 0;
+	BUInt	out = 0;
+
+	if(depth > NvmeMaxCommands)
+		depth = NvmeMaxCommands;
+	
+	// The write zeroes commands are pipelined keeping the Nvme's submission queues full
+	for(b = (queue - 1) * (trimBlocks/8); !e && (b < nvmeBlocks); b += oioQueues * (trimBlocks/8)){
+		if((b + (trimBlocks/8)) > nvmeBlocks){
+			trimBlocks = 8 * (nvmeBlocks - b);
+		}
+		block = ostartBlock/numNvme + b;
+		
+		for(nvme = 0; nvme < numNvme; nvme++){
+			// Wait for the oldest command if the queues are full
+			if((in - out) == depth){
+				if(s = nvmeRequestWait(ids[out++ % NvmeMaxCommands])){
+					printf("NvmeTrim1: Error status: 0x%x\n", s);
+					errors++;
+				}
+			}
+			
+			// Perform trim of 32k 512 Byte blocks
+			if(s = nvmeRequestStartNvme((numNvme == 2) ? nvme : ((nvmeSel == 1) ? 1 : 0), queue, 0x08, 1, 0x00000000, block * 8, 0x00000000, (1 << 25) | trimBlocks-1, ids[in % NvmeMaxCommands])){
+				e = s;
+				break;
+			}
+			in++;
+		}
+	}
+	
+	while(out != in){
+		if(s = nvmeRequestWait(ids[out++ % NvmeMaxCommands])){
+			printf("NvmeTrim1: Error status: 0x%x\n", s);
+			errors++;
+		}
+	}
+	
+	return e;
+}
 
-	printf("NvmeTrim1: nvme: %u startBlock: %u numBlocks: %u\n", onvmeNum, ostartBlock, onumBlocks);
+/// This reads the blocks using host issued Nvme read commands. Each IO queue has its own thread which keeps a read
+/// outstanding in each of its data slots and validates them in order as the reads complete.
+int Control::nvmeVerify(){
+	int		e = 0;
+	BUInt32		numVerify = (onumBlocks + overifyStride - 1) / overifyStride;
+	BUInt32		errors;
+	double		ts;
+	double		te;
+	double		r;
+
+	printf("NvmeVerify: nvme: %u startBlock: %u numBlocks: %u stride: %u ioQueues: %u\n", onvmeNum, ostartBlock, onumBlocks, overifyStride, oioQueues);
 	
 	if(e = nvmeInit())
 		return e;
+
+	validateLayout(ostartBlock, onvmeNum);
+	ts = getTime();
+	e = nvmeQueueThreads(&Control::nvmeVerifyQueue, 0, errors);
+	te = getTime();
+
+	if(!e && ovalidate)
+		e = nvmeVerifyUnaligned(errors);
+
+	r = ((double(BlockSize) * numVerify) / (te - ts));
+	printf("NvmeVerify: blocks: %u errors: %u rate: %f MBytes/s\n", numVerify, errors, r / (1024 * 1024));
 	
-	// Note this 
-	if(onvmeNum == 2){
-		for(b = 0; b < onumBlocks/2; b += (trimBlocks/8)){
-			if((b + (trimBlocks/8)) > onumBlocks/2){
-				trimBlocks = 8 * (onumBlocks/2 - b);
-			}
-			block = ostartBlock/2 + b;
+	return (e || errors) ? 1 : 0;
+}
+
+/// Verify this IO queue's share of the blocks. The queues take alternate blocks.
+int Control::nvmeVerifyQueue(BUInt nvmeSel, BUInt queue, BUInt32& errors){
+	int		s;
+	BUInt		numNvme = (nvmeSel == 2) ? 2 : 1;
+	BUInt		numSlots = nvmeSlotsNum() / oioQueues;
+	BUInt		ids[NvmeSlotsMax];
+	BUInt		slots[NvmeSlotsMax];
+	BUInt32		numVerify = (onumBlocks + overifyStride - 1) / overifyStride;
+	BUInt32		in = queue - 1;
+	BUInt32		out = queue - 1;
+	BUInt32		block;
+	BUInt32		nvmeBlock;
+	BUInt		nvme;
+	BUInt		slot;
+
+	if(numSlots > (numNvme * (oqueueNum - 1)))
+		numSlots = numNvme * (oqueueNum - 1);
+	if(numSlots < 1)
+		numSlots = 1;
+
+	while(out < numVerify){
+		// Keep a read outstanding in each slot
+		while((in < numVerify) && (((in - out) / oioQueues) < numSlots)){
+			nvmeVerifyBlock(nvmeSel, in, block, nvme, nvmeBlock);
+			slot = (in / oioQueues) % numSlots;
 			
-			// Perform trim of 32k 512 Byte blocks
-			setNvme(0);
-			if(e = nvmeRequest(1, 1, 0x08, 1, 0x00000000, block * 8, 0x00000000, (1 << 25) | trimBlocks-1))
-				return e;
+			if(s = nvmeSlotAllocate(slots[slot]))
+				return s;
+			if(s = nvmeRequestStartNvme(nvme, queue, 0x02, 1, nvmeSlotAddress(slots[slot]), nvmeBlock * 8, 0x00000000, 7, ids[slot])){
+				nvmeSlotFree(slots[slot]);
+				return s;
+			}
+			in += oioQueues;
+		}
 
-			setNvme(1);
-			if(e = nvmeRequest(1, 1, 0x08, 1, 0x00000000, block * 8, 0x00000000, (1 << 25) | trimBlocks-1))
-				return e;
+		// Validate the oldest slot
+		nvmeVerifyBlock(nvmeSel, out, block, nvme, nvmeBlock);
+		slot = (out / oioQueues) % numSlots;
+		if(s = nvmeRequestWait(ids[slot])){
+			printf("NvmeVerify: Error reading block: %u status: 0x%x\n", block, s);
+			errors++;
 		}
-		setNvme(2);
+		else if(ovalidate){
+			if(validateBlock(block, olayout.rampBlock(nvme, nvmeBlock), nvmeSlotData(slots[slot]))){
+				printf("Error in block: %u\n", block);
+				dumpDataBlock(nvmeSlotData(slots[slot]), (overbose > 1)?1:0);
+				errors++;
+			}
+		}
+		nvmeSlotFree(slots[slot]);
+		out += oioQueues;
+		
+		if(overbose && (queue == 1) && (((out / oioQueues) % 10000) == 0))
+			printf("Verified: %u blocks\n", out);
+	}
+
+	return 0;
+}
+
+/// With two Nvme's the verify indexes alternate between them and the stride applies to each Nvme's blocks, so that
+/// both Nvme's are checked whatever the stride.
+void Control::nvmeVerifyBlock(BUInt nvmeSel, BUInt32 index, BUInt32& block, BUInt& nvme, BUInt32& nvmeBlock){
+	if(nvmeSel == 2){
+		nvme = index % 2;
+		nvmeBlock = ostartBlock / 2 + (index / 2) * overifyStride;
+		block = (index / 2) * overifyStride * 2 + nvme;
 	}
 	else {
-		for(b = 0; b < onumBlocks; b += (trimBlocks/8)){
-			if((b + (trimBlocks/8)) > onumBlocks){
-				trimBlocks = 8 * (onumBlocks - b);
+		nvme = (nvmeSel == 1) ? 1 : 0;
+		nvmeBlock = ostartBlock + index * overifyStride;
+		block = index * overifyStride;
+	}
+}
+
+/// Read the first blocks to a data slot at a 512 byte offset. The 4k read spans two memory pages, using PRP2, and the
+/// 8k read spans three, using a PRP list. On Nvme's that support SGLs an 8k read is also scattered over two slots,
+/// using an SGL segment of two data block descriptors.
+int Control::nvmeVerifyUnaligned(BUInt32& errors){
+	int		s;
+	BUInt		numNvme = (onvmeNum == 2) ? 2 : 1;
+	BUInt		nvme = (onvmeNum == 1) ? 1 : 0;
+	BUInt32		nvmeBlock = ostartBlock / numNvme;
+	BUInt		slot;
+	BUInt		slots[2];
+	BUInt		offsets[2] = { 512, 0 };
+	NvmeSgl		sgl[2];
+	BUInt		id;
+	BUInt		n;
+	BUInt		b;
+
+	for(n = 1; n <= 2; n++){
+		if(s = nvmeSlotAllocate(slot))
+			return s;
+
+		memset(nvmeSlotData(slot), 0x01, n * BlockSize + 512);
+		if(s = nvmeRequestStartNvme(nvme, 1, 0x02, 1, nvmeSlotAddress(slot) + 512, nvmeBlock * 8, 0x00000000, (n * 8) - 1, id)){
+			nvmeSlotFree(slot);
+			return s;
+		}
+		if(s = nvmeRequestWait(id)){
+			printf("NvmeVerify: Error reading unaligned blocks: %u status: 0x%x\n", n, s);
+			errors++;
+		}
+		else {
+			for(b = 0; b < n; b++){
+				if(validateBlock(ostartBlock + b * numNvme, olayout.rampBlock(nvme, nvmeBlock + b), &nvmeSlotData(slot)[(512 + b * BlockSize) / 4])){
+					printf("Error in unaligned read of block: %u\n", ostartBlock + b * numNvme);
+					errors++;
+				}
 			}
-			block = ostartBlock + b;
-			
-			// Perform trim of 32k 512 Byte blocks
-			if(e = nvmeRequest(1, 1, 0x08, 1, 0x00000000, block * 8, 0x00000000, (1 << 25) | trimBlocks-1))
-				return e;
 		}
+		nvmeSlotFree(slot);
 	}
-	
+
+	if(!nvmeSglSupported(nvme))
+		return 0;
+
+	for(b = 0; b < 2; b++){
+		if(s = nvmeSlotAllocate(slots[b])){
+			if(b)
+				nvmeSlotFree(slots[0]);
+			return s;
+		}
+		memset(nvmeSlotData(slots[b]), 0x01, BlockSize + 512);
+		sgl[b] = NvmeSgl(nvmeSlotAddress(slots[b]) + offsets[b], BlockSize);
+	}
+
+	if(s = nvmeRequestStartSgl(nvme, 1, 0x02, 1, sgl, 2, nvmeBlock * 8, 0x00000000, 15, id)){
+		nvmeSlotFree(slots[0]);
+		nvmeSlotFree(slots[1]);
+		return s;
+	}
+	if(s = nvmeRequestWait(id)){
+		printf("NvmeVerify: Error reading scattered blocks status: 0x%x\n", s);
+		errors++;
+	}
+	else {
+		for(b = 0; b < 2; b++){
+			if(validateBlock(ostartBlock + b * numNvme, olayout.rampBlock(nvme, nvmeBlock + b), &nvmeSlotData(slots[b])[offsets[b] / 4])){
+				printf("Error in scattered read of block: %u\n", ostartBlock + b * numNvme);
+				errors++;
+			}
+		}
+	}
+	nvmeSlotFree(slots[0]);
+	nvmeSlotFree(slots[1]);
+
 	return 0;
 }
 
@@ -978,37 +1703,40 @@ BUInt64 get64(void* data, BUInt address){
 }
 
 int Control::nvmeInfoDevice(int device){
+	BUInt32		regs[2] = { NvmeRegCapLow, NvmeRegCapHigh };
+	BUInt32		v[2];
 	BUInt32		v1;
 	BUInt32		v2;
 	BUInt32*	p32;
 	BUInt64*	p64;
+	BUInt32*	info = nvmeIdentifyData(device);
 	
-	setNvme(device);
 	printf("Nvme device:        %d\n", device);
 
-	readNvmeReg32(NvmeRegCapLow, v1);
-	readNvmeReg32(NvmeRegCapHigh, v2);
+	readNvmeRegs(2, regs, v, device);
+	v1 = v[0];
+	v2 = v[1];
 	
 	printf("Capabilitieslow:      0x%8.8x\n", v1);
 	printf("CapabilitiesHigh:     0x%8.8x\n", v2);
 	printf("Doorbell stride:      %u\n", BUInt(pow(2, 2 + (v2 & 0x0F))));
 	printf("MaxPageSize:          %u\n", BUInt(pow(2, (12 + ((v2 >> 20) & 0x0F)))));
 	
-	nvmeRequest(1, 0, 0x06, 1, 0x01E00000, 0x00000000);	// Namespace info
-	//bhd32(odataBlockMem, 64);
-
-	printf("NamespaceSize:        %lu\n", get64(odataBlockMem, 0));
-	printf("NamespaceCapacity:    %lu\n", get64(odataBlockMem, 8));
-	printf("NamespaceAllocated:   %lu\n", get64(odataBlockMem, 16));
-	printf("NamespaceLbaFormat:   %u\n", get8(odataBlockMem, 26));
-	printf("NamespaceLbaFormat0  :0x%8.8x\n", get32(odataBlockMem, 128));
-	printf("NamespaceLbaSize0:    %u\n", BUInt(pow(2, ((get32(odataBlockMem, 128) >> 16) & 0xFF))));
-	printf("NamespaceLbaFormat1:  0x%8.8x\n", get32(odataBlockMem, 132));
-	printf("NamespaceLbaSize1:    %u\n", BUInt(pow(2, ((get32(odataBlockMem, 132) >> 16) & 0xFF))));
-	printf("NamespaceLbaFormat2:  0x%8.8x\n", get32(odataBlockMem, 136));
-	printf("NamespaceLbaSize2:    %u\n", BUInt(pow(2, ((get32(odataBlockMem, 136) >> 16) & 0xFF))));
-	printf("NamespaceLbaFormat3:  0x%8.8x\n", get32(odataBlockMem, 140));
-	printf("NamespaceLbaSize3:    %u\n", BUInt(pow(2, ((get32(odataBlockMem, 140) >> 16) & 0xFF))));
+	nvmeRequest(1, 0, 0x06, 1, nvmeIdentifyAddress(device), 0x00000000, 0, 0, device);	// Namespace info
+	//bhd32(info, 64);
+
+	printf("NamespaceSize:        %lu\n", get64(info, 0));
+	printf("NamespaceCapacity:    %lu\n", get64(info, 8));
+	printf("NamespaceAllocated:   %lu\n", get64(info, 16));
+	printf("NamespaceLbaFormat:   %u\n", get8(info, 26));
+	printf("NamespaceLbaFormat0  :0x%8.8x\n", get32(info, 128));
+	printf("NamespaceLbaSize0:    %u\n", BUInt(pow(2, ((get32(info, 128) >> 16) & 0xFF))));
+	printf("NamespaceLbaFormat1:  0x%8.8x\n", get32(info, 132));
+	printf("NamespaceLbaSize1:    %u\n", BUInt(pow(2, ((get32(info, 132) >> 16) & 0xFF))));
+	printf("NamespaceLbaFormat2:  0x%8.8x\n", get32(info, 136));
+	printf("NamespaceLbaSize2:    %u\n", BUInt(pow(2, ((get32(info, 136) >> 16) & 0xFF))));
+	printf("NamespaceLbaFormat3:  0x%8.8x\n", get32(info, 140));
+	printf("NamespaceLbaSize3:    %u\n", BUInt(pow(2, ((get32(info, 140) >> 16) & 0xFF))));
 
 	return 0;	
 }
@@ -1308,6 +2036,53 @@ int Control::test10(){
 	return 0;
 }
 
+int Control::test11(){
+	NvmeRequestPacket	packet;
+	BUInt32			block;
+	BUInt32			nvme;
+	BUInt32			w;
+	BUInt32			a;
+	BUInt32			v = 0;
+	double			ts;
+	double			te;
+	double			r;
+
+	printf("Test11: Host packet processing rate. Use with the loopback transport.\n");
+
+	start();
+
+	oreadNumBlocks = onumBlocks;
+	validateLayout(0, onvmeNum);
+	readPipelineStart(0);
+
+	// Send data packets as the NvmeRead engine would. These are looped back and processed by nvmeDataPacket().
+	ts = getTime();
+	for(block = 0; block < onumBlocks; block++){
+		nvme = (onvmeNum == 2) ? (block & 1) : onvmeNum;
+		for(a = 0; a < BlockSize; a += (PcieMaxPayloadSize * 4)){
+			packet.request = 1;
+			packet.address = (nvme ? 0x11F00000 : 0x01F00000) | ((block * BlockSize + a) & 0x000FFFFF);
+			packet.numWords = PcieMaxPayloadSize;
+			for(w = 0; w < PcieMaxPayloadSize; w++)
+				packet.data[w] = v++;
+
+			if(packetSend(packet)){
+				printf("Packet send error\n");
+				return 1;
+			}
+		}
+	}
+
+	oreadComplete.wait();
+	te = getTime();
+	readPipelineStop();
+
+	r = ((double(BlockSize) * onumBlocks) / (te - ts));
+	printf("Test11: rate: %f MBytes/s %f packets/s\n", r / (1024 * 1024), (onumBlocks * BlockSize / (PcieMaxPayloadSize * 4)) / (te - ts));
+
+	return 0;
+}
+
 int Control::test_misc(){
 	BUInt32	address = 0;
 	BUInt32	data[8];
@@ -1360,20 +2135,42 @@ void Control::uprintf(const char* fmt, ...){
 	}
 }
 
-int Control::validateBlock(BUInt32 blockNum, void* data){
+/// The validation of an operation's blocks uses the layout of the capture being validated. This is the operation's own
+/// start block and Nvme's unless set otherwise, such as when reading part of a capture or one Nvme of a dual capture.
+void Control::validateLayout(BUInt32 startBlock, BUInt nvme){
+	if(ocaptureStart != CaptureDefault)
+		startBlock = ocaptureStart;
+	if(ocaptureNvme != CaptureDefault)
+		nvme = ocaptureNvme;
+
+	olayout.set(startBlock, nvme);
+	uprintf("Validate: capture startBlock: %u numNvme: %u\n", olayout.ostartBlock, olayout.onumNvme);
+}
+
+int Control::validateBlock(BUInt32 blockNum, BUInt32 rampBlock, void* data){
 	BUInt32*	d = (BUInt32*)data;
+	BUInt32		start = rampBlock * (BlockSize / 4);	// The data is a 32 bit word ramp, so the start word is calculated in words to wrap correctly
 	BUInt		w;
+	BUInt		n;
 	
-	for(w = 0; w < BlockSize / 4; w++){
-		if(d[w] != ((blockNum * BlockSize / 4) + w)){
-			printf("Validate Error: Block: %u Position: %u 0x%8.8x !- 0x%8.8x\n", blockNum, w, d[w], ((blockNum * BlockSize / 4) + w));
-			return 1;
-		}
+	if(n = testDataValidate(d, start, BlockSize / 4, w)){
+		printf("Validate Error: Block: %u RampBlock: %u Position: %u 0x%8.8x !- 0x%8.8x Errors: %u\n", blockNum, rampBlock, w, d[w], start + w, n);
+		return 1;
 	}
 	
 	return 0;
 }
 
+void Control::validateError(BUInt32 blockNum, BUInt32 rampBlock, void* data, TestDataErrors& errors){
+	BUInt32*	d = (BUInt32*)data;
+	BUInt32		start = rampBlock * (BlockSize / 4);
+
+	if(errors.misplaced)
+		printf("Validate Error: Block: %u RampBlock: %u Misplaced by: %d blocks\n", blockNum, rampBlock, errors.offset);
+	else
+		printf("Validate Error: Block: %u RampBlock: %u Position: %u 0x%8.8x !- 0x%8.8x Errors: %u\n", blockNum, rampBlock, errors.firstError, d[errors.firstError], start + errors.firstError, errors.errors);
+}
+
 void Control::dumpDataBlock(void* data, Bool full){
 	char*	d = (char*)data;
 	
@@ -1390,15 +2187,20 @@ void Control::dumpDataBlock(void* data, Bool full){
 void Control::dumpNvmeRegisters(){
 	int	e;
 	BUInt	a;
-	BUInt32	data;
+	BUInt32	addresses[16];
+	BUInt32	data[16];
 	
 	printf("Nvme regs\n");
+	for(a = 0; a < 16; a++)
+		addresses[a] = a * 4;
+
+	if(e = readNvmeRegs(16, addresses, data)){
+		printf("Read register Error: %d\n", e);
+		return;
+	}
+
 	for(a = 0; a < 16; a++){
-		if(e = readNvmeReg32(a * 4, data)){
-			printf("Read register Error: %d\n", e);
-			return;
-		}
-		printf("Reg: 0x%3.3x 0x%8.8x\n", a * 4, data);
+		printf("Reg: 0x%3.3x 0x%8.8x\n", a * 4, data[a]);
 	}
 }
 
@@ -1411,13 +2213,37 @@ void usage(void) {
 	fprintf(stderr, " -m                    - Just return software readable data.\n");
 	fprintf(stderr, " -l                    - List tests\n");
 	fprintf(stderr, " -no-reset || -nr      - Disable reset/config on startup\n");
-	fprintf(stderr, " -no-validate || -nv   - Disable data validation on read's\n");
+	fprintf(stderr, " -no-validate || -nv   - Disable data validation on read's. Block sequence errors are then reported but do not fail the read\n");
 	fprintf(stderr, " -d <nvmeNum>          - Nvme to operate on: 0: Nvme0, 1: Nvme1, 2: Both Nvme's (default)\n");
 	fprintf(stderr, " -s <block>            - The starting 4k block number (default is 0)\n");
 	fprintf(stderr, " -n <num>              - The number of 4k blocks to read/write or trim (default is 2)\n");
 	fprintf(stderr, " -rs <block>           - The starting 4k block number for reads in captureAndRead (default is 0)\n");
 	fprintf(stderr, " -rn <num>             - The number of 4k blocks for reads in captureAndRead (default is 2)\n");
+	fprintf(stderr, " -rw <num>             - The number of 4k blocks per NvmeRead engine request in read and captureAndRead, bounded by the 4MB read fifos (default is half the fifo)\n");
+	fprintf(stderr, " -vk                   - Keep reading after validation errors, printing error statistics at the end of the read\n");
+	fprintf(stderr, " -vn <num>             - Validate every num'th block of reads (default is 1)\n");
+	fprintf(stderr, " -vp <percent>         - Validate a pseudo random percentage of the blocks of reads (default is 100)\n");
+	fprintf(stderr, " -vseed <seed>         - The seed for the pseudo random selection of blocks to validate (default is 0)\n");
+	fprintf(stderr, " -vl                   - Validate only the first and last 64 byte cache lines of the blocks of reads\n");
+	fprintf(stderr, " -vc <block>           - The start block of the capture being validated, for reads of part of a capture (default is the start block, -s)\n");
+	fprintf(stderr, " -vd <nvmeNum>         - The Nvme's the capture being validated was written to, for reads of one Nvme of a dual capture (default is -d)\n");
+	fprintf(stderr, " -vw <num>             - The number of validation worker threads in the read data pipeline, up to 8 (default is 2)\n");
+	fprintf(stderr, " -vs <num>             - Verify only every num'th block of each Nvme in verify, for quick checks of a whole drive (default is 1)\n");
+	fprintf(stderr, " -wb <num>             - The number of 4k blocks per host write command in write, limited by the Nvme's MDTS and the 128k data slot size (default is 2)\n");
+	fprintf(stderr, " -wq <num>             - The number of host write commands outstanding per Nvme in write (default is 16, limited by the queue and data slots)\n");
 	fprintf(stderr, " -o <filename>         - The filename for output data.\n");
+	fprintf(stderr, " -t <transport>        - The transport to use: bfpga: The FPGA via the bfpga driver (default), loopback: In-process loopback, sim: Software model of the FPGA system\n");
+	fprintf(stderr, " -ds <num>             - The number of 128k host data slots used by host issued IO commands, up to 48 (default is 32)\n");
+	fprintf(stderr, " -qp <num>             - The number of IO queue pairs per Nvme, each with its own host thread in write, trim1 and verify, up to 3 (default is 2)\n");
+	fprintf(stderr, " -hp                   - Use huge pages for the host data slots when available\n");
+	fprintf(stderr, " -b <bytes>            - Batch packets sent to the FPGA into transfers of up to this size, 0 disables (default is 0)\n");
+	fprintf(stderr, " -sw <MBytes/s>        - The sim transport's per Nvme write rate (default is 2000)\n");
+	fprintf(stderr, " -sr <MBytes/s>        - The sim transport's per Nvme read rate, 0 is unlimited (default is 0)\n");
+	fprintf(stderr, " -sp <params>          - The sim transport's Nvme service time profile as name=value,... with names:\n");
+	fprintf(stderr, "                         write, read (MBytes/s), latency (us), gcInterval (MBytes), gcStall (ms),\n");
+	fprintf(stderr, "                         trimRate (MBytes/s), trimRecovery (s), trimRecoveryRate (fraction of write rate)\n");
+	fprintf(stderr, "                         and sgl (1: SGL data transfers supported, 0: PRP only)\n");
+	fprintf(stderr, " -sf <filename>        - The sim transport's state file, keeping the Nvme's state between runs\n");
 }
 
 static struct option options[] = {
@@ -1435,7 +2261,28 @@ static struct option options[] = {
 		{ "n",			1, NULL, 0 },
 		{ "rs",			1, NULL, 0 },
 		{ "rn",			1, NULL, 0 },
+		{ "vs",			1, NULL, 0 },
+		{ "rw",			1, NULL, 0 },
+		{ "vk",			0, NULL, 0 },
+		{ "vn",			1, NULL, 0 },
+		{ "vp",			1, NULL, 0 },
+		{ "vseed",		1, NULL, 0 },
+		{ "vl",			0, NULL, 0 },
+		{ "vc",			1, NULL, 0 },
+		{ "vd",			1, NULL, 0 },
+		{ "vw",			1, NULL, 0 },
+		{ "wb",			1, NULL, 0 },
+		{ "wq",			1, NULL, 0 },
 		{ "o",			1, NULL, 0 },
+		{ "t",			1, NULL, 0 },
+		{ "b",			1, NULL, 0 },
+		{ "ds",			1, NULL, 0 },
+		{ "qp",			1, NULL, 0 },
+		{ "hp",			0, NULL, 0 },
+		{ "sw",			1, NULL, 0 },
+		{ "sr",			1, NULL, 0 },
+		{ "sp",			1, NULL, 0 },
+		{ "sf",			1, NULL, 0 },
 		{ 0,0,0,0 }
 };
 int main(int argc, char** argv){
@@ -1446,6 +2293,14 @@ int main(int argc, char** argv){
 	Control		control;
 	Bool		listTests = 0;
 	const char*	test = 0;
+	const char*	transport = "bfpga";
+	double		simWriteRate = 2000;
+	double		simReadRate = 0;
+	const char*	simProfile = 0;
+	const char*	simStateFile = 0;
+	BUInt		dataSlots = 32;
+	Bool		hugePages = 0;
+	NvmeStorageSim*	sim;
 
 	while((c = getopt_long_only(argc, argv, "", options, &optIndex)) == 0){
 		s = options[optIndex].name;
@@ -1483,9 +2338,72 @@ int main(int argc, char** argv){
 		else if(!strcmp(s, "rn")){
 			control.setReadNumBlocks(strtoul(optarg, 0, 0));
 		}
+		else if(!strcmp(s, "rw")){
+			control.setReadWindow(strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "vk")){
+			control.ovalidateContinue = 1;
+		}
+		else if(!strcmp(s, "vn")){
+			control.osampling.set(strtoul(optarg, 0, 0), control.osampling.ofraction, control.osampling.oseed, control.osampling.oedges);
+		}
+		else if(!strcmp(s, "vp")){
+			control.osampling.set(control.osampling.oevery, atof(optarg) / 100, control.osampling.oseed, control.osampling.oedges);
+		}
+		else if(!strcmp(s, "vseed")){
+			control.osampling.set(control.osampling.oevery, control.osampling.ofraction, strtoul(optarg, 0, 0), control.osampling.oedges);
+		}
+		else if(!strcmp(s, "vl")){
+			control.osampling.set(control.osampling.oevery, control.osampling.ofraction, control.osampling.oseed, 1);
+		}
+		else if(!strcmp(s, "vc")){
+			control.setCapture(strtoul(optarg, 0, 0), control.ocaptureNvme);
+		}
+		else if(!strcmp(s, "vd")){
+			control.setCapture(control.ocaptureStart, strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "vw")){
+			control.setValidateWorkers(strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "vs")){
+			control.setVerifyStride(strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "wb")){
+			control.setWrite(strtoul(optarg, 0, 0), control.owriteDepth);
+		}
+		else if(!strcmp(s, "wq")){
+			control.setWrite(control.owriteBlocks, strtoul(optarg, 0, 0));
+		}
 		else if(!strcmp(s, "o")){
 			control.setFilename(optarg);
 		}
+		else if(!strcmp(s, "t")){
+			transport = optarg;
+		}
+		else if(!strcmp(s, "b")){
+			control.setSendBatch(strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "ds")){
+			dataSlots = strtoul(optarg, 0, 0);
+		}
+		else if(!strcmp(s, "qp")){
+			control.setIoQueues(strtoul(optarg, 0, 0));
+		}
+		else if(!strcmp(s, "hp")){
+			hugePages = 1;
+		}
+		else if(!strcmp(s, "sw")){
+			simWriteRate = atof(optarg);
+		}
+		else if(!strcmp(s, "sr")){
+			simReadRate = atof(optarg);
+		}
+		else if(!strcmp(s, "sp")){
+			simProfile = optarg;
+		}
+		else if(!strcmp(s, "sf")){
+			simStateFile = optarg;
+		}
 		else {
 			fprintf(stderr, "Error: No option: %s\n", s);
 			usage();
@@ -1496,6 +2414,30 @@ int main(int argc, char** argv){
 		usage();
 		return 1;
 	}
+
+	if(!strcmp(transport, "bfpga")){
+		control.setTransport(new NvmeTransportBfpga());
+	}
+	else if(!strcmp(transport, "loopback")){
+		control.setTransport(new NvmeTransportLoopback());
+	}
+	else if(!strcmp(transport, "sim")){
+		sim = new NvmeStorageSim();
+		sim->setWriteRate(simWriteRate);
+		sim->setReadRate(simReadRate);
+		if(simProfile && sim->setProfile(simProfile)){
+			delete sim;
+			usage();
+			return 1;
+		}
+		sim->setStateFile(simStateFile);
+		control.setTransport(new NvmeTransportLoopback(sim));
+	}
+	else {
+		fprintf(stderr, "Error: No such transport: %s\n", transport);
+		usage();
+		return 1;
+	}
 	
 	if(control.ofilename){
 		if(! (control.ofile = fopen(control.ofilename, "w"))){
@@ -1523,6 +2465,7 @@ int main(int argc, char** argv){
 		printf("write: Write data to Nvme's\n");
 		printf("trim: Trim/deallocate blocks on Nvme's\n");
 		printf("trim1: Trim/deallocate blocks on Nvme's using Write0 command\n");
+		printf("verify: Verify blocks on Nvme's using host reads with many outstanding\n");
 		printf("regs: Display NvmeStorage register values\n");
 		printf("info: Display some info on the NVMe drives\n");
 		printf("test*: Collection of misc programmed tests. See source code.\n");
@@ -1535,6 +2478,7 @@ int main(int argc, char** argv){
 		}
 		test = argv[optind++];
 
+		control.setDataSlots(dataSlots, hugePages);
 		if(err = control.init()){
 			return err;
 		}
@@ -1560,6 +2504,9 @@ int main(int argc, char** argv){
 		else if(!strcmp(test, "trim1")){
 			err = control.nvmeTrim1();
 		}
+		else if(!strcmp(test, "verify")){
+			err = control.nvmeVerify();
+		}
 		else if(!strcmp(test, "regs")){
 			err = control.nvmeRegs();
 		}
@@ -1598,6 +2545,9 @@ int main(int argc, char** argv){
 		else if(!strcmp(test, "test10")){
 			err = control.test10();
 		}
+		else if(!strcmp(test, "test11")){
+			err = control.test11();
+		}
 		else if(!strcmp(test, "test_misc")){
 			err = control.test_misc();
 		}